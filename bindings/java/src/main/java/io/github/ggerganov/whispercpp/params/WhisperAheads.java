@@ -0,0 +1,60 @@
+package io.github.ggerganov.whispercpp.params;
+
+import com.sun.jna.IntegerType;
+import com.sun.jna.Memory;
+import com.sun.jna.Native;
+import com.sun.jna.Pointer;
+import com.sun.jna.Structure;
+
+import java.util.Arrays;
+import java.util.List;
+
+/** Custom alignment heads, see whisper_aheads in whisper.h */
+public class WhisperAheads extends Structure {
+
+    /** size_t */
+    public static class SizeT extends IntegerType {
+        public SizeT() {
+            this(0);
+        }
+
+        public SizeT(long value) {
+            super(Native.SIZE_T_SIZE, value, true);
+        }
+    }
+
+    /** Number of heads (default = 0) */
+    public SizeT n_heads;
+
+    /** Array of n_heads whisper_ahead { int n_text_layer; int n_head; } (default = null) */
+    public Pointer heads;
+
+    // keeps the native array alive as long as the structure
+    private Memory headsMemory;
+
+    /**
+     * Set the alignment heads - heads[i] is { n_text_layer, n_head } of head i
+     */
+    public void setHeads(int[][] aheads) {
+        if (aheads.length == 0) {
+            headsMemory = null;
+            heads = null;
+            n_heads = new SizeT(0);
+            return;
+        }
+
+        headsMemory = new Memory(aheads.length * 2L * 4);
+        for (int i = 0; i < aheads.length; i++) {
+            headsMemory.setInt(i * 8L,     aheads[i][0]);
+            headsMemory.setInt(i * 8L + 4, aheads[i][1]);
+        }
+
+        heads = headsMemory;
+        n_heads = new SizeT(aheads.length);
+    }
+
+    @Override
+    protected List<String> getFieldOrder() {
+        return Arrays.asList("n_heads", "heads");
+    }
+}
@@ -0,0 +1,24 @@
+package io.github.ggerganov.whispercpp.params;
+
+/** The cross-attention heads of the text decoder used for the DTW token timestamps */
+public enum WhisperAlignmentHeadsPreset {
+    WHISPER_AHEADS_NONE,
+
+    /** all heads of the dtw_n_top top-most text layers */
+    WHISPER_AHEADS_N_TOP_MOST,
+
+    /** the heads in dtw_aheads */
+    WHISPER_AHEADS_CUSTOM,
+
+    WHISPER_AHEADS_TINY_EN,
+    WHISPER_AHEADS_TINY,
+    WHISPER_AHEADS_BASE_EN,
+    WHISPER_AHEADS_BASE,
+    WHISPER_AHEADS_SMALL_EN,
+    WHISPER_AHEADS_SMALL,
+    WHISPER_AHEADS_MEDIUM_EN,
+    WHISPER_AHEADS_MEDIUM,
+    WHISPER_AHEADS_LARGE_V1,
+    WHISPER_AHEADS_LARGE_V2,
+    WHISPER_AHEADS_LARGE_V3
+}
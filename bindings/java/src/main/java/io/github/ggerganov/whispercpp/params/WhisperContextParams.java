@@ -24,8 +24,40 @@ public class WhisperContextParams extends Structure {
         use_gpu = enable ? CBool.TRUE : CBool.FALSE;
     }
 
+    /** How long (in microseconds) the idle compute threads busy-wait for new work before they sleep (default = 1000) */
+    public int threadpool_spin_us;
+
+    /** [EXPERIMENTAL] Token-level timestamps with dynamic time warping (default = false) */
+    public CBool dtw_token_timestamps;
+
+    /** [EXPERIMENTAL] Token-level timestamps with dynamic time warping (default = false) */
+    public void dtwTokenTimestamps(boolean enable) {
+        dtw_token_timestamps = enable ? CBool.TRUE : CBool.FALSE;
+    }
+
+    /** Alignment heads used for the DTW, see WhisperAlignmentHeadsPreset (default = WHISPER_AHEADS_NONE) */
+    public int dtw_aheads_preset;
+
+    /** Alignment heads used for the DTW (default = WHISPER_AHEADS_NONE) */
+    public void dtwAheadsPreset(WhisperAlignmentHeadsPreset preset) {
+        dtw_aheads_preset = preset.ordinal();
+    }
+
+    /** Number of top-most text layers for WHISPER_AHEADS_N_TOP_MOST, <= 0 for the top half of the layers (default = -1) */
+    public int dtw_n_top;
+
+    /** Alignment heads for WHISPER_AHEADS_CUSTOM (default = none) */
+    public WhisperAheads dtw_aheads;
+
+    /** Alignment heads for WHISPER_AHEADS_CUSTOM - aheads[i] is { n_text_layer, n_head } of head i */
+    public void dtwAheads(int[][] aheads) {
+        dtw_aheads_preset = WhisperAlignmentHeadsPreset.WHISPER_AHEADS_CUSTOM.ordinal();
+        dtw_aheads.setHeads(aheads);
+    }
+
     @Override
     protected List<String> getFieldOrder() {
-        return Arrays.asList("use_gpu");
+        return Arrays.asList("use_gpu", "threadpool_spin_us",
+                "dtw_token_timestamps", "dtw_aheads_preset", "dtw_n_top", "dtw_aheads");
     }
 }
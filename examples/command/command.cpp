@@ -289,6 +289,16 @@ int process_command_list(struct whisper_context * ctx, audio_async &audio, const
         max_len = std::max(max_len, (int) cmd.size());
     }
 
+    // only the logits of the command tokens are needed
+    {
+        std::vector<whisper_token> vocab_subset;
+        for (const auto & tokens : allowed_tokens) {
+            vocab_subset.insert(vocab_subset.end(), tokens.begin(), tokens.end());
+        }
+
+        whisper_set_vocab_subset(ctx, vocab_subset.data(), vocab_subset.size());
+    }
+
     fprintf(stderr, "%s: allowed commands [ tokens ]:\n", __func__);
     fprintf(stderr, "\n");
     for (int i = 0; i < (int) allowed_commands.size(); ++i) {
@@ -693,7 +703,7 @@ int main(int argc, char ** argv) {
 
     // whisper init
 
-    struct whisper_context_params cparams;
+    struct whisper_context_params cparams = whisper_context_default_params();
     cparams.use_gpu = params.use_gpu;
 
     struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
@@ -56,6 +56,7 @@ void replace_all(std::string & s, const std::string & search, const std::string
 struct whisper_params {
     int32_t n_threads    = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t n_processors =  1;
+    int32_t spin_us      = whisper_context_default_params().threadpool_spin_us;
     int32_t offset_t_ms  =  0;
     int32_t offset_n     =  0;
     int32_t duration_ms  =  0;
@@ -64,19 +65,26 @@ struct whisper_params {
     int32_t max_len      =  0;
     int32_t best_of      = whisper_full_default_params(WHISPER_SAMPLING_GREEDY).greedy.best_of;
     int32_t beam_size    = whisper_full_default_params(WHISPER_SAMPLING_BEAM_SEARCH).beam_search.beam_size;
+    int32_t repetition_max_period = whisper_full_default_params(WHISPER_SAMPLING_GREEDY).repetition_max_period;
 
     float word_thold    =  0.01f;
     float entropy_thold =  2.40f;
     float logprob_thold = -1.00f;
+    float no_speech_thold = 0.6f;
+    float vad_thold       = 0.6f;
 
     bool speed_up        = false;
     bool debug_mode      = false;
+    bool audio_ctx_auto  = false;
+    bool vad_split       = false;
+    bool skip_silence    = false;
     bool translate       = false;
     bool detect_language = false;
     bool diarize         = false;
     bool tinydiarize     = false;
     bool split_on_word   = false;
     bool no_fallback     = false;
+    bool spec_fallback   = false;
     bool output_txt      = false;
     bool output_vtt      = false;
     bool output_srt      = false;
@@ -103,6 +111,11 @@ struct whisper_params {
 
     std::string openvino_encode_device = "CPU";
 
+    std::string dtw = "";
+
+    // align the transcript in this file to the audio instead of transcribing it
+    std::string fname_align = "";
+
     std::vector<std::string> fname_inp = {};
     std::vector<std::string> fname_out = {};
 };
@@ -129,6 +142,7 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         }
         else if (arg == "-t"    || arg == "--threads")         { params.n_threads       = std::stoi(argv[++i]); }
         else if (arg == "-p"    || arg == "--processors")      { params.n_processors    = std::stoi(argv[++i]); }
+        else if (arg == "-spin" || arg == "--spin-us")         { params.spin_us         = std::stoi(argv[++i]); }
         else if (arg == "-ot"   || arg == "--offset-t")        { params.offset_t_ms     = std::stoi(argv[++i]); }
         else if (arg == "-on"   || arg == "--offset-n")        { params.offset_n        = std::stoi(argv[++i]); }
         else if (arg == "-d"    || arg == "--duration")        { params.duration_ms     = std::stoi(argv[++i]); }
@@ -139,13 +153,20 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-wt"   || arg == "--word-thold")      { params.word_thold      = std::stof(argv[++i]); }
         else if (arg == "-et"   || arg == "--entropy-thold")   { params.entropy_thold   = std::stof(argv[++i]); }
         else if (arg == "-lpt"  || arg == "--logprob-thold")   { params.logprob_thold   = std::stof(argv[++i]); }
+        else if (arg == "-rp"   || arg == "--rep-period")      { params.repetition_max_period = std::stoi(argv[++i]); }
+        else if (arg == "-nth"  || arg == "--no-speech-thold") { params.no_speech_thold = std::stof(argv[++i]); }
+        else if (arg == "-vth"  || arg == "--vad-thold")       { params.vad_thold       = std::stof(argv[++i]); }
         // else if (arg == "-su"   || arg == "--speed-up")        { params.speed_up        = true; }
         else if (arg == "-debug"|| arg == "--debug-mode")      { params.debug_mode      = true; }
+        else if (arg == "-aca"  || arg == "--audio-ctx-auto")  { params.audio_ctx_auto  = true; }
+        else if (arg == "-vs"   || arg == "--vad-split")       { params.vad_split       = true; }
+        else if (arg == "-ss"   || arg == "--skip-silence")    { params.skip_silence    = true; }
         else if (arg == "-tr"   || arg == "--translate")       { params.translate       = true; }
         else if (arg == "-di"   || arg == "--diarize")         { params.diarize         = true; }
         else if (arg == "-tdrz" || arg == "--tinydiarize")     { params.tinydiarize     = true; }
         else if (arg == "-sow"  || arg == "--split-on-word")   { params.split_on_word   = true; }
         else if (arg == "-nf"   || arg == "--no-fallback")     { params.no_fallback     = true; }
+        else if (arg == "-sf"   || arg == "--spec-fallback")   { params.spec_fallback   = true; }
         else if (arg == "-otxt" || arg == "--output-txt")      { params.output_txt      = true; }
         else if (arg == "-ovtt" || arg == "--output-vtt")      { params.output_vtt      = true; }
         else if (arg == "-osrt" || arg == "--output-srt")      { params.output_srt      = true; }
@@ -167,6 +188,8 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-m"    || arg == "--model")           { params.model           = argv[++i]; }
         else if (arg == "-f"    || arg == "--file")            { params.fname_inp.emplace_back(argv[++i]); }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = argv[++i]; }
+        else if (arg == "-dtw"  || arg == "--dtw")             { params.dtw             = argv[++i]; }
+        else if (arg == "-al"   || arg == "--align")           { params.fname_align     = argv[++i]; }
         else if (arg == "-ls"   || arg == "--log-score")       { params.log_score       = true; }
         else if (arg == "-ng"   || arg == "--no-gpu")          { params.use_gpu         = false; }
         else {
@@ -187,6 +210,7 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -h,        --help              [default] show this help message and exit\n");
     fprintf(stderr, "  -t N,      --threads N         [%-7d] number of threads to use during computation\n",    params.n_threads);
     fprintf(stderr, "  -p N,      --processors N      [%-7d] number of processors to use during computation\n", params.n_processors);
+    fprintf(stderr, "  -spin N,   --spin-us N         [%-7d] microseconds the idle threads busy-wait before sleeping\n", params.spin_us);
     fprintf(stderr, "  -ot N,     --offset-t N        [%-7d] time offset in milliseconds\n",                    params.offset_t_ms);
     fprintf(stderr, "  -on N,     --offset-n N        [%-7d] segment index offset\n",                           params.offset_n);
     fprintf(stderr, "  -d  N,     --duration N        [%-7d] duration of audio to process in milliseconds\n",   params.duration_ms);
@@ -198,12 +222,19 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -wt N,     --word-thold N      [%-7.2f] word timestamp probability threshold\n",         params.word_thold);
     fprintf(stderr, "  -et N,     --entropy-thold N   [%-7.2f] entropy threshold for decoder fail\n",           params.entropy_thold);
     fprintf(stderr, "  -lpt N,    --logprob-thold N   [%-7.2f] log probability threshold for decoder fail\n",   params.logprob_thold);
+    fprintf(stderr, "  -rp N,     --rep-period N      [%-7d] max period of the repetition loops failing a decoder early (0 - off)\n", params.repetition_max_period);
+    fprintf(stderr, "  -nth N,    --no-speech-thold N [%-7.2f] no speech probability threshold for skipping a window\n", params.no_speech_thold);
+    fprintf(stderr, "  -vth N,    --vad-thold N       [%-7.2f] energy threshold of the speech regions of --vad-split\n", params.vad_thold);
     // fprintf(stderr, "  -su,       --speed-up          [%-7s] speed up audio by x2 (reduced accuracy)\n",        params.speed_up ? "true" : "false");
     fprintf(stderr, "  -debug,    --debug-mode        [%-7s] enable debug mode (eg. dump log_mel)\n",           params.debug_mode ? "true" : "false");
+    fprintf(stderr, "  -aca,      --audio-ctx-auto    [%-7s] reduce the audio context of short inputs (faster, can be less accurate)\n", params.audio_ctx_auto ? "true" : "false");
+    fprintf(stderr, "  -vs,       --vad-split         [%-7s] transcribe the speech regions independently, -p of them at the same time\n", params.vad_split ? "true" : "false");
+    fprintf(stderr, "  -ss,       --skip-silence      [%-7s] skip the silences of 30 s or more before running the encoder\n", params.skip_silence ? "true" : "false");
     fprintf(stderr, "  -tr,       --translate         [%-7s] translate from source language to english\n",      params.translate ? "true" : "false");
     fprintf(stderr, "  -di,       --diarize           [%-7s] stereo audio diarization\n",                       params.diarize ? "true" : "false");
     fprintf(stderr, "  -tdrz,     --tinydiarize       [%-7s] enable tinydiarize (requires a tdrz model)\n",     params.tinydiarize ? "true" : "false");
     fprintf(stderr, "  -nf,       --no-fallback       [%-7s] do not use temperature fallback while decoding\n", params.no_fallback ? "true" : "false");
+    fprintf(stderr, "  -sf,       --spec-fallback     [%-7s] start the temperature fallback early, next to the greedy decoder\n", params.spec_fallback ? "true" : "false");
     fprintf(stderr, "  -otxt,     --output-txt        [%-7s] output result in a text file\n",                   params.output_txt ? "true" : "false");
     fprintf(stderr, "  -ovtt,     --output-vtt        [%-7s] output result in a vtt file\n",                    params.output_vtt ? "true" : "false");
     fprintf(stderr, "  -osrt,     --output-srt        [%-7s] output result in a srt file\n",                    params.output_srt ? "true" : "false");
@@ -225,6 +256,10 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
     fprintf(stderr, "  -f FNAME,  --file FNAME        [%-7s] input WAV file path\n",                            "");
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
+    fprintf(stderr, "  -dtw MODEL --dtw MODEL         [%-7s] compute token-level timestamps with DTW, using the alignment heads of MODEL\n", params.dtw.c_str());
+    fprintf(stderr, "                                           (tiny, tiny.en, base, base.en, small, small.en, medium, medium.en,\n");
+    fprintf(stderr, "                                            large-v1, large-v2, large-v3 or top)\n");
+    fprintf(stderr, "  -al FNAME, --align FNAME       [%-7s] align the transcript in FNAME to the audio instead of transcribing it\n", params.fname_align.c_str());
     fprintf(stderr, "  -ls,       --log-score         [%-7s] log best decoder scores of tokens\n",              params.log_score?"true":"false");
     fprintf(stderr, "  -ng,       --no-gpu            [%-7s] disable GPU\n",                                    params.use_gpu ? "false" : "true");
     fprintf(stderr, "\n");
@@ -890,8 +925,32 @@ int main(int argc, char ** argv) {
 
     // whisper init
 
-    struct whisper_context_params cparams;
+    struct whisper_context_params cparams = whisper_context_default_params();
     cparams.use_gpu = params.use_gpu;
+    cparams.threadpool_spin_us = params.spin_us;
+
+    if (!params.dtw.empty()) {
+        cparams.dtw_token_timestamps = true;
+        cparams.dtw_aheads_preset = WHISPER_AHEADS_NONE;
+
+        if (params.dtw == "tiny")      cparams.dtw_aheads_preset = WHISPER_AHEADS_TINY;
+        if (params.dtw == "tiny.en")   cparams.dtw_aheads_preset = WHISPER_AHEADS_TINY_EN;
+        if (params.dtw == "base")      cparams.dtw_aheads_preset = WHISPER_AHEADS_BASE;
+        if (params.dtw == "base.en")   cparams.dtw_aheads_preset = WHISPER_AHEADS_BASE_EN;
+        if (params.dtw == "small")     cparams.dtw_aheads_preset = WHISPER_AHEADS_SMALL;
+        if (params.dtw == "small.en")  cparams.dtw_aheads_preset = WHISPER_AHEADS_SMALL_EN;
+        if (params.dtw == "medium")    cparams.dtw_aheads_preset = WHISPER_AHEADS_MEDIUM;
+        if (params.dtw == "medium.en") cparams.dtw_aheads_preset = WHISPER_AHEADS_MEDIUM_EN;
+        if (params.dtw == "large-v1")  cparams.dtw_aheads_preset = WHISPER_AHEADS_LARGE_V1;
+        if (params.dtw == "large-v2")  cparams.dtw_aheads_preset = WHISPER_AHEADS_LARGE_V2;
+        if (params.dtw == "large-v3")  cparams.dtw_aheads_preset = WHISPER_AHEADS_LARGE_V3;
+        if (params.dtw == "top")       cparams.dtw_aheads_preset = WHISPER_AHEADS_N_TOP_MOST;
+
+        if (cparams.dtw_aheads_preset == WHISPER_AHEADS_NONE) {
+            fprintf(stderr, "error: unknown DTW preset '%s'\n", params.dtw.c_str());
+            return 3;
+        }
+    }
 
     struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
 
@@ -970,6 +1029,13 @@ int main(int argc, char ** argv) {
 
             wparams.speed_up         = params.speed_up;
             wparams.debug_mode       = params.debug_mode;
+            wparams.audio_ctx_auto   = params.audio_ctx_auto;
+
+            wparams.vad_split        = params.vad_split;
+            wparams.vad_n_parallel   = params.n_processors;
+            wparams.vad_thold        = params.vad_thold;
+
+            wparams.skip_silence     = params.skip_silence;
 
             wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
 
@@ -980,7 +1046,11 @@ int main(int argc, char ** argv) {
 
             wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
             wparams.entropy_thold    = params.entropy_thold;
+            wparams.repetition_max_period = params.repetition_max_period;
             wparams.logprob_thold    = params.logprob_thold;
+            wparams.no_speech_thold  = params.no_speech_thold;
+
+            wparams.fallback_speculative = params.spec_fallback;
 
             wparams.no_timestamps    = params.no_timestamps;
 
@@ -1022,7 +1092,20 @@ int main(int argc, char ** argv) {
                 wparams.abort_callback_user_data = &is_aborted;
             }
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
+            if (!params.fname_align.empty()) {
+                std::ifstream fin(params.fname_align);
+                if (!fin) {
+                    fprintf(stderr, "error: failed to open transcript '%s'\n", params.fname_align.c_str());
+                    return 10;
+                }
+
+                const std::string transcript((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+
+                if (whisper_align(ctx, wparams, pcmf32.data(), pcmf32.size(), transcript.c_str()) != 0) {
+                    fprintf(stderr, "%s: failed to align the transcript\n", argv[0]);
+                    return 10;
+                }
+            } else if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
                 fprintf(stderr, "%s: failed to process audio\n", argv[0]);
                 return 10;
             }
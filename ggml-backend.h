@@ -86,6 +86,10 @@ extern "C" {
     GGML_API GGML_CALL bool ggml_backend_is_cpu           (ggml_backend_t backend);
     GGML_API           void ggml_backend_cpu_set_n_threads(ggml_backend_t backend_cpu, int n_threads);
 
+    // use persistent worker threads for the graph computations instead of creating new ones each time
+    // the threadpool is not owned by the backend and must outlive it (or be unset with NULL)
+    GGML_API           void ggml_backend_cpu_set_threadpool(ggml_backend_t backend_cpu, struct ggml_threadpool * threadpool);
+
     // Create a backend buffer from an existing pointer
     GGML_API GGML_CALL ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size);
 
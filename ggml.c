@@ -84,6 +84,51 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef CRITICAL_SECTION   pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static int pthread_mutex_init(pthread_mutex_t * mutex, void * unused) {
+    (void) unused;
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+    DeleteCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_lock(pthread_mutex_t * mutex) {
+    EnterCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+    LeaveCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t * cond, void * unused) {
+    (void) unused;
+    InitializeConditionVariable(cond);
+    return 0;
+}
+
+static int pthread_cond_destroy(pthread_cond_t * cond) {
+    (void) cond;
+    return 0;
+}
+
+static int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+    return 0;
+}
+
+static int pthread_cond_broadcast(pthread_cond_t * cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
 #else
 #include <pthread.h>
 #include <stdatomic.h>
@@ -16568,6 +16613,7 @@ struct ggml_compute_state {
     ggml_thread_t thrd;
     int ith;
     struct ggml_compute_state_shared * shared;
+    int ec; // exit code when running on a ggml_threadpool
 };
 
 static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
@@ -17164,6 +17210,185 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
     return cplan;
 }
 
+//
+// thread pool
+//
+// the workers are created once and reused by all subsequent ggml_threadpool_run() calls
+// after finishing a task, a worker busy-waits for up to spin_us microseconds for the next one
+// and then sleeps on a condition variable until new work is submitted or the pool is freed
+//
+
+struct ggml_threadpool_worker {
+    ggml_thread_t thrd;
+    int ith;
+    struct ggml_threadpool * threadpool;
+};
+
+struct ggml_threadpool {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+
+    int n_threads; // including the calling thread
+
+    struct ggml_threadpool_worker * workers; // [n_threads - 1]
+
+    atomic_int n_gen;   // incremented every time new work is submitted
+    atomic_int n_busy;  // number of workers that have not finished the current work yet
+    atomic_int stop;    // set when the pool is being freed
+    atomic_int spin_us; // how long the idle workers busy-wait before going to sleep
+
+    // current work
+    ggml_threadpool_task_t task;
+    void * user_data;
+    int nth;
+};
+
+static thread_ret_t ggml_threadpool_worker_thread(void * data) {
+    struct ggml_threadpool_worker * worker = (struct ggml_threadpool_worker *) data;
+    struct ggml_threadpool * tp = worker->threadpool;
+
+    int n_gen = 0;
+
+    while (true) {
+        if (atomic_load(&tp->n_gen) == n_gen) {
+            const int64_t spin_us = atomic_load(&tp->spin_us);
+
+            if (spin_us > 0) {
+                const int64_t t_end_us = ggml_time_us() + spin_us;
+
+                while (atomic_load(&tp->n_gen) == n_gen && ggml_time_us() < t_end_us) {
+                    ggml_lock_lock(NULL);
+                }
+            }
+
+            if (atomic_load(&tp->n_gen) == n_gen) {
+                pthread_mutex_lock(&tp->mutex);
+                while (atomic_load(&tp->n_gen) == n_gen) {
+                    pthread_cond_wait(&tp->cond, &tp->mutex);
+                }
+                pthread_mutex_unlock(&tp->mutex);
+            }
+        }
+
+        n_gen = atomic_load(&tp->n_gen);
+
+        if (atomic_load(&tp->stop)) {
+            break;
+        }
+
+        if (worker->ith < tp->nth) {
+            tp->task(worker->ith, tp->nth, tp->user_data);
+        }
+
+        atomic_fetch_sub(&tp->n_busy, 1);
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(int n_threads, int spin_us) {
+    GGML_ASSERT(n_threads > 0);
+
+    ggml_time_init();
+
+    struct ggml_threadpool * tp = malloc(sizeof(struct ggml_threadpool));
+
+    pthread_mutex_init(&tp->mutex, NULL);
+    pthread_cond_init (&tp->cond,  NULL);
+
+    tp->n_threads = n_threads;
+    tp->workers   = n_threads > 1 ? malloc(sizeof(struct ggml_threadpool_worker)*(n_threads - 1)) : NULL;
+
+    atomic_store(&tp->n_gen,   0);
+    atomic_store(&tp->n_busy,  0);
+    atomic_store(&tp->stop,    0);
+    atomic_store(&tp->spin_us, spin_us);
+
+    tp->task      = NULL;
+    tp->user_data = NULL;
+    tp->nth       = 0;
+
+    for (int j = 1; j < n_threads; ++j) {
+        struct ggml_threadpool_worker * worker = &tp->workers[j - 1];
+
+        worker->thrd       = 0;
+        worker->ith        = j;
+        worker->threadpool = tp;
+
+        const int rc = ggml_thread_create(&worker->thrd, NULL, ggml_threadpool_worker_thread, worker);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return tp;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * tp) {
+    if (tp == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&tp->mutex);
+    atomic_store(&tp->stop, 1);
+    atomic_fetch_add(&tp->n_gen, 1);
+    pthread_cond_broadcast(&tp->cond);
+    pthread_mutex_unlock(&tp->mutex);
+
+    for (int j = 1; j < tp->n_threads; ++j) {
+        const int rc = ggml_thread_join(tp->workers[j - 1].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    pthread_cond_destroy (&tp->cond);
+    pthread_mutex_destroy(&tp->mutex);
+
+    free(tp->workers);
+    free(tp);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * tp) {
+    return tp->n_threads;
+}
+
+void ggml_threadpool_set_spin(struct ggml_threadpool * tp, int spin_us) {
+    atomic_store(&tp->spin_us, spin_us);
+}
+
+void ggml_threadpool_run(struct ggml_threadpool * tp, int nth, ggml_threadpool_task_t task, void * user_data) {
+    GGML_ASSERT(nth > 0 && nth <= tp->n_threads);
+
+    if (nth == 1) {
+        task(0, 1, user_data);
+        return;
+    }
+
+    tp->task      = task;
+    tp->user_data = user_data;
+    tp->nth       = nth;
+
+    atomic_store(&tp->n_busy, tp->n_threads - 1);
+
+    pthread_mutex_lock(&tp->mutex);
+    atomic_fetch_add(&tp->n_gen, 1);
+    pthread_cond_broadcast(&tp->cond);
+    pthread_mutex_unlock(&tp->mutex);
+
+    task(0, nth, user_data);
+
+    while (atomic_load(&tp->n_busy) > 0) {
+        sched_yield();
+    }
+}
+
+static void ggml_graph_compute_thread_task(int ith, int nth, void * user_data) {
+    struct ggml_compute_state * workers = (struct ggml_compute_state *) user_data;
+
+    workers[ith].ec = (int) (size_t) ggml_graph_compute_thread(&workers[ith]);
+
+    UNUSED(nth);
+}
+
 int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     {
         GGML_ASSERT(cplan);
@@ -17201,8 +17426,26 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     };
     struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
 
+    // reuse the persistent worker threads, if provided
+    struct ggml_threadpool * threadpool = cplan->threadpool;
+
+    if (threadpool && (n_threads == 1 || ggml_threadpool_n_threads(threadpool) < n_threads)) {
+        threadpool = NULL;
+    }
+
+    if (threadpool) {
+        for (int j = 0; j < n_threads; ++j) {
+            workers[j] = (struct ggml_compute_state) {
+                .thrd   = 0,
+                .ith    = j,
+                .shared = &state_shared,
+                .ec     = GGML_EXIT_SUCCESS,
+            };
+        }
+    }
+
     // create thread pool
-    if (n_threads > 1) {
+    if (n_threads > 1 && !threadpool) {
         for (int j = 1; j < n_threads; ++j) {
             workers[j] = (struct ggml_compute_state) {
                 .thrd   = 0,
@@ -17222,14 +17465,22 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
-    // this is a work thread too
-    int compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
+    int compute_status = GGML_EXIT_SUCCESS;
+
+    if (threadpool) {
+        ggml_threadpool_run(threadpool, n_threads, ggml_graph_compute_thread_task, workers);
+
+        compute_status = workers[0].ec;
+    } else {
+        // this is a work thread too
+        compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
+    }
 
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
     // join or kill thread pool
-    if (n_threads > 1) {
+    if (n_threads > 1 && !threadpool) {
         for (int j = 1; j < n_threads; j++) {
             const int rc = ggml_thread_join(workers[j].thrd, NULL);
             GGML_ASSERT(rc == 0);
@@ -567,6 +567,9 @@ extern "C" {
 
     static const size_t GGML_TENSOR_SIZE = sizeof(struct ggml_tensor);
 
+    // persistent pool of compute threads - see ggml_threadpool_new()
+    struct ggml_threadpool;
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -575,6 +578,10 @@ extern "C" {
 
         int n_threads;
 
+        // optional persistent worker threads, owned by the caller
+        // if NULL (default), the threads are created and joined on each `ggml_graph_compute()` call
+        struct ggml_threadpool * threadpool;
+
         // abort ggml_graph_compute when true
         bool (*abort_callback)(void * data);
         void * abort_callback_data;
@@ -1885,6 +1892,21 @@ extern "C" {
     GGML_API struct ggml_cplan ggml_graph_plan   (const struct ggml_cgraph * cgraph, int n_threads /*= GGML_DEFAULT_N_THREADS*/);
     GGML_API int               ggml_graph_compute(      struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
 
+    // persistent pool of worker threads that can be reused across many ggml_graph_compute() calls
+    // set cplan.threadpool to a pool with at least cplan.n_threads threads to avoid spawning new threads on each call
+    // idle workers busy-wait for up to spin_us microseconds for new work and then go to sleep until woken up
+    // a pool must not be used by more than one caller at a time
+    typedef void (*ggml_threadpool_task_t)(int ith, int nth, void * user_data);
+
+    GGML_API struct ggml_threadpool * ggml_threadpool_new      (int n_threads, int spin_us);
+    GGML_API void                     ggml_threadpool_free     (struct ggml_threadpool * threadpool);
+    GGML_API int                      ggml_threadpool_n_threads(const struct ggml_threadpool * threadpool);
+    GGML_API void                     ggml_threadpool_set_spin (struct ggml_threadpool * threadpool, int spin_us);
+
+    // run task(ith, nth, user_data) for each ith in [0, nth) and wait for all of them to finish
+    // the calling thread executes ith = 0, nth must not exceed the number of threads in the pool
+    GGML_API void ggml_threadpool_run(struct ggml_threadpool * threadpool, int nth, ggml_threadpool_task_t task, void * user_data);
+
     // same as ggml_graph_compute() but the work data is allocated as a part of the context
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API void ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
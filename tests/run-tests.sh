@@ -13,7 +13,11 @@
 #
 # Usage:
 #
-#   ./tests/run-tests.sh <model_name> [threads]
+#   ./tests/run-tests.sh <model_name> [threads] [extra main args]
+#
+# The extra arguments are passed to main, e.g. to check the accuracy of the reduced audio context:
+#
+#   ./tests/run-tests.sh base.en 4 -aca
 #
 
 cd `dirname $0`
@@ -32,7 +36,7 @@ function list_models {
 }
 
 if [ $# -eq 0 ]; then
-    printf "Usage: $0 [model] [threads]\n\n"
+    printf "Usage: $0 [model] [threads] [extra main args]\n\n"
     printf "No model specified. Aborting\n"
     list_models
     exit 1
@@ -42,10 +46,12 @@ model=$1
 main="../main"
 
 threads=""
-if [ $# -eq 2 ]; then
+if [ $# -ge 2 ]; then
     threads="-t $2"
 fi
 
+args="${@:3}"
+
 if [ ! -f ../models/ggml-$model.bin ]; then
     printf "Model $model not found. Aborting\n"
     list_models
@@ -110,7 +116,7 @@ function run_lang() {
             fi
         fi
 
-        $main -m ../models/ggml-$model.bin $threads -f $fname_dst -l $lang -otxt 2> /dev/null
+        $main -m ../models/ggml-$model.bin $threads $args -f $fname_dst -l $lang -otxt 2> /dev/null
 
         git diff --no-index --word-diff=color --word-diff-regex=. $lang-$i-ref.txt $fname_dst.txt
 
@@ -0,0 +1,193 @@
+// Greedy decoding of several streams with whisper_decode_batch(), with the streams joining and leaving the batch
+// at different steps, compared with the decoding of each stream on its own with whisper_decode_with_state()
+//
+// usage: test-decode-batch <model.bin>
+//
+#include "whisper.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+struct stream {
+    whisper_state * state = nullptr;
+
+    int step_join = 0; // the scheduler step at which the stream joins the batch
+    int n_max     = 0; // the stream leaves the batch after this many tokens
+
+    int n_past = 0;
+
+    std::vector<whisper_token> prompt;
+    std::vector<whisper_token> tokens; // the decoded tokens
+    std::vector<float>         logits; // the logits of each decoded token [tokens.size()][n_vocab]
+
+    bool done() const {
+        return (int) tokens.size() >= n_max;
+    }
+};
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <model.bin>\n", argv[0]);
+        return 1;
+    }
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params(argv[1], whisper_context_default_params());
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to load model '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const int n_vocab   = whisper_n_vocab(ctx);
+    const int n_streams = 4;
+    const int n_threads = 1;
+
+    std::vector<stream> streams(n_streams);
+
+    for (int s = 0; s < n_streams; ++s) {
+        auto & st = streams[s];
+
+        st.state     = whisper_init_state(ctx);
+        st.step_join = 2*s;
+        st.n_max     = 4 + 3*s;
+
+        // a different synthetic clip per stream
+        std::vector<float> pcm(WHISPER_SAMPLE_RATE*(2 + s));
+        for (size_t i = 0; i < pcm.size(); ++i) {
+            pcm[i] = 0.1f*sinf(i*0.01f*(s + 1)) + 0.05f*sinf(i*0.137f);
+        }
+
+        if (whisper_pcm_to_mel_with_state(ctx, st.state, pcm.data(), pcm.size(), n_threads) != 0 ||
+            whisper_encode_with_state(ctx, st.state, 0, n_threads) != 0) {
+            fprintf(stderr, "%s: failed to encode stream %d\n", __func__, s);
+            return 1;
+        }
+
+        st.prompt.push_back(whisper_token_sot(ctx));
+        for (int k = 0; k < s; ++k) {
+            st.prompt.push_back(whisper_token_not(ctx) + k);
+        }
+    }
+
+    // a vocabulary subset for one of the streams
+    {
+        std::vector<whisper_token> subset;
+        for (int i = 0; i < 1000; ++i) {
+            subset.push_back(i);
+        }
+
+        whisper_set_vocab_subset_with_state(ctx, streams[1].state, subset.data(), subset.size());
+    }
+
+    // the scheduler: each step decodes the next token of the active streams in one batch
+    for (int step = 0; ; ++step) {
+        std::vector<whisper_state *>       states;
+        std::vector<const whisper_token *> tokens;
+        std::vector<int>                   n_tokens;
+        std::vector<int>                   n_past;
+        std::vector<int>                   ids;
+
+        bool pending = false;
+
+        for (int s = 0; s < n_streams; ++s) {
+            auto & st = streams[s];
+
+            if (st.done()) {
+                continue;
+            }
+
+            pending = true;
+
+            if (step < st.step_join) {
+                continue;
+            }
+
+            // the prompt on the first step, then the last decoded token
+            states  .push_back(st.state);
+            tokens  .push_back(st.tokens.empty() ? st.prompt.data() : &st.tokens.back());
+            n_tokens.push_back(st.tokens.empty() ? (int) st.prompt.size() : 1);
+            n_past  .push_back(st.n_past);
+            ids     .push_back(s);
+        }
+
+        if (!pending) {
+            break;
+        }
+
+        if (states.empty()) {
+            continue;
+        }
+
+        if (whisper_decode_batch(ctx, states.data(), tokens.data(), n_tokens.data(), n_past.data(), states.size(), n_threads) != 0) {
+            fprintf(stderr, "%s: whisper_decode_batch() failed at step %d\n", __func__, step);
+            return 1;
+        }
+
+        for (size_t i = 0; i < ids.size(); ++i) {
+            auto & st = streams[ids[i]];
+
+            const float * logits = whisper_get_logits_from_state(st.state) + (n_tokens[i] - 1)*n_vocab;
+
+            st.n_past += n_tokens[i];
+            st.tokens.push_back(std::max_element(logits, logits + n_vocab) - logits);
+            st.logits.insert(st.logits.end(), logits, logits + n_vocab);
+        }
+    }
+
+    // decode each stream again on its own and compare
+    int n_fail = 0;
+
+    for (int s = 0; s < n_streams; ++s) {
+        auto & st = streams[s];
+
+        int n_past = 0;
+
+        for (size_t t = 0; t < st.tokens.size(); ++t) {
+            const whisper_token * tokens   = t == 0 ? st.prompt.data() : &st.tokens[t - 1];
+            const int             n_tokens = t == 0 ? (int) st.prompt.size() : 1;
+
+            if (whisper_decode_with_state(ctx, st.state, tokens, n_tokens, n_past, n_threads) != 0) {
+                fprintf(stderr, "%s: whisper_decode_with_state() failed\n", __func__);
+                return 1;
+            }
+
+            n_past += n_tokens;
+
+            const float * ref = whisper_get_logits_from_state(st.state) + (n_tokens - 1)*n_vocab;
+            const float * cur = st.logits.data() + t*n_vocab;
+
+            float max_diff = 0.0f;
+            for (int i = 0; i < n_vocab; ++i) {
+                if (std::isinf(ref[i]) || std::isinf(cur[i])) {
+                    max_diff = std::max(max_diff, ref[i] == cur[i] ? 0.0f : INFINITY);
+                } else {
+                    max_diff = std::max(max_diff, std::fabs(ref[i] - cur[i]));
+                }
+            }
+
+            // with a vocabulary subset, a single state projects onto the F32 rows of the subset, while the batch
+            // projects onto the whole F16 token embeddings, hence the tolerance
+            const whisper_token token = std::max_element(ref, ref + n_vocab) - ref;
+
+            if (token != st.tokens[t] || max_diff > 1e-2f) {
+                fprintf(stderr, "%s: stream %d, token %d: %d vs %d, max logit difference %g\n", __func__, s, (int) t, st.tokens[t], token, max_diff);
+                n_fail++;
+            }
+        }
+    }
+
+    for (auto & st : streams) {
+        whisper_free_state(st.state);
+    }
+
+    whisper_free(ctx);
+
+    if (n_fail > 0) {
+        return 1;
+    }
+
+    printf("%s: %d streams OK\n", __func__, n_streams);
+
+    return 0;
+}
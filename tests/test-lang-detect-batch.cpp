@@ -0,0 +1,119 @@
+// Language identification of several clips with whisper_lang_detect_batch(), compared with the detection of each
+// clip on its own with whisper_lang_auto_detect_with_state() at the same audio_ctx
+//
+// usage: test-lang-detect-batch <model.bin>
+//
+#include "whisper.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+// the audio_ctx used by whisper_lang_detect_batch() for a clip: its length, padded to a multiple of 64
+static int clip_audio_ctx(struct whisper_context * ctx, int n_samples) {
+    const int n_audio_ctx = whisper_model_n_audio_ctx(ctx);
+    const int n_frames    = std::min(n_samples/WHISPER_HOP_LENGTH, 2*n_audio_ctx);
+
+    return std::min(n_audio_ctx, ((n_frames + 1)/2 + 63)/64*64);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <model.bin>\n", argv[0]);
+        return 1;
+    }
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params(argv[1], whisper_context_default_params());
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to load model '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const int n_lang    = whisper_lang_max_id() + 1;
+    const int n_threads = 1;
+
+    // a clip is encoded with the audio_ctx of the longest clip of its group, so the lengths are chosen to make two
+    // groups with a single audio_ctx each: 3 clips of 384 and 2 clips of 640
+    const std::vector<float> secs = { 7.0f, 12.0f, 6.8f, 12.5f, 7.2f };
+
+    const int n_clips = secs.size();
+
+    std::vector<std::vector<float>> pcm(n_clips);
+
+    std::vector<const float *> samples;
+    std::vector<int>           n_samples;
+
+    for (int c = 0; c < n_clips; ++c) {
+        pcm[c].resize(WHISPER_SAMPLE_RATE*secs[c]);
+        for (size_t i = 0; i < pcm[c].size(); ++i) {
+            pcm[c][i] = 0.1f*sinf(i*(0.01f + 0.003f*c)) + 0.05f*sinf(i*0.137f*(c + 1));
+        }
+
+        samples  .push_back(pcm[c].data());
+        n_samples.push_back(pcm[c].size());
+    }
+
+    std::vector<int>   lang_ids(n_clips);
+    std::vector<float> lang_probs(n_clips*n_lang);
+
+    if (whisper_lang_detect_batch(ctx, samples.data(), n_samples.data(), n_clips, n_threads, lang_ids.data(), lang_probs.data()) != 0) {
+        fprintf(stderr, "%s: whisper_lang_detect_batch() failed\n", __func__);
+        return 1;
+    }
+
+    int n_fail = 0;
+
+    for (int c = 0; c < n_clips; ++c) {
+        struct whisper_state * state = whisper_init_state(ctx);
+
+        // whisper_full_with_state() computes the mel spectrogram of the clip and sets its audio_ctx in the state
+        whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+        wparams.n_threads       = n_threads;
+        wparams.audio_ctx       = clip_audio_ctx(ctx, n_samples[c]);
+        wparams.detect_language = true;
+        wparams.print_progress  = false;
+
+        std::vector<float> ref(n_lang);
+
+        if (whisper_full_with_state(ctx, state, wparams, samples[c], n_samples[c]) != 0 ||
+            whisper_lang_auto_detect_with_state(ctx, state, 0, n_threads, ref.data()) < 0) {
+            fprintf(stderr, "%s: failed to detect the language of clip %d\n", __func__, c);
+            return 1;
+        }
+
+        whisper_free_state(state);
+
+        const float * cur = lang_probs.data() + c*n_lang;
+
+        float max_diff = 0.0f;
+        for (int l = 0; l < n_lang; ++l) {
+            max_diff = std::max(max_diff, std::fabs(ref[l] - cur[l]));
+        }
+
+        // the top language must match when it is not a tie within the tolerance
+        std::vector<float> sorted(ref);
+        std::sort(sorted.begin(), sorted.end(), std::greater<float>());
+
+        const int  lang_id = std::max_element(ref.begin(), ref.end()) - ref.begin();
+        const bool clear   = sorted[0] - sorted[1] > 1e-2f;
+
+        // the cross-attention K and V of a single clip are stored in F16 in kv_cross, the batch keeps them in F32
+        if (max_diff > 1e-3f || (clear && lang_id != lang_ids[c])) {
+            fprintf(stderr, "%s: clip %d: language %d vs %d, max probability difference %g\n", __func__, c, lang_ids[c], lang_id, max_diff);
+            n_fail++;
+        }
+    }
+
+    whisper_free(ctx);
+
+    if (n_fail > 0) {
+        return 1;
+    }
+
+    printf("%s: %d clips OK\n", __func__, n_clips);
+
+    return 0;
+}
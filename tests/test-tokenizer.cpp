@@ -0,0 +1,134 @@
+// Compare whisper_tokenize() with the std::regex based pre-tokenizer it replaced
+//
+// usage: test-tokenizer <model.bin> [n_strings]
+//
+#include "whisper.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+// the tokenizer as it was implemented with std::regex
+static std::vector<whisper_token> tokenize_regex(const std::map<std::string, whisper_token> & token_to_id, const std::string & text) {
+    std::vector<std::string> words;
+
+    // first split the text into words
+    {
+        std::string str = text;
+        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+
+        std::regex re(pat);
+        std::smatch m;
+
+        while (std::regex_search(str, m, re)) {
+            for (auto x : m) {
+                words.push_back(x);
+            }
+            str = m.suffix();
+        }
+    }
+
+    // find the longest tokens that form the words:
+    std::vector<whisper_token> tokens;
+    for (const auto & word : words) {
+        if (word.empty()) continue;
+
+        int i = 0;
+        int n = word.size();
+        while (i < n) {
+            int j = n;
+            bool found = false;
+            while (j > i) {
+                auto sub = word.substr(i, j-i);
+                auto it = token_to_id.find(sub);
+                if (it != token_to_id.end()) {
+                    tokens.push_back(it->second);
+                    i = j;
+                    found = true;
+                    break;
+                }
+                --j;
+            }
+            if (!found) {
+                ++i;
+            }
+        }
+    }
+
+    return tokens;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <model.bin> [n_strings]\n", argv[0]);
+        return 1;
+    }
+
+    const int n_strings = argc > 2 ? atoi(argv[2]) : 5000;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params(argv[1], whisper_context_default_params());
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to load model '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    // same as whisper_model_load(): the last token with a given text wins
+    std::map<std::string, whisper_token> token_to_id;
+    for (int i = 0; i < whisper_n_vocab(ctx); ++i) {
+        token_to_id[whisper_token_to_str(ctx, i)] = i;
+    }
+
+    const std::vector<std::string> pieces = {
+        "'s", "'t", "'re", "'ve", "'m", "'ll", "'d", "'", "''",
+        " ", "  ", "   ", "\n", "\t", " \n", "\r\n", "\v", "\f",
+        "a", "hello", "World", "x", " the", " ok.", "it's", "don't", "'S",
+        "123", "4", " 56", "!", "?!", "...", "-",
+        "caf\xc3\xa9", "\xc3\xbc", " \xc3\xa9", "\xe2\x80\x94", "\xe6\x97\xa5\xe6\x9c\xac", "\xf0\x9f\x98\x80",
+    };
+
+    std::mt19937 rng(42);
+    std::vector<whisper_token> tokens(1024);
+
+    int n_fail = 0;
+
+    for (int n = 0; n < n_strings; ++n) {
+        std::string text;
+
+        const int len = 1 + rng() % 12;
+        for (int k = 0; k < len; ++k) {
+            text += pieces[rng() % pieces.size()];
+        }
+
+        // arbitrary bytes now and then
+        if (n % 100 == 0) {
+            for (int k = 0; k < 8; ++k) {
+                text += (char) (1 + rng() % 255);
+            }
+        }
+
+        const int n_tokens = whisper_tokenize(ctx, text.c_str(), tokens.data(), tokens.size());
+        const auto ref = tokenize_regex(token_to_id, text);
+
+        if (n_tokens != (int) ref.size() || !std::equal(ref.begin(), ref.end(), tokens.begin())) {
+            if (n_fail++ < 10) {
+                fprintf(stderr, "%s: mismatch for '%s': %d tokens, expected %d\n", __func__, text.c_str(), n_tokens, (int) ref.size());
+            }
+        }
+    }
+
+    whisper_free(ctx);
+
+    if (n_fail > 0) {
+        fprintf(stderr, "%s: %d / %d strings tokenized differently\n", __func__, n_fail, n_strings);
+        return 1;
+    }
+
+    printf("%s: %d strings OK\n", __func__, n_strings);
+
+    return 0;
+}
@@ -28,13 +28,15 @@
 #include <cstdio>
 #include <cstdarg>
 #include <cstring>
+#include <condition_variable>
 #include <fstream>
 #include <map>
-#include <set>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
-#include <regex>
 #include <random>
 #include <functional>
 
@@ -146,8 +148,42 @@ static void whisper_log_callback_default(ggml_log_level level, const char * text
 //#define WHISPER_USE_FLASH_ATTN
 //#define WHISPER_USE_FLASH_FF
 #define WHISPER_MAX_DECODERS 8
+#define WHISPER_MAX_OUTPUTS  WHISPER_MAX_DECODERS // default max number of tokens per decoder batch for which logits are computed
+
+// max number of states decoded in one graph by whisper_decode_batch()
+#define WHISPER_BATCH_MAX_STATES 8
+
+// KV cache sequence holding the decoded prompt of the current window
+// sequences [0, 2*WHISPER_MAX_DECODERS) are used by the decoders and the beam search
+#define WHISPER_SEQ_ID_PROMPT (2*WHISPER_MAX_DECODERS)
+
+// max number of sequences in the KV cache - the sequence membership of a cell is stored as a bitmask
+#define WHISPER_KV_MAX_SEQ 32
+
+static_assert(WHISPER_SEQ_ID_PROMPT < WHISPER_KV_MAX_SEQ, "too many KV cache sequences");
+
 #define WHISPER_MAX_NODES 4096
 
+// the number of self-attention KV cells used by the decoder is padded to a multiple of this
+#define WHISPER_KV_PAD 32
+
+// the audio_ctx of the clips in whisper_lang_detect_batch() is padded to a multiple of this, so that clips of
+// similar length can be encoded together
+#define WHISPER_LANG_CTX_PAD 64
+
+// with whisper_full_params::audio_ctx_auto, the audio context of a window covers the audio plus this many encoder
+// frames (1 s) of the padding of the spectrogram
+#define WHISPER_AUDIO_CTX_AUTO_PAD 50
+
+// whisper_full_parallel() splits the audio at the quietest window of this length within the search distance of the
+// equal split points and the chunks after the first one start this much before their split point
+#define WHISPER_PARALLEL_SPLIT_WINDOW_MS  200
+#define WHISPER_PARALLEL_SPLIT_SEARCH_MS 5000
+#define WHISPER_PARALLEL_OVERLAP_MS       500
+
+// default of whisper_context_params::threadpool_spin_us
+#define WHISPER_THREADPOOL_SPIN_US 1000
+
 //
 // ggml helpers
 //
@@ -174,9 +210,11 @@ static bool ggml_graph_compute_helper(
 static bool ggml_graph_compute_helper(
        struct ggml_backend * backend,
         struct ggml_cgraph * graph,
-                       int   n_threads) {
+                       int   n_threads,
+   struct ggml_threadpool * threadpool) {
     if (ggml_backend_is_cpu(backend)) {
         ggml_backend_cpu_set_n_threads(backend, n_threads);
+        ggml_backend_cpu_set_threadpool(backend, threadpool);
     }
 #ifdef GGML_USE_METAL
     if (ggml_backend_is_metal(backend)) {
@@ -347,6 +385,33 @@ static const std::map<std::string, std::pair<int, std::string>> g_lang = {
     { "yue", { 99,  "cantonese",      } },
 };
 
+// alignment heads of the official models, ref: whisper_alignment_heads_preset
+static const whisper_ahead g_aheads_tiny_en[]   = { {1, 0}, {2, 0}, {2, 5}, {3, 0}, {3, 1}, {3, 2}, {3, 3}, {3, 4} };
+static const whisper_ahead g_aheads_tiny[]      = { {2, 2}, {3, 0}, {3, 2}, {3, 3}, {3, 4}, {3, 5} };
+static const whisper_ahead g_aheads_base_en[]   = { {3, 3}, {4, 7}, {5, 1}, {5, 5}, {5, 7} };
+static const whisper_ahead g_aheads_base[]      = { {3, 1}, {4, 2}, {4, 3}, {4, 7}, {5, 1}, {5, 2}, {5, 4}, {5, 6} };
+static const whisper_ahead g_aheads_small_en[]  = { {6, 6}, {7, 0}, {7, 3}, {7, 8}, {8, 2}, {8, 5}, {8, 7}, {9, 0}, {9, 4}, {9, 8}, {9, 10}, {10, 0}, {10, 1}, {10, 2}, {10, 3}, {10, 6}, {10, 11}, {11, 2}, {11, 4} };
+static const whisper_ahead g_aheads_small[]     = { {5, 3}, {5, 9}, {8, 0}, {8, 4}, {8, 7}, {8, 8}, {9, 0}, {9, 7}, {9, 9}, {10, 5} };
+static const whisper_ahead g_aheads_medium_en[] = { {11, 4}, {14, 1}, {14, 12}, {14, 14}, {15, 4}, {16, 0}, {16, 4}, {16, 9}, {17, 12}, {17, 14}, {18, 7}, {18, 10}, {18, 15}, {20, 0}, {20, 3}, {20, 9}, {20, 14}, {21, 12} };
+static const whisper_ahead g_aheads_medium[]    = { {13, 15}, {15, 4}, {15, 15}, {16, 1}, {20, 0}, {23, 4} };
+static const whisper_ahead g_aheads_large_v1[]  = { {9, 19}, {11, 2}, {11, 4}, {11, 17}, {22, 7}, {22, 11}, {22, 17}, {23, 2}, {23, 15} };
+static const whisper_ahead g_aheads_large_v2[]  = { {10, 12}, {13, 17}, {16, 11}, {16, 12}, {16, 13}, {17, 15}, {17, 16}, {18, 4}, {18, 11}, {18, 19}, {19, 11}, {21, 2}, {21, 3}, {22, 3}, {22, 9}, {22, 12}, {23, 5}, {23, 7}, {23, 13}, {25, 5}, {26, 1}, {26, 12}, {27, 15} };
+static const whisper_ahead g_aheads_large_v3[]  = { {7, 0}, {10, 17}, {12, 18}, {13, 12}, {16, 1}, {17, 14}, {19, 11}, {21, 4}, {24, 1}, {25, 6} };
+
+static const std::map<whisper_alignment_heads_preset, whisper_aheads> g_aheads {
+    { WHISPER_AHEADS_TINY_EN,   {  8, g_aheads_tiny_en   } },
+    { WHISPER_AHEADS_TINY,      {  6, g_aheads_tiny      } },
+    { WHISPER_AHEADS_BASE_EN,   {  5, g_aheads_base_en   } },
+    { WHISPER_AHEADS_BASE,      {  8, g_aheads_base      } },
+    { WHISPER_AHEADS_SMALL_EN,  { 19, g_aheads_small_en  } },
+    { WHISPER_AHEADS_SMALL,     { 10, g_aheads_small     } },
+    { WHISPER_AHEADS_MEDIUM_EN, { 18, g_aheads_medium_en } },
+    { WHISPER_AHEADS_MEDIUM,    {  6, g_aheads_medium    } },
+    { WHISPER_AHEADS_LARGE_V1,  {  9, g_aheads_large_v1  } },
+    { WHISPER_AHEADS_LARGE_V2,  { 23, g_aheads_large_v2  } },
+    { WHISPER_AHEADS_LARGE_V3,  { 10, g_aheads_large_v3  } },
+};
+
 struct whisper_mel {
     int n_len;
     int n_len_org;
@@ -384,6 +449,24 @@ struct whisper_vocab {
     id token_not        = 50362; // no timestamps
     id token_beg        = 50363; // begin timestamps
 
+    // tokens suppressed during sampling, precomputed after loading the vocabulary
+    // see whisper_vocab_init_suppress()
+    std::vector<id> suppress_special;    // task, language and other special tokens that are never sampled
+    std::vector<id> suppress_non_speech; // suppressed with whisper_full_params.suppress_non_speech_tokens
+    id token_space = -1;                 // " ", suppressed at the beginning with whisper_full_params.suppress_blank
+
+    // byte trie of token_to_id for the longest-match lookups in tokenize()
+    // see whisper_vocab_init_trie()
+    struct trie_node {
+        id      token = -1; // the token that ends at this node, if any
+        int32_t child = -1; // first child
+        int32_t next  = -1; // next sibling
+        uint8_t byte  = 0;
+    };
+
+    std::vector<trie_node> trie;
+    std::vector<int32_t>   trie_root; // the node of each first byte
+
     bool is_multilingual() const {
         return n_vocab >= 51865;
     }
@@ -457,6 +540,15 @@ static void whisper_batch_prep_legacy(whisper_batch & batch, const whisper_token
     batch.logits[n_tokens - 1] = 1;
 }
 
+// number of tokens in the batch for which logits are requested
+static int whisper_batch_n_outputs(const whisper_batch & batch) {
+    int n_outputs = 0;
+    for (int i = 0; i < batch.n_tokens; ++i) {
+        n_outputs += batch.logits[i] != 0;
+    }
+    return n_outputs;
+}
+
 // replace std::pair by using customized pair struct (reason: std::pair is very slow)
 template<typename A, typename B>
 struct whisper_pair {
@@ -639,10 +731,14 @@ struct whisper_layer_decoder {
 struct whisper_kv_cell {
     whisper_pos pos = -1;
 
-    std::set<whisper_seq_id> seq_id;
+    uint32_t seq_mask = 0; // bit i is set if the cell belongs to sequence i
 
     bool has_seq_id(const whisper_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return (seq_mask >> id) & 1;
+    }
+
+    bool is_empty() const {
+        return seq_mask == 0;
     }
 };
 
@@ -655,6 +751,11 @@ struct whisper_kv_cache {
 
     std::vector<whisper_kv_cell> cells;
 
+    // for each sequence, the range of cells [seq_beg, seq_end) that can belong to it
+    // the ranges are conservative - they are extended on insert and shrunk only when a sequence is removed
+    uint32_t seq_beg[WHISPER_KV_MAX_SEQ] = { 0 };
+    uint32_t seq_end[WHISPER_KV_MAX_SEQ] = { 0 };
+
     struct ggml_tensor * k;
     struct ggml_tensor * v;
 
@@ -713,23 +814,90 @@ struct whisper_partial_utf8 {
     int      n_remain; // num bytes remaining; -1 indicates invalid sequence
 };
 
+struct whisper_grammar_candidate {
+    whisper_token          id;
+    const uint32_t       * code_points;
+    whisper_partial_utf8   partial_utf8;
+};
+
+// a grammar compiled once per whisper_full() call and shared by all decoders
+// the stacks of the decoders point into the same rules, so a grammar state - the stacks and the partial UTF-8
+// sequence - can be used as a key, and the tokens that it rejects are computed only the first time it is met
+struct whisper_grammar_compiled {
+    // max number of cached grammar states, about n_vocab/8 bytes each
+    static const int n_states_max = 1024;
+
+    std::vector<std::vector<whisper_grammar_element>>         rules;
+    std::vector<std::vector<const whisper_grammar_element *>> stacks; // the initial stacks
+
+    // the vocabulary decoded from the start of a code point, used by all states without a partial UTF-8 sequence
+    std::vector<std::vector<uint32_t>>     code_points;
+    std::vector<whisper_grammar_candidate> candidates;
+
+    // the allowed tokens of each grammar state, as a bitmask over the vocabulary
+    // entries are never removed, so the masks stay valid while other decoders add new states
+    std::mutex mutex;
+    std::unordered_map<std::string, std::vector<uint32_t>> masks;
+};
+
 struct whisper_grammar {
-    /*const*/ std::vector<std::vector<whisper_grammar_element>> rules;
-    std::vector<std::vector<const whisper_grammar_element *>>   stacks;
+    std::shared_ptr<whisper_grammar_compiled> compiled;
+
+    std::vector<std::vector<const whisper_grammar_element *>> stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     whisper_partial_utf8 partial_utf8;
 };
 
-struct whisper_grammar_candidate {
-    whisper_token          id;
-    const uint32_t       * code_points;
-    whisper_partial_utf8   partial_utf8;
+// online detection of decoding loops
+// tracks for each period p how many of the latest text tokens are equal to the token p positions before them
+// the sequence is in a loop when its last n_window text tokens repeat with period p
+// with p <= 10 such a window of 32 tokens has an entropy below the default entropy_thold, so this catches
+// the loops rejected by the entropy check as soon as they form, instead of after the whole window is decoded
+struct whisper_repetition {
+    static const int n_period_max = 10;
+    static const int n_window     = 32;
+
+    whisper_token tokens[n_period_max]; // ring buffer of the last text tokens
+
+    int32_t n = 0; // number of text tokens seen so far
+    int32_t run[n_period_max + 1];
+
+    void reset() {
+        n = 0;
+    }
+
+    // returns true if the sequence is in a loop with a period of at most p_max after adding the token
+    bool add(whisper_token token, int p_max) {
+        bool loop = false;
+
+        for (int p = 1; p <= std::min(n, n_period_max); ++p) {
+            run[p] = tokens[(n - p) % n_period_max] == token ? run[p] + 1 : 0;
+
+            loop = loop || (p <= p_max && run[p] + p >= n_window);
+        }
+
+        if (n < n_period_max) {
+            run[n + 1] = 0;
+        }
+
+        tokens[n % n_period_max] = token;
+        n++;
+
+        return loop;
+    }
 };
 
 struct whisper_sequence {
     std::vector<whisper_token_data> tokens;
 
+    // loop detection over the text tokens
+    whisper_repetition repetition;
+
+    // [EXPERIMENTAL] DTW token timestamps: for each token, the row of whisper_state::aheads_rows with the
+    // cross-attention weights of the decoder step that produced it
+    std::vector<int32_t> aheads;
+
     // the accumulated transcription in the current iteration (used to truncate the tokens array)
     int result_len;
 
@@ -751,6 +919,8 @@ struct whisper_decoder {
     int i_batch;    // the index of the token in the current batch
     int seek_delta; // the window shift found so far based on the decoded timestamp tokens
 
+    int32_t aheads_row = -1; // the row of whisper_state::aheads_rows of the current logits (DTW token timestamps)
+
     bool failed;    // has the current segment failed to decode?
     bool completed; // has the decoder completed the current segment?
     bool has_ts;    // have we already sampled a non-beg timestamp token for the current segment?
@@ -760,12 +930,87 @@ struct whisper_decoder {
     std::vector<float> logits;
     std::vector<float> logprobs;
 
-    // work container used to avoid memory allocations
-    std::vector<whisper_pair<double, whisper_vocab::id>> logits_id;
+    // work containers used to avoid memory allocations
+    std::vector<whisper_pair<double, whisper_vocab::id>> logits_id; // language detection (decoder 0 only)
+    std::vector<double> probs_cdf;
 
     mutable std::mt19937 rng; // used for sampling at t > 0.0
 };
 
+// the rows of one state in a decoder graph
+// a graph of whisper_decode_batch() has one segment per state, with its own KV caches and attention
+struct whisper_graph_decoder_seg {
+    whisper_state       * wstate = nullptr;
+    const whisper_batch * batch  = nullptr;
+
+    int32_t n_tokens    = 0;
+    int32_t n_outputs   = 0;
+    int32_t n_kv        = 0;
+    int32_t n_audio_ctx = 0;
+
+    int32_t i_token  = 0; // first row of the state in the graph
+    int32_t i_output = 0; // first output row of the state in the logits
+
+    // inputs
+    struct ggml_tensor * KQ_mask = nullptr;
+    struct ggml_tensor * out_ids = nullptr; // output rows within the rows of the state, for the alignment heads
+
+    // outputs
+    struct ggml_tensor * aheads = nullptr; // cross-attention weights of the alignment heads [n_aheads][n_outputs][n_audio_ctx]
+};
+
+// the last built decoder graph
+// reused by the next decode call on the CPU backend if the graph topology is the same - only the inputs and the
+// KV cache views at kv_self.head are updated, avoiding the rebuild and re-allocation of the graph
+struct whisper_graph_decoder {
+    bool valid = false;
+
+    // topology
+    int32_t n_tokens    = 0;
+    int32_t n_outputs   = 0;
+    int32_t n_vocab_out = 0; // number of computed logits per output token
+
+    ggml_cgraph * gf = nullptr;
+
+    // inputs
+    struct ggml_tensor * embd      = nullptr;
+    struct ggml_tensor * position  = nullptr;
+    struct ggml_tensor * out_ids   = nullptr; // rows of the batch for which to compute logits (null if all)
+    struct ggml_tensor * vocab_ids = nullptr; // tokens for which to compute logits (null if all)
+
+    // outputs
+    struct ggml_tensor * logits = nullptr; // [n_outputs][n_vocab_out]
+
+    std::vector<whisper_graph_decoder_seg> segs;
+
+    // views of kv_self.k / kv_self.v at kv_self.head and the copies into them, per layer (single state only)
+    std::vector<struct ggml_tensor *> k_store;
+    std::vector<struct ggml_tensor *> v_store;
+};
+
+// encoder results shared by the states of whisper_full_multi()
+// each window is encoded by the first state that needs it, the others copy its cross-attention KV cache
+struct whisper_encoder_cache {
+    struct entry {
+        int seek;
+        int n_audio_ctx;
+
+        bool ready  = false;
+        bool failed = false;
+
+        // the used part of kv_cross.k / kv_cross.v
+        std::vector<uint8_t> k;
+        std::vector<uint8_t> v;
+    };
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::vector<std::shared_ptr<entry>> entries; // oldest first
+
+    size_t n_max = 1; // max number of cached windows
+};
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
@@ -797,6 +1042,11 @@ struct whisper_state {
 
     ggml_backend_t backend = nullptr;
 
+    // persistent worker threads, reused by the graph computations and the sampling of this state
+    // (re)created on demand when the requested number of threads changes
+    ggml_threadpool * threadpool = nullptr;
+    int32_t           threadpool_spin_us = WHISPER_THREADPOOL_SPIN_US;
+
     // ggml-alloc:
     // - stores meta info about the intermediate tensors into the `meta` buffers
     // - stores the actual tensor data into the `data` buffers
@@ -805,13 +1055,28 @@ struct whisper_state {
     whisper_allocr alloc_cross;
     whisper_allocr alloc_decode;
 
+    // compute buffer of whisper_lang_detect_batch(), measured on first use for all the group shapes
+    whisper_allocr alloc_lang;
+
+    whisper_graph_decoder graph_decoder;
+
+    // not owned, set during whisper_full_multi()
+    whisper_encoder_cache * encoder_cache = nullptr;
+
+    // the window of the mel spectrogram encoded in kv_cross (-1 - none)
+    // whisper_encode_cached() skips the encoder when the same window is requested again, e.g. by the first
+    // window of whisper_full() after the language detection. Reset when the mel spectrogram changes
+    int32_t kv_cross_seek        = -1;
+    int32_t kv_cross_n_audio_ctx = 0;
+
     // result of the encoder
     struct ggml_tensor * embd_conv = nullptr;
     struct ggml_tensor * embd_enc  = nullptr;
 
     // helpers for GPU offloading
-    std::vector<float> inp_mel;
-    std::vector<float> inp_mask;
+    std::vector<float>   inp_mel;
+    std::vector<float>   inp_mask;
+    std::vector<int32_t> inp_out_ids;
 
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
@@ -819,8 +1084,25 @@ struct whisper_state {
     std::vector<whisper_segment> result_all;
     std::vector<whisper_token>   prompt_past;
 
+    // [EXPERIMENTAL] DTW token timestamps
+    // - aheads_cross: cross-attention weights of the alignment heads of the last decode [n_aheads][n_outputs][n_audio_ctx]
+    // - aheads_rows:  the weights of the output rows kept for the decoded tokens of the current window, one row of
+    //                 [n_aheads][n_audio_ctx] per decoder step, referenced by whisper_sequence::aheads
+    int32_t                  aheads_n_audio_ctx = 0;
+    std::vector<float>       aheads_cross;
+    std::vector<ggml_fp16_t> aheads_rows;
+
     int lang_id = 0; // english by default
 
+    // sorted subset of the vocabulary for which the decoder computes logits (empty - whole vocabulary)
+    // see whisper_set_vocab_subset()
+    std::vector<int32_t> vocab_subset;
+    std::vector<float>   logits_subset; // work buffer
+
+    // max number of tokens per decoder batch for which logits are computed
+    // the decoder compute buffer is measured for this many outputs, see whisper_reserve_outputs()
+    int32_t n_outputs_max = WHISPER_MAX_OUTPUTS;
+
     std::string path_model; // populated by whisper_init_from_file_with_params()
 
 #ifdef WHISPER_USE_COREML
@@ -855,10 +1137,24 @@ struct whisper_context {
     whisper_model model;
     whisper_vocab vocab;
 
+    // the alignment heads used for the DTW token timestamps, empty if disabled
+    std::vector<whisper_ahead> aheads;
+
     whisper_state * state = nullptr;
 
+    // the states of the chunks of whisper_full_parallel() and of the regions of whisper_full_params::vad_split,
+    // kept for the next call
+    std::vector<whisper_state *> state_pool;
+    std::mutex                   state_pool_mutex;
+
     ggml_backend_t backend = nullptr;
 
+    // the graph of whisper_decode_batch() and its compute buffer, measured once for WHISPER_BATCH_MAX_STATES states
+    // of WHISPER_MAX_DECODERS tokens each
+    whisper_allocr        alloc_batch;
+    whisper_graph_decoder graph_batch;
+    std::mutex            batch_mutex;
+
     std::string path_model; // populated by whisper_init_from_file_with_params()
 };
 
@@ -924,6 +1220,9 @@ static bool kv_cache_init(
         ggml_allocr_free(alloc);
     }
 
+    // the decoder attends to padded ranges of cells, so make sure the unused cells do not contain garbage
+    ggml_backend_buffer_clear(cache.buffer, 0);
+
     return true;
 }
 
@@ -976,31 +1275,76 @@ static bool whisper_kv_cache_find_slot(
     }
 
     for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
+        const uint32_t cell = cache.head + i;
+
+        cache.cells[cell].pos = batch.pos[i];
 
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+            const whisper_seq_id seq_id = batch.seq_id[i][j];
+
+            GGML_ASSERT(seq_id >= 0 && seq_id < WHISPER_KV_MAX_SEQ);
+
+            cache.cells[cell].seq_mask |= 1u << seq_id;
+
+            if (cache.seq_beg[seq_id] >= cache.seq_end[seq_id]) {
+                cache.seq_beg[seq_id] = cell;
+                cache.seq_end[seq_id] = cell + 1;
+            } else {
+                cache.seq_beg[seq_id] = std::min(cache.seq_beg[seq_id], cell);
+                cache.seq_end[seq_id] = std::max(cache.seq_end[seq_id], cell + 1);
+            }
         }
     }
 
     return true;
 }
 
+// upper bound of the cells used by any sequence
+static uint32_t whisper_kv_cache_seq_end_max(const struct whisper_kv_cache & cache) {
+    uint32_t res = 0;
+    for (int s = 0; s < WHISPER_KV_MAX_SEQ; ++s) {
+        if (cache.seq_beg[s] < cache.seq_end[s]) {
+            res = std::max(res, cache.seq_end[s]);
+        }
+    }
+
+    return res;
+}
+
 // find how many cells are currently in use
 static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
-    for (uint32_t i = cache.size - 1; i > 0; --i) {
-        if (cache.cells[i].pos >= 0 && !cache.cells[i].seq_id.empty()) {
-            return i + 1;
+    for (uint32_t i = whisper_kv_cache_seq_end_max(cache); i > 1; --i) {
+        if (cache.cells[i - 1].pos >= 0 && !cache.cells[i - 1].is_empty()) {
+            return i;
         }
     }
 
     return 1;
 }
 
+static uint32_t whisper_kv_cache_n_free(const struct whisper_kv_cache & cache) {
+    // the cells past the ranges of all the sequences are free
+    const uint32_t n = whisper_kv_cache_seq_end_max(cache);
+
+    uint32_t n_free = cache.size - n;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        if (cache.cells[i].pos < 0) {
+            n_free++;
+        }
+    }
+
+    return n_free;
+}
+
 static void whisper_kv_cache_clear(struct whisper_kv_cache & cache) {
     for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
         cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+        cache.cells[i].seq_mask = 0;
+    }
+    for (int s = 0; s < WHISPER_KV_MAX_SEQ; ++s) {
+        cache.seq_beg[s] = 0;
+        cache.seq_end[s] = 0;
     }
     cache.head = 0;
 }
@@ -1015,19 +1359,39 @@ static void whisper_kv_cache_seq_rm(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<whisper_pos>::max();
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
+    const uint32_t i0 = seq_id < 0 ? 0                                   : cache.seq_beg[seq_id];
+    const uint32_t i1 = seq_id < 0 ? whisper_kv_cache_seq_end_max(cache) : cache.seq_end[seq_id];
+
+    // the cells that remain in the sequence
+    uint32_t beg = i1;
+    uint32_t end = i0;
+
+    for (uint32_t i = i0; i < i1; ++i) {
         if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
+                cache.cells[i].seq_mask = 0;
             } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
+                cache.cells[i].seq_mask &= ~(1u << seq_id);
             } else {
                 continue;
             }
-            if (cache.cells[i].seq_id.empty()) {
+            if (cache.cells[i].is_empty()) {
                 cache.cells[i].pos = -1;
                 if (new_head == cache.size) new_head = i;
             }
+        } else if (seq_id >= 0 && cache.cells[i].has_seq_id(seq_id)) {
+            beg = std::min(beg, i);
+            end = i + 1;
+        }
+    }
+
+    if (seq_id >= 0) {
+        cache.seq_beg[seq_id] = beg;
+        cache.seq_end[seq_id] = std::max(beg, end);
+    } else if (p0 == 0 && p1 == std::numeric_limits<whisper_pos>::max()) {
+        for (int s = 0; s < WHISPER_KV_MAX_SEQ; ++s) {
+            cache.seq_beg[s] = 0;
+            cache.seq_end[s] = 0;
         }
     }
 
@@ -1046,11 +1410,56 @@ static void whisper_kv_cache_seq_cp(
 
     cache.head = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
+    const uint32_t i0 = cache.seq_beg[seq_id_src];
+    const uint32_t i1 = cache.seq_end[seq_id_src];
+
+    for (uint32_t i = i0; i < i1; ++i) {
         if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+            cache.cells[i].seq_mask |= 1u << seq_id_dst;
+        }
+    }
+
+    if (i0 < i1) {
+        if (cache.seq_beg[seq_id_dst] >= cache.seq_end[seq_id_dst]) {
+            cache.seq_beg[seq_id_dst] = i0;
+            cache.seq_end[seq_id_dst] = i1;
+        } else {
+            cache.seq_beg[seq_id_dst] = std::min(cache.seq_beg[seq_id_dst], i0);
+            cache.seq_end[seq_id_dst] = std::max(cache.seq_end[seq_id_dst], i1);
+        }
+    }
+}
+
+static void whisper_kv_cache_seq_keep(
+        struct whisper_kv_cache & cache,
+                 whisper_seq_id   seq_id) {
+    uint32_t new_head = cache.size;
+
+    const uint32_t n = whisper_kv_cache_seq_end_max(cache);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        if (!cache.cells[i].has_seq_id(seq_id)) {
+            cache.cells[i].pos = -1;
+            cache.cells[i].seq_mask = 0;
+            if (new_head == cache.size) new_head = i;
+        } else {
+            cache.cells[i].seq_mask = 1u << seq_id;
+        }
+    }
+
+    if (new_head == cache.size && n < cache.size) {
+        new_head = n;
+    }
+
+    for (int s = 0; s < WHISPER_KV_MAX_SEQ; ++s) {
+        if (s != seq_id) {
+            cache.seq_beg[s] = 0;
+            cache.seq_end[s] = 0;
         }
     }
+
+    // If we freed up a slot, set head to it so searching can start there.
+    if (new_head != cache.size) cache.head = new_head;
 }
 
 static ggml_backend_t whisper_backend_init(const whisper_context_params & params) {
@@ -1088,6 +1497,117 @@ static ggml_backend_t whisper_backend_init(const whisper_context_params & params
     return ggml_backend_cpu_init();
 }
 
+static const std::vector<std::string> non_speech_tokens = {
+    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+};
+
+// lookup the ids of the tokens suppressed by whisper_process_logits() once, instead of on every sampled token
+static void whisper_vocab_init_suppress(whisper_vocab & vocab) {
+    auto & special = vocab.suppress_special;
+
+    special.clear();
+
+    // <|notimestamps|>, sot, nosp, task and prev tokens
+    special.push_back(vocab.token_not);
+    special.push_back(vocab.token_sot);
+    special.push_back(vocab.token_nosp);
+    special.push_back(vocab.token_translate);
+    special.push_back(vocab.token_transcribe);
+    special.push_back(vocab.token_prev);
+
+    // lang tokens
+    for (size_t i = 0; i < g_lang.size(); ++i) {
+        special.push_back(vocab.token_sot + 1 + i);
+    }
+
+    // non-speech tokens
+    // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+    auto & non_speech = vocab.suppress_non_speech;
+
+    non_speech.clear();
+
+    for (const std::string & token : non_speech_tokens) {
+        const std::string suppress_tokens[] = {token, " " + token};
+        for (const std::string & suppress_token : suppress_tokens) {
+            const auto it = vocab.token_to_id.find(suppress_token);
+            if (it != vocab.token_to_id.end()) {
+                non_speech.push_back(it->second);
+            }
+        }
+    }
+
+    // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+    for (const std::string suppress_token : { " -", " '" }) {
+        const auto it = vocab.token_to_id.find(suppress_token);
+        if (it != vocab.token_to_id.end()) {
+            non_speech.push_back(it->second);
+        }
+    }
+
+    const auto it = vocab.token_to_id.find(" ");
+    vocab.token_space = it != vocab.token_to_id.end() ? it->second : -1;
+}
+
+static int32_t whisper_vocab_trie_child(const whisper_vocab & vocab, int32_t node, uint8_t c) {
+    if (node < 0) {
+        return vocab.trie_root[c];
+    }
+
+    for (int32_t k = vocab.trie[node].child; k >= 0; k = vocab.trie[k].next) {
+        if (vocab.trie[k].byte == c) {
+            return k;
+        }
+    }
+
+    return -1;
+}
+
+static void whisper_vocab_init_trie(whisper_vocab & vocab) {
+    auto & trie = vocab.trie;
+
+    trie.clear();
+    vocab.trie_root.assign(256, -1);
+
+    for (const auto & kv : vocab.token_to_id) {
+        const auto & token = kv.first;
+
+        if (token.empty()) {
+            continue;
+        }
+
+        int32_t node = -1;
+
+        for (const char ch : token) {
+            const uint8_t c = ch;
+
+            int32_t next = whisper_vocab_trie_child(vocab, node, c);
+
+            if (next < 0) {
+                next = trie.size();
+
+                whisper_vocab::trie_node child;
+                child.byte = c;
+
+                if (node < 0) {
+                    vocab.trie_root[c] = next;
+                } else {
+                    child.next = trie[node].child;
+                    trie[node].child = next;
+                }
+
+                trie.push_back(child);
+            }
+
+            node = next;
+        }
+
+        trie[node].token = kv.second;
+    }
+}
+
 // load the model from a ggml file
 //
 // file format:
@@ -1289,6 +1809,9 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
 
         WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
+
+        whisper_vocab_init_suppress(vocab);
+        whisper_vocab_init_trie(vocab);
     }
 
     const ggml_type wtype = wctx.wtype;
@@ -1699,6 +2222,195 @@ static bool whisper_encode_external(const whisper_state & wstate) {
     return use_coreml || use_openvino;
 }
 
+// building blocks of the graphs below
+
+// cur = w*norm(cur) + b
+static struct ggml_tensor * whisper_build_norm(
+        struct ggml_context * ctx0,
+         struct ggml_tensor * cur,
+         struct ggml_tensor * w,
+         struct ggml_tensor * b,
+                      float   eps) {
+    cur = ggml_norm(ctx0, cur, eps);
+
+    return ggml_add(ctx0, ggml_mul(ctx0, cur, w), b);
+}
+
+// cur = w x cur + b
+static struct ggml_tensor * whisper_build_linear(
+        struct ggml_context * ctx0,
+         struct ggml_tensor * cur,
+         struct ggml_tensor * w,
+         struct ggml_tensor * b) {
+    cur = ggml_mul_mat(ctx0, w, cur);
+
+    return ggml_add(ctx0, cur, b);
+}
+
+// convolutions + gelu of a [2*n_ctx][n_mels] mel spectrogram, the result is [n_ctx][n_state]
+static struct ggml_tensor * whisper_build_conv(
+        struct ggml_context * ctx0,
+      const whisper_model & model,
+         struct ggml_tensor * mel) {
+    struct ggml_tensor * cur = nullptr;
+
+    cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
+    cur = ggml_add(ctx0, cur, model.e_conv_1_b);
+
+    cur = ggml_gelu(ctx0, cur);
+
+    cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
+    cur = ggml_add(ctx0, cur, model.e_conv_2_b);
+
+    cur = ggml_gelu(ctx0, cur);
+
+    return cur;
+}
+
+// feed-forward network of an encoder or decoder layer, with its norm and the residual
+template<typename T>
+static struct ggml_tensor * whisper_build_ffn(
+        struct ggml_context * ctx0,
+                    const T & layer,
+         struct ggml_tensor * inpFF,
+                      float   eps) {
+    struct ggml_tensor * cur = whisper_build_norm(ctx0, inpFF, layer.mlp_ln_w, layer.mlp_ln_b, eps);
+
+    // fully connected
+    cur = whisper_build_linear(ctx0, cur, layer.mlp_0_w, layer.mlp_0_b);
+
+    // GELU activation
+    cur = ggml_gelu(ctx0, cur);
+
+    // projection
+    cur = whisper_build_linear(ctx0, cur, layer.mlp_1_w, layer.mlp_1_b);
+
+    return ggml_add(ctx0, cur, inpFF);
+}
+
+// encoder layer over the frames of n_clips clips of n_ctx frames each, inpL is [n_state][n_ctx*n_clips]
+// the self-attention is computed per clip
+static struct ggml_tensor * whisper_build_encoder_layer(
+            struct ggml_context * ctx0,
+        const whisper_context & wctx,
+  const whisper_layer_encoder & layer,
+             struct ggml_tensor * inpL,
+                          int   n_ctx,
+                          int   n_clips) {
+    const auto & hparams = wctx.model.hparams;
+
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+
+    const float KQscale = 1.0f/sqrtf(float(n_state)/n_head);
+
+    struct ggml_tensor * cur = whisper_build_norm(ctx0, inpL, layer.attn_ln_0_w, layer.attn_ln_0_b, hparams.eps);
+
+    // self-attention
+    {
+        struct ggml_tensor * Qcur = whisper_build_linear(ctx0, cur, layer.attn_q_w, layer.attn_q_b);
+
+        //Qcur = ggml_scale(ctx0, Qcur, pow(float(n_state)/n_head, -0.25));
+
+        // note: no bias for Key
+        struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                layer.attn_k_w,
+                cur);
+
+        //Kcur = ggml_scale(ctx0, Kcur, pow(float(n_state)/n_head, -0.25));
+
+        struct ggml_tensor * Vcur = whisper_build_linear(ctx0, cur, layer.attn_v_w, layer.attn_v_b);
+
+        // ------
+
+#ifdef WHISPER_USE_FLASH_ATTN
+        struct ggml_tensor * Q =
+            ggml_permute(ctx0,
+                    ggml_cpy(ctx0,
+                        Qcur,
+                        ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_clips)),
+                    0, 2, 1, 3);
+
+        struct ggml_tensor * K =
+            ggml_permute(ctx0,
+                    ggml_cpy(ctx0,
+                        Kcur,
+                        ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_clips)),
+                    0, 2, 1, 3);
+
+        struct ggml_tensor * V =
+            ggml_cpy(ctx0,
+                    ggml_permute(ctx0,
+                        ggml_reshape_4d(ctx0,
+                            Vcur,
+                            n_state/n_head, n_head, n_ctx, n_clips),
+                        1, 2, 0, 3),
+                    ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_clips));
+
+        struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
+#else
+        struct ggml_tensor * Q =
+            ggml_permute(ctx0,
+                    ggml_cpy(ctx0,
+                        Qcur,
+                        ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx, n_clips)),
+                    0, 2, 1, 3);
+
+        struct ggml_tensor * K =
+            ggml_permute(ctx0,
+                    ggml_cpy(ctx0,
+                        Kcur,
+                        ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_clips)),
+                    0, 2, 1, 3);
+
+        // K * Q
+        struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+        struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQscale);
+
+        struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_scaled);
+
+        struct ggml_tensor * V =
+            ggml_cpy(ctx0,
+                    ggml_permute(ctx0,
+                        ggml_reshape_4d(ctx0,
+                            Vcur,
+                            n_state/n_head, n_head, n_ctx, n_clips),
+                        1, 2, 0, 3),
+                    ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_clips)
+                    );
+
+        struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+#endif
+        struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+        cur = ggml_cpy(ctx0,
+                KQV_merged,
+                ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx*n_clips));
+    }
+
+    // projection
+    cur = whisper_build_linear(ctx0, cur, layer.attn_ln_1_w, layer.attn_ln_1_b);
+
+    // add the input
+    cur = ggml_add(ctx0, cur, inpL);
+
+    struct ggml_tensor * inpFF = cur;
+
+    // feed-forward network
+#ifdef WHISPER_USE_FLASH_FF
+    cur = whisper_build_norm(ctx0, inpFF, layer.mlp_ln_w, layer.mlp_ln_b, hparams.eps);
+
+    cur = ggml_flash_ff(ctx0,
+            ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wctx.itype, n_state, n_ctx*n_clips)),
+            layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
+
+    return ggml_add(ctx0, cur, inpFF);
+#else
+    return whisper_build_ffn(ctx0, layer, inpFF, hparams.eps);
+#endif
+}
+
 static struct ggml_cgraph * whisper_build_graph_conv(
         whisper_context & wctx,
           whisper_state & wstate,
@@ -1752,17 +2464,7 @@ static struct ggml_cgraph * whisper_build_graph_conv(
 
     if (!whisper_encode_external(wstate)) {
         // convolution + gelu
-        {
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_1_b);
-
-            cur = ggml_gelu(ctx0, cur);
-
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_2_b);
-
-            cur = ggml_gelu(ctx0, cur);
-        }
+        cur = whisper_build_conv(ctx0, model, mel);
 
         ggml_set_name(cur, "embd_conv");
         wstate.embd_conv = cur;
@@ -1802,8 +2504,6 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
     const auto & hparams = model.hparams;
 
     const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state;
-    const int n_head  = hparams.n_audio_head;
     const int n_layer = hparams.n_audio_layer;
 
     struct ggml_init_params params = {
@@ -1826,8 +2526,6 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
     //}
     struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
 
-    const float KQscale = 1.0f/sqrtf(float(n_state)/n_head);
-
     // ===================================================================
     // NOTE: experimenting with partial evaluation of the encoder (ignore)
     //static int iter = -1;
@@ -1856,173 +2554,13 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
     struct ggml_tensor * inpL = cur;
 
     for (int il = 0; il < n_layer; ++il) {
-        const auto & layer = model.layers_encoder[il];
-
-        // norm
-        {
-            cur = ggml_norm(ctx0, inpL, hparams.eps);
-
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0, cur, layer.attn_ln_0_w),
-                    layer.attn_ln_0_b);
-        }
-
-        // self-attention
-        {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
-                    layer.attn_q_w,
-                    cur);
-
-            Qcur = ggml_add(ctx0, Qcur, layer.attn_q_b);
-
-            //Qcur = ggml_scale(ctx0, Qcur, pow(float(n_state)/n_head, -0.25));
-
-            // note: no bias for Key
-            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
-                    layer.attn_k_w,
-                    cur);
-
-            //Kcur = ggml_scale(ctx0, Kcur, pow(float(n_state)/n_head, -0.25));
-
-            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
-                    layer.attn_v_w,
-                    cur);
-
-            Vcur = ggml_add(ctx0, Vcur, layer.attn_v_b);
-
-            // ------
-
-#ifdef WHISPER_USE_FLASH_ATTN
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
-                        0, 2, 1, 3);
-
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Kcur,
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
-                        0, 2, 1, 3);
-
-            struct ggml_tensor * V =
-                ggml_cpy(ctx0,
-                        ggml_permute(ctx0,
-                            ggml_reshape_3d(ctx0,
-                                Vcur,
-                                n_state/n_head, n_head, n_ctx),
-                            1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head));
-
-            struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
-#else
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
-                        0, 2, 1, 3);
-
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Kcur,
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
-                        0, 2, 1, 3);
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-
-            struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQscale);
-
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_scaled);
-
-            struct ggml_tensor * V =
-                ggml_cpy(ctx0,
-                        ggml_permute(ctx0,
-                            ggml_reshape_3d(ctx0,
-                                Vcur,
-                                n_state/n_head, n_head, n_ctx),
-                            1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head)
-                        );
-
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-#endif
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx));
-        }
-
-        // projection
-        {
-            cur = ggml_mul_mat(ctx0,
-                    layer.attn_ln_1_w,
-                    cur);
-
-            cur = ggml_add(ctx0, cur, layer.attn_ln_1_b);
-        }
-
-        // add the input
-        cur = ggml_add(ctx0, cur, inpL);
-
-        struct ggml_tensor * inpFF = cur;
-
-        // feed-forward network
-        {
-            // norm
-            {
-                cur = ggml_norm(ctx0, inpFF, hparams.eps);
-
-                // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0, cur, layer.mlp_ln_w),
-                        layer.mlp_ln_b);
-            }
-
-#ifdef WHISPER_USE_FLASH_FF
-            cur = ggml_flash_ff(ctx0,
-                    ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx)),
-                    layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
-#else
-            // fully connected
-            cur = ggml_mul_mat(ctx0,
-                    layer.mlp_0_w,
-                    cur);
-
-            cur = ggml_add(ctx0, cur, layer.mlp_0_b);
-
-            // GELU activation
-            cur = ggml_gelu(ctx0, cur);
-
-            // projection
-            cur = ggml_mul_mat(ctx0,
-                    layer.mlp_1_w,
-                    cur);
-
-            cur = ggml_add(ctx0, cur, layer.mlp_1_b);
-#endif
-        }
-
-        inpL = ggml_add(ctx0, cur, inpFF);
+        inpL = whisper_build_encoder_layer(ctx0, wctx, model.layers_encoder[il], inpL, n_ctx, 1);
     }
 
     cur = inpL;
 
     // norm
-    {
-        cur = ggml_norm(ctx0, cur, hparams.eps);
-
-        // cur = ln_f_g*cur + ln_f_b
-        cur = ggml_add(ctx0,
-                ggml_mul(ctx0, cur, model.e_ln_w),
-                model.e_ln_b);
-    }
+    cur = whisper_build_norm(ctx0, cur, model.e_ln_w, model.e_ln_b, hparams.eps);
 
     ggml_build_forward_expand(gf, cur);
 
@@ -2086,13 +2624,7 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 
         Kcross = ggml_scale(ctx0, Kcross, Kscale);
 
-        struct ggml_tensor* Vcross = ggml_mul_mat(ctx0,
-                layer.cross_attn_v_w,
-                cur);
-
-        Vcross = ggml_add(ctx0,
-                    Vcross,
-                    layer.cross_attn_v_b);
+        struct ggml_tensor* Vcross = whisper_build_linear(ctx0, cur, layer.cross_attn_v_w, layer.cross_attn_v_b);
 
         Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
 
@@ -2115,6 +2647,39 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     return gf;
 }
 
+// the threadpool of the state for n_threads threads, nullptr when running single-threaded
+static ggml_threadpool * whisper_get_threadpool(whisper_state & wstate, int n_threads) {
+    if (n_threads <= 1) {
+        return nullptr;
+    }
+
+    if (wstate.threadpool && ggml_threadpool_n_threads(wstate.threadpool) != n_threads) {
+        ggml_threadpool_free(wstate.threadpool);
+        wstate.threadpool = nullptr;
+    }
+
+    if (wstate.threadpool == nullptr) {
+        wstate.threadpool = ggml_threadpool_new(n_threads, wstate.threadpool_spin_us);
+    }
+
+    return wstate.threadpool;
+}
+
+// call `process` from n_threads threads (including the calling one) using the state's threadpool
+template<typename F>
+static void whisper_parallel_run(whisper_state & wstate, int n_threads_pool, int n_threads, F & process) {
+    ggml_threadpool * threadpool = n_threads > 1 ? whisper_get_threadpool(wstate, n_threads_pool) : nullptr;
+
+    if (threadpool == nullptr) {
+        process();
+        return;
+    }
+
+    ggml_threadpool_run(threadpool, n_threads, [](int /*ith*/, int /*nth*/, void * user_data) {
+        (*(F *) user_data)();
+    }, &process);
+}
+
 // evaluate the encoder with the given state
 //
 // given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
@@ -2134,6 +2699,8 @@ static bool whisper_encode_internal(
                    void * abort_callback_data) {
     const int64_t t_start_us = ggml_time_us();
 
+    wstate.kv_cross_seek = -1;
+
     // conv
     {
         auto & alloc = wstate.alloc_conv.alloc;
@@ -2145,7 +2712,7 @@ static bool whisper_encode_internal(
         ggml_allocr_alloc_graph(alloc, gf);
 
         if (!whisper_encode_external(wstate)) {
-            if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+            if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads, whisper_get_threadpool(wstate, n_threads))) {
                 return false;
             }
         }
@@ -2161,7 +2728,7 @@ static bool whisper_encode_internal(
 
         ggml_allocr_alloc_graph(alloc, gf);
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads, whisper_get_threadpool(wstate, n_threads))) {
             return false;
         }
     }
@@ -2176,97 +2743,248 @@ static bool whisper_encode_internal(
 
         ggml_allocr_alloc_graph(alloc, gf);
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads, whisper_get_threadpool(wstate, n_threads))) {
             return false;
         }
     }
 
+    wstate.kv_cross_seek        = mel_offset;
+    wstate.kv_cross_n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
     wstate.t_encode_us += ggml_time_us() - t_start_us;
     wstate.n_encode++;
 
     return !(abort_callback && abort_callback(abort_callback_data));
 }
 
+// whisper_encode_internal() that reuses the windows already encoded by other states, see whisper_full_multi()
+static bool whisper_encode_cached(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads,
+ whisper_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    const auto & hparams  = wctx.model.hparams;
+    const auto & kv_cross = wstate.kv_cross;
+
+    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    // the window is already in kv_cross
+    if (wstate.kv_cross_seek == mel_offset && wstate.kv_cross_n_audio_ctx == n_audio_ctx) {
+        return !(abort_callback && abort_callback(abort_callback_data));
+    }
+
+    auto * cache = wstate.encoder_cache;
+
+    if (cache == nullptr) {
+        return whisper_encode_internal(wctx, wstate, mel_offset, n_threads, abort_callback, abort_callback_data);
+    }
+
+    const size_t nbytes_k = ggml_element_size(kv_cross.k)*hparams.n_text_layer*n_audio_ctx*hparams.n_text_state;
+    const size_t nbytes_v = ggml_element_size(kv_cross.v)*hparams.n_text_layer*n_audio_ctx*hparams.n_text_state;
+
+    std::shared_ptr<whisper_encoder_cache::entry> entry;
+
+    bool produce = false;
+
+    {
+        std::unique_lock<std::mutex> lock(cache->mutex);
+
+        for (const auto & e : cache->entries) {
+            if (e->seek == mel_offset && e->n_audio_ctx == n_audio_ctx) {
+                entry = e;
+                break;
+            }
+        }
+
+        if (entry) {
+            cache->cv.wait(lock, [&]() { return entry->ready; });
+        } else {
+            entry = std::make_shared<whisper_encoder_cache::entry>();
+            entry->seek        = mel_offset;
+            entry->n_audio_ctx = n_audio_ctx;
+
+            // evict the oldest finished windows
+            for (size_t i = 0; i < cache->entries.size() && cache->entries.size() >= cache->n_max; ) {
+                if (cache->entries[i]->ready) {
+                    cache->entries.erase(cache->entries.begin() + i);
+                } else {
+                    ++i;
+                }
+            }
+
+            cache->entries.push_back(entry);
+
+            produce = true;
+        }
+    }
+
+    if (!produce && !entry->failed) {
+        const int64_t t_start_us = ggml_time_us();
+
+        ggml_backend_tensor_set(kv_cross.k, entry->k.data(), 0, nbytes_k);
+        ggml_backend_tensor_set(kv_cross.v, entry->v.data(), 0, nbytes_v);
+
+        wstate.kv_cross_seek        = mel_offset;
+        wstate.kv_cross_n_audio_ctx = n_audio_ctx;
+
+        wstate.t_encode_us += ggml_time_us() - t_start_us;
+
+        return !(abort_callback && abort_callback(abort_callback_data));
+    }
+
+    const bool ok = whisper_encode_internal(wctx, wstate, mel_offset, n_threads, abort_callback, abort_callback_data);
+
+    if (produce) {
+        if (ok) {
+            entry->k.resize(nbytes_k);
+            entry->v.resize(nbytes_v);
+
+            ggml_backend_tensor_get(kv_cross.k, entry->k.data(), 0, nbytes_k);
+            ggml_backend_tensor_get(kv_cross.v, entry->v.data(), 0, nbytes_v);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(cache->mutex);
+
+            entry->ready  = true;
+            entry->failed = !ok;
+        }
+
+        cache->cv.notify_all();
+    }
+
+    return ok;
+}
+
+// the decoder graph for the batches of one or more states
+// the token rows of all states go through the same layer norms, projections and MLPs, so that the decoder
+// weights are read once per call. The self-attention and the cross-attention are computed per state (segment),
+// each on the rows of the state, with its own kv_self and kv_cross
+// graph.segs must be set to the states and their batches before the call
 static struct ggml_cgraph * whisper_build_graph_decoder(
          whisper_context & wctx,
-         whisper_state   & wstate,
-     const whisper_batch & batch) {
+          whisper_allocr & allocr,
+   whisper_graph_decoder & graph) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    auto & kv_self = wstate.kv_self;
-
-    WHISPER_ASSERT(!!kv_self.ctx);
+    ggml_allocr * alloc = allocr.alloc;
 
-    ggml_allocr * alloc = wstate.alloc_decode.alloc;
+    const bool measure = ggml_allocr_is_measure(alloc);
 
-    const int n_ctx   = kv_self.size;
     const int n_state = hparams.n_text_state;
     const int n_head  = hparams.n_text_head;
     const int n_layer = hparams.n_text_layer;
 
-    const int n_tokens    = batch.n_tokens;
-    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    auto & segs = graph.segs;
+
+    const int n_segs = segs.size();
 
-    const int32_t n_kv     = ggml_allocr_is_measure(alloc) ? n_ctx            : kv_self.n;
-    const int32_t kv_head  = ggml_allocr_is_measure(alloc) ? n_ctx - n_tokens : kv_self.head;
+    // the vocabulary subset is applied to the output projection only for a single state
+    // with several states, the logits are computed for the whole vocabulary and the subsets are applied to them
+    const auto & vocab_subset = segs[0].wstate->vocab_subset;
+
+    const bool subset = n_segs == 1 && !vocab_subset.empty();
+
+    int n_tokens  = 0;
+    int n_outputs = 0;
+
+    for (auto & seg : segs) {
+        const auto & wstate  = *seg.wstate;
+        const auto & kv_self = wstate.kv_self;
+
+        WHISPER_ASSERT(!!kv_self.ctx);
+
+        seg.n_tokens    = seg.batch->n_tokens;
+        seg.n_outputs   = whisper_batch_n_outputs(*seg.batch);
+        seg.n_kv        = measure ? kv_self.size          : kv_self.n;
+        seg.n_audio_ctx = measure ? hparams.n_audio_ctx   : (wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx);
+        seg.i_token     = n_tokens;
+        seg.i_output    = n_outputs;
+
+        n_tokens  += seg.n_tokens;
+        n_outputs += seg.n_outputs;
+    }
 
     //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.alloc_decode.meta.size(),
-        /*.mem_buffer =*/ wstate.alloc_decode.meta.data(),
+        /*.mem_size   =*/ allocr.meta.size(),
+        /*.mem_buffer =*/ allocr.meta.data(),
         /*.no_alloc   =*/ true,
     };
 
     struct ggml_context * ctx0 = ggml_init(params);
 
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES*n_segs, false);
 
+    graph.valid       = false;
+    graph.n_tokens    = n_tokens;
+    graph.n_outputs   = n_outputs;
+    graph.n_vocab_out = subset ? (int32_t) vocab_subset.size() : hparams.n_vocab;
+    graph.gf          = gf;
+
+    graph.k_store.clear();
+    graph.v_store.clear();
+
+    // the input data is set by whisper_decoder_set_inputs()
     struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
     ggml_allocr_alloc(alloc, embd);
 
-    if (!ggml_allocr_is_measure(alloc)) {
-        ggml_backend_tensor_set(embd, batch.token, 0, n_tokens*ggml_element_size(embd));
-    }
-
     struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
     ggml_allocr_alloc(alloc, position);
 
-    if (!ggml_allocr_is_measure(alloc)) {
-        for (int i = 0; i < n_tokens; ++i) {
-            const int32_t val = batch.pos[i];
-            ggml_backend_tensor_set(position, &val, i*sizeof(int32_t), sizeof(int32_t));
-        }
-    }
-
     const float KQscale = pow(float(n_state)/n_head, -0.25);
 
-    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
-    ggml_allocr_alloc(alloc, KQ_mask);
+    for (auto & seg : segs) {
+        seg.KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, seg.n_kv, seg.n_tokens, 1);
+        ggml_allocr_alloc(alloc, seg.KQ_mask);
 
-    if (!ggml_allocr_is_measure(alloc)) {
-        wstate.inp_mask.resize(n_kv*n_tokens);
+        seg.out_ids = nullptr;
+        seg.aheads  = nullptr;
+    }
 
-        float * data = wstate.inp_mask.data();
-        memset(data, 0, ggml_nbytes(KQ_mask));
+    graph.embd      = embd;
+    graph.position  = position;
+    graph.out_ids   = nullptr;
+    graph.vocab_ids = nullptr;
+    graph.logits    = nullptr;
 
-        for (int h = 0; h < 1; ++h) {
-            for (int j = 0; j < n_tokens; ++j) {
-                const whisper_pos    pos    = batch.pos[j];
-                const whisper_seq_id seq_id = batch.seq_id[j][0];
+    // the rows of the batch for which to compute the outputs
+    if (n_outputs > 0 && n_outputs < n_tokens) {
+        struct ggml_tensor * out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_outputs);
+        ggml_allocr_alloc(alloc, out_ids);
 
-                for (int i = 0; i < n_kv; ++i) {
-                    if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                    }
-                }
+        graph.out_ids = out_ids;
+    }
+
+    // the output rows of each state, for the cross-attention weights of the alignment heads
+    if (!wctx.aheads.empty()) {
+        for (auto & seg : segs) {
+            if (seg.n_outputs == 0 || seg.n_outputs == seg.n_tokens) {
+                continue;
             }
-        }
 
-        ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
+            if (n_segs == 1) {
+                seg.out_ids = graph.out_ids;
+            } else {
+                seg.out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, seg.n_outputs);
+                ggml_allocr_alloc(alloc, seg.out_ids);
+            }
+        }
     }
 
+    // the rows of segment s of a [n_state][n_tokens] tensor
+    auto seg_rows = [&](struct ggml_tensor * t, const whisper_graph_decoder_seg & seg) {
+        if (n_segs == 1) {
+            return t;
+        }
+
+        return ggml_view_2d(ctx0, t, n_state, seg.n_tokens, t->nb[1], seg.i_token*t->nb[1]);
+    };
+
     // token encoding + position encoding
     struct ggml_tensor * cur =
         ggml_add(ctx0,
@@ -2279,26 +2997,11 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
         const auto & layer = model.layers_decoder[il];
 
         // norm
-        {
-            cur = ggml_norm(ctx0, inpL, hparams.eps);
-
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        cur,
-                        layer.attn_ln_0_w),
-                    layer.attn_ln_0_b);
-        }
+        cur = whisper_build_norm(ctx0, inpL, layer.attn_ln_0_w, layer.attn_ln_0_b, hparams.eps);
 
         // self-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
-                    layer.attn_q_w,
-                    cur);
-
-            Qcur = ggml_add(ctx0,
-                        Qcur,
-                        layer.attn_q_b);
+            struct ggml_tensor * Qcur = whisper_build_linear(ctx0, cur, layer.attn_q_w, layer.attn_q_b);
 
             Qcur = ggml_scale(ctx0, Qcur, KQscale);
 
@@ -2309,235 +3012,234 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
             Kcur = ggml_scale(ctx0, Kcur, KQscale);
 
-            // store key and value to memory
-            {
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
-                        layer.attn_v_w,
-                        cur);
+            struct ggml_tensor * Vcur = whisper_build_linear(ctx0, cur, layer.attn_v_w, layer.attn_v_b);
 
-                Vcur = ggml_add(ctx0,
-                            Vcur,
-                            layer.attn_v_b);
+            cur = n_segs == 1 ? nullptr : ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens);
 
-                Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
+            for (const auto & seg : segs) {
+                const auto & kv_self = seg.wstate->kv_self;
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
-                        (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
+                const int n_ctx   = kv_self.size;
+                const int n_cur   = seg.n_tokens;
+                const int n_kv    = seg.n_kv;
+                const int kv_head = measure ? n_ctx - n_cur : kv_self.head;
 
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
-            }
+                // store key and value to memory
+                {
+                    struct ggml_tensor * Ks = seg_rows(Kcur, seg);
+                    struct ggml_tensor * Vs = ggml_transpose(ctx0, seg_rows(Vcur, seg));
+
+                    struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_cur*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                    struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_cur, n_state,
+                            (   n_ctx)*ggml_element_size(kv_self.v),
+                            (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
+
+                    struct ggml_tensor * k_cpy = ggml_cpy(ctx0, Ks, k);
+                    struct ggml_tensor * v_cpy = ggml_cpy(ctx0, Vs, v);
+
+                    if (n_segs == 1) {
+                        graph.k_store.push_back(k);
+                        graph.k_store.push_back(k_cpy);
+                        graph.v_store.push_back(v);
+                        graph.v_store.push_back(v_cpy);
+                    }
 
-            // ------
+                    ggml_build_forward_expand(gf, k_cpy);
+                    ggml_build_forward_expand(gf, v_cpy);
+                }
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+                // ------
 
-            struct ggml_tensor * K =
-                ggml_view_3d(ctx0, kv_self.k,
-                        n_state/n_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state/n_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, seg_rows(Qcur, seg), n_state/n_head, n_head, n_cur),
+                            0, 2, 1, 3);
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                struct ggml_tensor * K =
+                    ggml_view_3d(ctx0, kv_self.k,
+                            n_state/n_head, n_kv, n_head,
+                            ggml_element_size(kv_self.k)*n_state,
+                            ggml_element_size(kv_self.k)*n_state/n_head,
+                            ggml_element_size(kv_self.k)*n_state*n_ctx*il);
 
-            //struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ, n_past);
-            struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ, KQ_mask);
+                //struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+                //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ, n_past);
+                struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ, seg.KQ_mask);
 
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_kv, n_state/n_head, n_head,
-                        n_ctx*ggml_element_size(kv_self.v),
-                        n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
-                        n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_state/n_head, n_head,
+                            n_ctx*ggml_element_size(kv_self.v),
+                            n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
+                            n_ctx*ggml_element_size(kv_self.v)*n_state*il);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens));
-        }
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-        // projection
-        {
-            cur = ggml_mul_mat(ctx0,
-                    layer.attn_ln_1_w,
-                    cur);
+                KQV_merged = ggml_cpy(ctx0,
+                        KQV_merged,
+                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_cur));
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.attn_ln_1_b);
+                cur = n_segs == 1 ? KQV_merged : ggml_set_2d_inplace(ctx0, cur, KQV_merged, cur->nb[1], seg.i_token*cur->nb[1]);
+            }
         }
 
+        // projection
+        cur = whisper_build_linear(ctx0, cur, layer.attn_ln_1_w, layer.attn_ln_1_b);
+
         // add the input
         struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
 
         // norm
-        {
-            cur = ggml_norm(ctx0, inpCA, hparams.eps); // note: we use inpCA here
-
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        cur,
-                        layer.cross_attn_ln_0_w),
-                    layer.cross_attn_ln_0_b);
-        }
+        cur = whisper_build_norm(ctx0, inpCA, layer.cross_attn_ln_0_w, layer.cross_attn_ln_0_b, hparams.eps); // note: we use inpCA here
 
         // cross-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
-                    layer.cross_attn_q_w,
-                    cur);
-
-            Qcur = ggml_add(ctx0,
-                        Qcur,
-                        layer.cross_attn_q_b);
+            struct ggml_tensor * Qcur = whisper_build_linear(ctx0, cur, layer.cross_attn_q_w, layer.cross_attn_q_b);
 
             Qcur = ggml_scale(ctx0, Qcur, KQscale);
 
-            // Kcross is already scaled
-            struct ggml_tensor * Kcross =
-                ggml_view_3d(ctx0, wstate.kv_cross.k,
-                        n_state/n_head, n_audio_ctx, n_head,
-                        ggml_element_size(wstate.kv_cross.k)*n_state,
-                        ggml_element_size(wstate.kv_cross.k)*n_state/n_head,
-                        ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
+            cur = n_segs == 1 ? nullptr : ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens);
 
-            //struct ggml_tensor * Vcross =
-            //    ggml_reshape_3d(ctx0,
-            //            ggml_view_1d(ctx0, wstate.kv_cross.v, n_audio_ctx*n_state, il*n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state),
-            //            n_state/n_head, n_head, n_audio_ctx);
+            for (auto & seg : segs) {
+                const auto & kv_cross = seg.wstate->kv_cross;
 
-            //struct ggml_tensor * V_trans =
-            //    ggml_cpy(ctx0,
-            //            ggml_permute(ctx0, Vcross, 1, 2, 0, 3),
-            //            ggml_new_tensor_3d(ctx0, Vcross->type, n_audio_ctx, n_state/n_head, n_head));
+                const int n_cur       = seg.n_tokens;
+                const int n_audio_ctx = seg.n_audio_ctx;
 
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, wstate.kv_cross.v,
-                        n_audio_ctx, n_state/n_head, n_head,
-                        n_audio_ctx*ggml_element_size(wstate.kv_cross.v),
-                        n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state/n_head,
-                        n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state*il);
+                // Kcross is already scaled
+                struct ggml_tensor * Kcross =
+                    ggml_view_3d(ctx0, kv_cross.k,
+                            n_state/n_head, n_audio_ctx, n_head,
+                            ggml_element_size(kv_cross.k)*n_state,
+                            ggml_element_size(kv_cross.k)*n_state/n_head,
+                            ggml_element_size(kv_cross.k)*n_state*n_audio_ctx*il);
 
-            // ------
+                //struct ggml_tensor * Vcross =
+                //    ggml_reshape_3d(ctx0,
+                //            ggml_view_1d(ctx0, wstate.kv_cross.v, n_audio_ctx*n_state, il*n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state),
+                //            n_state/n_head, n_head, n_audio_ctx);
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+                //struct ggml_tensor * V_trans =
+                //    ggml_cpy(ctx0,
+                //            ggml_permute(ctx0, Vcross, 1, 2, 0, 3),
+                //            ggml_new_tensor_3d(ctx0, Vcross->type, n_audio_ctx, n_state/n_head, n_head));
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_cross.v,
+                            n_audio_ctx, n_state/n_head, n_head,
+                            n_audio_ctx*ggml_element_size(kv_cross.v),
+                            n_audio_ctx*ggml_element_size(kv_cross.v)*n_state/n_head,
+                            n_audio_ctx*ggml_element_size(kv_cross.v)*n_state*il);
 
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale(ctx0,
-            //            KQ,
-            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+                // ------
 
-            // no masking for cross-attention
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, seg_rows(Qcur, seg), n_state/n_head, n_head, n_cur),
+                            0, 2, 1, 3);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ);
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                //struct ggml_tensor * KQ_scaled =
+                //    ggml_scale(ctx0,
+                //            KQ,
+                //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                //            );
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                // no masking for cross-attention
+                //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
 
-            // cur = KQV_merged.contiguous().view(n_state, n_tokens)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens));
-        }
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ);
 
-        // projection
-        {
-            cur = ggml_mul_mat(ctx0,
-                    layer.cross_attn_ln_1_w,
-                    cur);
+                if (seg.n_outputs > 0) {
+                    for (const auto & ahead : wctx.aheads) {
+                        if (ahead.n_text_layer != il) {
+                            continue;
+                        }
+
+                        struct ggml_tensor * w = ggml_view_2d(ctx0, KQ_soft_max, n_audio_ctx, n_cur, KQ_soft_max->nb[1], ahead.n_head*KQ_soft_max->nb[2]);
+
+                        if (seg.out_ids) {
+                            w = ggml_get_rows(ctx0, w, seg.out_ids);
+                        } else {
+                            w = ggml_cont(ctx0, w);
+                        }
+
+                        seg.aheads = seg.aheads ? ggml_concat(ctx0, seg.aheads, w) : w;
+                    }
+                }
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.cross_attn_ln_1_b);
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                // cur = KQV_merged.contiguous().view(n_state, n_tokens)
+                KQV_merged = ggml_cpy(ctx0,
+                        KQV_merged,
+                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_cur));
+
+                cur = n_segs == 1 ? KQV_merged : ggml_set_2d_inplace(ctx0, cur, KQV_merged, cur->nb[1], seg.i_token*cur->nb[1]);
+            }
         }
 
+        // projection
+        cur = whisper_build_linear(ctx0, cur, layer.cross_attn_ln_1_w, layer.cross_attn_ln_1_b);
+
         // add the input
         cur = ggml_add(ctx0, cur, inpCA);
 
-        struct ggml_tensor * inpFF = cur;
-
         // feed-forward network
-        {
-            // norm
-            {
-                cur = ggml_norm(ctx0, inpFF, hparams.eps);
+        inpL = whisper_build_ffn(ctx0, layer, cur, hparams.eps);
+    }
 
-                // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0,
-                            cur,
-                            layer.mlp_ln_w),
-                        layer.mlp_ln_b);
-            }
+    cur = inpL;
 
-            // fully connected
-            cur = ggml_mul_mat(ctx0,
-                    layer.mlp_0_w,
-                    cur);
+    // norm
+    cur = whisper_build_norm(ctx0, cur, model.d_ln_w, model.d_ln_b, hparams.eps);
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.mlp_0_b);
+    if (n_outputs == 0) {
+        ggml_build_forward_expand(gf, cur);
 
-            // GELU activation
-            cur = ggml_gelu(ctx0, cur);
+        ggml_free(ctx0);
 
-            // projection
-            cur = ggml_mul_mat(ctx0,
-                    layer.mlp_1_w,
-                    cur);
+        return gf;
+    }
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.mlp_1_b);
-        }
+    // compute logits only for the tokens flagged in batch.logits
+    if (graph.out_ids) {
+        cur = ggml_get_rows(ctx0, cur, graph.out_ids);
+    }
 
-        inpL = ggml_add(ctx0, cur, inpFF);
+    for (const auto & seg : segs) {
+        if (seg.aheads) {
+            ggml_build_forward_expand(gf, seg.aheads);
+        }
     }
 
-    cur = inpL;
+    // project only onto the token embeddings of the active vocabulary subset
+    struct ggml_tensor * d_te = model.d_te;
 
-    // norm
-    {
-        cur = ggml_norm(ctx0, cur, hparams.eps);
+    if (subset) {
+        struct ggml_tensor * vocab_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, vocab_subset.size());
+        ggml_allocr_alloc(alloc, vocab_ids);
 
-        cur = ggml_add(ctx0,
-                ggml_mul(ctx0,
-                    cur,
-                    model.d_ln_w),
-                model.d_ln_b);
+        graph.vocab_ids = vocab_ids;
+
+        d_te = ggml_get_rows(ctx0, model.d_te, vocab_ids);
     }
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all n_tokens
-    // might be useful in the future
-    //cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    struct ggml_tensor * logits = ggml_mul_mat(ctx0, d_te, cur);
 
-    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    graph.logits = logits;
 
     ggml_build_forward_expand(gf, logits);
 
@@ -2546,34 +3248,206 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     return gf;
 }
 
-// evaluate the decoder
-//
-// given text prompt + audio features -> computes the logits for the next token
-//
-//   - model:      the model
-//   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
-//
-static bool whisper_decode_internal(
-        whisper_context & wctx,
-          whisper_state & wstate,
-    const whisper_batch & batch,
-              const int   n_threads,
- whisper_abort_callback   abort_callback,
-                   void * abort_callback_data) {
-    const int64_t t_start_us = ggml_time_us();
-
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
-
-    const int n_vocab  = hparams.n_vocab;
+// build the self-attention KQ mask [n_tokens][n_kv] of a batch
+static void whisper_kv_cache_build_mask(
+    const whisper_kv_cache & kv_self,
+       const whisper_batch & batch,
+                       int   n_kv,
+                     float * data) {
     const int n_tokens = batch.n_tokens;
 
-    auto & logits_out = wstate.logits;
+    std::fill(data, data + n_kv*n_tokens, -INFINITY);
 
-    struct ggml_tensor * logits;
+    // only the cells in the range of the sequence can be visible
+    for (int h = 0; h < 1; ++h) {
+        for (int j = 0; j < n_tokens; ++j) {
+            const whisper_pos    pos    = batch.pos[j];
+            const whisper_seq_id seq_id = batch.seq_id[j][0];
+
+            const int i0 = kv_self.seq_beg[seq_id];
+            const int i1 = std::min<int>(kv_self.seq_end[seq_id], n_kv);
+
+            for (int i = i0; i < i1; ++i) {
+                if (kv_self.cells[i].has_seq_id(seq_id) && kv_self.cells[i].pos <= pos) {
+                    data[h*(n_kv*n_tokens) + j*n_kv + i] = 0.0f;
+                }
+            }
+        }
+    }
+}
+
+static void whisper_decoder_set_inputs(whisper_graph_decoder & graph) {
+    auto & wstate0 = *graph.segs[0].wstate;
+
+    if (graph.out_ids) {
+        wstate0.inp_out_ids.clear();
+    }
+
+    for (const auto & seg : graph.segs) {
+        auto & wstate = *seg.wstate;
+
+        const auto & batch = *seg.batch;
+
+        const int n_tokens = seg.n_tokens;
+        const int n_kv     = seg.n_kv;
+
+        ggml_backend_tensor_set(graph.embd,     batch.token, seg.i_token*sizeof(int32_t), n_tokens*sizeof(int32_t));
+        ggml_backend_tensor_set(graph.position, batch.pos,   seg.i_token*sizeof(int32_t), n_tokens*sizeof(int32_t));
+
+        wstate.inp_mask.resize(n_kv*n_tokens);
+
+        whisper_kv_cache_build_mask(wstate.kv_self, batch, n_kv, wstate.inp_mask.data());
+
+        ggml_backend_tensor_set(seg.KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(seg.KQ_mask)*sizeof(float));
+
+        if (graph.out_ids) {
+            for (int i = 0; i < n_tokens; ++i) {
+                if (batch.logits[i]) {
+                    wstate0.inp_out_ids.push_back(seg.i_token + i);
+                }
+            }
+        }
+
+        // the output rows of the state, relative to its first row
+        if (seg.out_ids && seg.out_ids != graph.out_ids) {
+            std::vector<int32_t> out_ids;
+            for (int i = 0; i < n_tokens; ++i) {
+                if (batch.logits[i]) {
+                    out_ids.push_back(i);
+                }
+            }
+
+            ggml_backend_tensor_set(seg.out_ids, out_ids.data(), 0, seg.n_outputs*sizeof(int32_t));
+        }
+    }
+
+    if (graph.out_ids) {
+        ggml_backend_tensor_set(graph.out_ids, wstate0.inp_out_ids.data(), 0, graph.n_outputs*sizeof(int32_t));
+    }
+
+    if (graph.vocab_ids) {
+        ggml_backend_tensor_set(graph.vocab_ids, wstate0.vocab_subset.data(), 0, graph.n_vocab_out*sizeof(int32_t));
+    }
+}
+
+// copy the logits and the alignment heads weights of the output rows to the states
+static void whisper_decoder_get_outputs(whisper_graph_decoder & graph, int n_vocab) {
+    const int n_vocab_out = graph.n_vocab_out;
+
+    for (const auto & seg : graph.segs) {
+        auto & wstate = *seg.wstate;
+
+        const auto & batch = *seg.batch;
+
+        auto & logits_out = wstate.logits;
+        logits_out.resize(seg.n_tokens*n_vocab);
+
+        // the logits tensor contains only the rows of the flagged tokens
+        if (wstate.vocab_subset.empty()) {
+            for (int i = 0, i_out = seg.i_output; i < seg.n_tokens; i++) {
+                if (batch.logits[i] == 0) {
+                    continue;
+                }
+                ggml_backend_tensor_get(graph.logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i_out), sizeof(float)*n_vocab);
+                i_out++;
+            }
+        } else {
+            // scatter the logits of the vocabulary subset, the rest of the tokens cannot be sampled
+            // graph.vocab_ids is set if the logits were computed only for the subset
+            const auto & vocab_subset = wstate.vocab_subset;
+
+            auto & logits_subset = wstate.logits_subset;
+            logits_subset.resize(seg.n_outputs*n_vocab_out);
+
+            if (seg.n_outputs > 0) {
+                ggml_backend_tensor_get(graph.logits, logits_subset.data(), sizeof(float)*seg.i_output*n_vocab_out, sizeof(float)*seg.n_outputs*n_vocab_out);
+            }
+
+            for (int i = 0, i_out = 0; i < seg.n_tokens; i++) {
+                if (batch.logits[i] == 0) {
+                    continue;
+                }
+
+                float * dst = logits_out.data() + n_vocab*i;
+                std::fill(dst, dst + n_vocab, -INFINITY);
+
+                const float * src = logits_subset.data() + n_vocab_out*i_out;
+                for (int j = 0; j < (int) vocab_subset.size(); ++j) {
+                    dst[vocab_subset[j]] = src[graph.vocab_ids ? j : vocab_subset[j]];
+                }
+                i_out++;
+            }
+        }
+
+        if (seg.aheads) {
+            wstate.aheads_n_audio_ctx = seg.n_audio_ctx;
+            wstate.aheads_cross.resize(ggml_nelements(seg.aheads));
+
+            ggml_backend_tensor_get(seg.aheads, wstate.aheads_cross.data(), 0, ggml_nbytes(seg.aheads));
+        }
+    }
+}
+
+// point the KV cache views of a previously built single-state decoder graph to the new kv_self.head
+// must match the offsets used in whisper_build_graph_decoder()
+// only valid for backends where the data pointer of a tensor is its address in the backend (CPU): other backends
+// (e.g. CUDA) keep their own device pointer of the view, set when the view is allocated
+static void whisper_decoder_set_kv_head(
+          whisper_state & wstate,
+                    int   n_state,
+                    int   kv_head) {
+    const auto & kv_self = wstate.kv_self;
+    const auto & graph   = wstate.graph_decoder;
+
+    const size_t n_ctx = kv_self.size;
+
+    for (size_t i = 0; i < graph.k_store.size(); ++i) {
+        const size_t il   = i/2;
+        const size_t offs = (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head);
+
+        graph.k_store[i]->view_offs = offs;
+        graph.k_store[i]->data      = (char *) kv_self.k->data + offs;
+    }
+
+    for (size_t i = 0; i < graph.v_store.size(); ++i) {
+        const size_t il   = i/2;
+        const size_t offs = (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v);
+
+        graph.v_store[i]->view_offs = offs;
+        graph.v_store[i]->data      = (char *) kv_self.v->data + offs;
+    }
+}
+
+// evaluate the decoder
+//
+// given text prompt + audio features -> computes the logits for the next token
+//
+//   - model:      the model
+//   - n_threads:  number of threads to use
+//   - tokens:     text prompt
+//   - n_tokens:   number of tokens in the prompt
+//   - n_past:     number of past tokens to prefix the prompt with
+//
+static bool whisper_decode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+    const whisper_batch & batch,
+              const int   n_threads,
+ whisper_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_vocab   = hparams.n_vocab;
+    const int n_tokens  = batch.n_tokens;
+    const int n_outputs = whisper_batch_n_outputs(batch);
+
+    if (n_outputs > wstate.n_outputs_max) {
+        WHISPER_LOG_ERROR("%s: too many output tokens in the batch (%d > %d)\n", __func__, n_outputs, wstate.n_outputs_max);
+        return false;
+    }
 
     // find KV slot for the batch
     {
@@ -2583,35 +3457,52 @@ static bool whisper_decode_internal(
             return false;
         }
 
-        kv_self.n = whisper_kv_cache_cell_max(kv_self);
-        //kv_self.n = std::min((int32_t) hparams.n_text_ctx, std::max(32, whisper_kv_cache_cell_max(kv_self)));
+        // pad the number of attended cells, so that consecutive calls can reuse the same graph
+        // the padding cells are masked out
+        kv_self.n = std::min(kv_self.size, (uint32_t) GGML_PAD(whisper_kv_cache_cell_max(kv_self), WHISPER_KV_PAD));
         //printf("n_tokens = %5d, kv_self.head = %5d, kv_self.n = %5d, seq_id = %5d\n", batch.n_tokens, kv_self.head, kv_self.n, batch.seq_id[0][0]);
     }
 
+    auto & graph = wstate.graph_decoder;
+
     // decoder
     {
-        auto & alloc = wstate.alloc_decode.alloc;
+        const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+        // the graph is reused only on the CPU backend, see whisper_decoder_set_kv_head()
+        const bool reuse =
+            ggml_backend_is_cpu(wstate.backend) &&
+            graph.valid &&
+            graph.n_tokens            == n_tokens &&
+            graph.n_outputs           == n_outputs &&
+            graph.segs[0].n_kv        == (int32_t) wstate.kv_self.n &&
+            graph.segs[0].n_audio_ctx == n_audio_ctx &&
+            graph.n_vocab_out         == (wstate.vocab_subset.empty() ? n_vocab : (int32_t) wstate.vocab_subset.size());
+
+        graph.segs[0].batch = &batch;
+
+        if (reuse) {
+            whisper_decoder_set_kv_head(wstate, hparams.n_text_state, wstate.kv_self.head);
+        } else {
+            auto & alloc = wstate.alloc_decode.alloc;
 
-        ggml_allocr_reset(alloc);
+            ggml_allocr_reset(alloc);
 
-        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch);
+            whisper_build_graph_decoder(wctx, wstate.alloc_decode, graph);
 
-        ggml_allocr_alloc_graph(alloc, gf);
+            ggml_allocr_alloc_graph(alloc, graph.gf);
+
+            graph.valid = true;
+        }
 
-        logits = gf->nodes[gf->n_nodes - 1];
+        whisper_decoder_set_inputs(graph);
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(wstate.backend, graph.gf, n_threads, whisper_get_threadpool(wstate, n_threads))) {
             return false;
         }
     }
 
-    logits_out.resize(n_tokens*n_vocab);
-    for (int i = 0; i < n_tokens; i++) {
-        if (batch.logits[i] == 0) {
-            continue;
-        }
-        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
-    }
+    whisper_decoder_get_outputs(graph, n_vocab);
 
     if (batch.n_tokens > 1) {
         //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
@@ -2636,2369 +3527,3846 @@ static bool whisper_decode_internal(
     return !(abort_callback && abort_callback(abort_callback_data));
 }
 
-//  500 -> 00:05.000
-// 6000 -> 01:00.000
-static std::string to_timestamp(int64_t t, bool comma = false) {
-    int64_t msec = t * 10;
-    int64_t hr = msec / (1000 * 60 * 60);
-    msec = msec - hr * (1000 * 60 * 60);
-    int64_t min = msec / (1000 * 60);
-    msec = msec - min * (1000 * 60);
-    int64_t sec = msec / 1000;
-    msec = msec - sec * 1000;
+// measure the worst-case memory usage of the decoder graph
+// depends on the active vocabulary subset, so it is re-measured when the subset changes
+static void whisper_allocr_graph_init_decoder(whisper_context & wctx, whisper_state & wstate) {
+    whisper_allocr_graph_init(wstate.alloc_decode, wctx.backend,
+            [&]() {
+                const auto & hparams = wctx.model.hparams;
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+                // TODO: make sure this is the worst-case scenario
+                const int n_tokens = hparams.n_text_ctx;
+                const int n_past   = 0;
 
-    return std::string(buf);
-}
+                whisper_batch_prep_legacy(wstate.batch, nullptr, n_tokens, n_past, 0);
 
-#define SIN_COS_N_COUNT WHISPER_N_FFT
-static float sin_vals[SIN_COS_N_COUNT];
-static float cos_vals[SIN_COS_N_COUNT];
+                // the logits are computed only for the flagged tokens, so reserve for the max number of them
+                for (int i = 0; i < std::min(n_tokens, wstate.n_outputs_max); ++i) {
+                    wstate.batch.logits[n_tokens - 1 - i] = 1;
+                }
 
-// In FFT, we frequently use sine and cosine operations with the same values.
-// We can use precalculated values to speed up the process.
-static void fill_sin_cos_table() {
-    static bool is_filled = false;
-    if (is_filled) return;
-    for (int i = 0; i < SIN_COS_N_COUNT; i++) {
-        double theta = (2*M_PI*i)/SIN_COS_N_COUNT;
-        sin_vals[i] = sinf(theta);
-        cos_vals[i] = cosf(theta);
-    }
-    is_filled = true;
+                auto & graph = wstate.graph_decoder;
+
+                graph.segs.resize(1);
+                graph.segs[0].wstate = &wstate;
+                graph.segs[0].batch  = &wstate.batch;
+
+                return whisper_build_graph_decoder(wctx, wstate.alloc_decode, graph);
+            });
 }
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const std::vector<float> & in, std::vector<float> & out) {
-    int N = in.size();
+// measure the compute buffer of whisper_decode_batch() for the largest batch it builds in one graph:
+// WHISPER_BATCH_MAX_STATES states of WHISPER_MAX_DECODERS tokens each, with logits for all of them
+// the measure graph uses the KV caches of wstate for all the states, only their sizes matter
+static void whisper_allocr_graph_init_batch(whisper_context & wctx, whisper_state & wstate) {
+    auto & allocr = wctx.alloc_batch;
 
-    out.resize(N*2);
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
+    const int n_nodes = WHISPER_MAX_NODES*WHISPER_BATCH_MAX_STATES;
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+    allocr.alloc = ggml_allocr_new_measure_from_backend(wctx.backend);
+    allocr.meta.resize(ggml_tensor_overhead()*n_nodes + ggml_graph_overhead_custom(n_nodes, false));
 
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*cos_vals[idx]; // cos(t)
-            im -= in[n]*sin_vals[idx]; // sin(t)
-        }
+    whisper_batch batch = whisper_batch_init(WHISPER_MAX_DECODERS, 1);
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
+    whisper_batch_prep_legacy(batch, nullptr, WHISPER_MAX_DECODERS, 0, 0);
+    for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
+        batch.token [i] = 0;
+        batch.logits[i] = 1;
     }
-}
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(const std::vector<float> & in, std::vector<float> & out) {
-    out.resize(in.size()*2);
+    // the measure is done without vocabulary subsets, they are not applied to the output projection of several states
+    std::vector<int32_t> vocab_subset;
+    std::swap(vocab_subset, wstate.vocab_subset);
 
-    int N = in.size();
+    auto & graph = wctx.graph_batch;
 
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
+    graph.segs.assign(WHISPER_BATCH_MAX_STATES, whisper_graph_decoder_seg());
+    for (auto & seg : graph.segs) {
+        seg.wstate = &wstate;
+        seg.batch  = &batch;
     }
 
-    if (N%2 == 1) {
-        dft(in, out);
-        return;
-    }
+    ggml_allocr_alloc_graph(allocr.alloc, whisper_build_graph_decoder(wctx, allocr, graph));
 
-    std::vector<float> even;
-    std::vector<float> odd;
+    std::swap(vocab_subset, wstate.vocab_subset);
 
-    even.reserve(N/2);
-    odd.reserve(N/2);
+    whisper_batch_free(batch);
 
-    for (int i = 0; i < N; i++) {
-        if (i % 2 == 0) {
-            even.push_back(in[i]);
-        } else {
-            odd.push_back(in[i]);
-        }
-    }
+    WHISPER_LOG_INFO("%s: compute buffer (batch)  = %7.2f MB\n", __func__, whisper_allocr_size(allocr) / 1e6);
 
-    std::vector<float> even_fft;
-    std::vector<float> odd_fft;
+    whisper_allocr_graph_realloc(allocr, wctx.backend);
+}
 
-    fft(even, even_fft);
-    fft(odd, odd_fft);
+// decode the batches of several states (at most WHISPER_BATCH_MAX_STATES, each of at most WHISPER_MAX_DECODERS
+// tokens) in one graph, with the compute buffer of the context
+static bool whisper_decode_batch_internal(
+        whisper_context & wctx,
+        whisper_state  ** states,
+              const int   n_states,
+              const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < N/2; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = cos_vals[idx]; // cos(t)
-        float im = -sin_vals[idx]; // sin(t)
+    const int n_vocab = wctx.model.hparams.n_vocab;
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+    std::lock_guard<std::mutex> lock(wctx.batch_mutex);
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+    if (wctx.alloc_batch.alloc == nullptr) {
+        whisper_allocr_graph_init_batch(wctx, *states[0]);
+    }
 
-        out[2*(k + N/2) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + N/2) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+    // find KV slots for the batches
+    for (int s = 0; s < n_states; ++s) {
+        auto & kv_self = states[s]->kv_self;
+
+        if (!whisper_kv_cache_find_slot(kv_self, states[s]->batch)) {
+            WHISPER_LOG_ERROR("%s: failed to find a KV cache slot for state %d\n", __func__, s);
+            return false;
+        }
+
+        kv_self.n = std::min(kv_self.size, (uint32_t) GGML_PAD(whisper_kv_cache_cell_max(kv_self), WHISPER_KV_PAD));
     }
-}
 
-static bool hann_window(int length, bool periodic, std::vector<float> & output) {
-    if (output.size() < static_cast<size_t>(length)) {
-        output.resize(length);
+    auto & graph  = wctx.graph_batch;
+    auto & allocr = wctx.alloc_batch;
+
+    graph.segs.assign(n_states, whisper_graph_decoder_seg());
+    for (int s = 0; s < n_states; ++s) {
+        graph.segs[s].wstate = states[s];
+        graph.segs[s].batch  = &states[s]->batch;
     }
-    int offset = -1;
-    if (periodic) {
-        offset = 0;
+
+    ggml_allocr_reset(allocr.alloc);
+
+    whisper_build_graph_decoder(wctx, allocr, graph);
+
+    ggml_allocr_alloc_graph(allocr.alloc, graph.gf);
+
+    whisper_decoder_set_inputs(graph);
+
+    auto & wstate0 = *states[0];
+
+    if (!ggml_graph_compute_helper(wstate0.backend, graph.gf, n_threads, whisper_get_threadpool(wstate0, n_threads))) {
+        return false;
     }
-    for (int i = 0; i < length; i++) {
-        output[i] = 0.5*(1.0 - cosf((2.0*M_PI*i)/(length + offset)));
+
+    whisper_decoder_get_outputs(graph, n_vocab);
+
+    const int64_t t_us = ggml_time_us() - t_start_us;
+
+    for (int s = 0; s < n_states; ++s) {
+        auto & wstate = *states[s];
+
+        if (wstate.batch.n_tokens == 1) {
+            wstate.t_decode_us += t_us;
+            wstate.n_decode++;
+        } else {
+            wstate.t_batchd_us += t_us;
+            wstate.n_batchd += wstate.batch.n_tokens;
+        }
     }
 
     return true;
 }
 
-static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const std::vector<float> & samples,
-                                              int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size, 0.0);
-    std::vector<float> fft_out(2 * frame_step);
-    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    int n_fft = 1 + (frame_size / 2);
-    int i = ith;
-
-    // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
-        const int offset = i * frame_step;
+// inputs and output of the graph built by whisper_build_graph_lang_batch()
+struct whisper_graph_lang_batch {
+    struct ggml_tensor * mel      = nullptr; // [n_clips][n_mels][2*n_ctx]
+    struct ggml_tensor * embd     = nullptr; // the SOT token of each clip
+    struct ggml_tensor * position = nullptr;
+    struct ggml_tensor * lang     = nullptr; // the language tokens
+    struct ggml_tensor * logits   = nullptr; // [n_clips][n_lang]
+};
 
-        // apply Hanning window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
-            fft_in[j] = hann[j] * samples[offset + j];
-        }
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
-        }
+// language identification of several clips with the same audio_ctx in a single graph
+// the encoder processes the frames of all clips together, except for the convolutions and the self-attention,
+// which are computed per clip. The cross-attention K and V are computed from the encoder output directly, without
+// going through kv_cross. The decoder evaluates the SOT token of each clip and only the logits of the
+// language tokens are computed
+// the self-attention of a single token returns its value, so the decoder self-attention is reduced to the V projection
+static struct ggml_cgraph * whisper_build_graph_lang_batch(
+          whisper_context & wctx,
+           whisper_allocr & allocr,
+                      int   n_clips,
+                      int   n_ctx,
+                      int   n_lang,
+ whisper_graph_lang_batch & graph) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
 
-        // FFT
-        fft(fft_in, fft_out);
+    ggml_allocr * alloc = allocr.alloc;
 
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < frame_size; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
+    const int n_mels       = hparams.n_mels;
+    const int n_state      = hparams.n_audio_state;
+    const int n_layer      = hparams.n_audio_layer;
+    const int n_text_state = hparams.n_text_state;
+    const int n_text_head  = hparams.n_text_head;
+    const int n_text_layer = hparams.n_text_layer;
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
+    const int n_rows = n_ctx*n_clips;
 
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ allocr.meta.size(),
+        /*.mem_buffer =*/ allocr.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
 
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
+    struct ggml_context * ctx0 = ggml_init(params);
 
-            sum = log10(std::max(sum, 1e-10));
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES + 16*n_clips, false);
 
-            mel.data[j * mel.n_len + i] = sum;
-        }
-    }
+    graph.mel = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels, n_clips);
+    ggml_allocr_alloc(alloc, graph.mel);
 
-    // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
-    for (; i < mel.n_len; i += n_threads) {
-        for (int j = 0; j < mel.n_mel; j++) {
-            mel.data[j * mel.n_len + i] = sum;
-        }
-    }
-}
+    graph.embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_clips);
+    ggml_allocr_alloc(alloc, graph.embd);
 
-// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
-static bool log_mel_spectrogram(
-              whisper_state & wstate,
-              const float * samples,
-              const int   n_samples,
-              const int   /*sample_rate*/,
-              const int   frame_size,
-              const int   frame_step,
-              const int   n_mel,
-              const int   n_threads,
-              const whisper_filters & filters,
-              const bool   debug,
-              whisper_mel & mel) {
-    const int64_t t_start_us = ggml_time_us();
+    graph.position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_clips);
+    ggml_allocr_alloc(alloc, graph.position);
 
-    // Hanning window (Use cosf to eliminate difference)
-    // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
-    // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
-    std::vector<float> hann;
-    hann_window(frame_size, true, hann);
+    graph.lang = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_lang);
+    ggml_allocr_alloc(alloc, graph.lang);
 
+    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, model.e_pe->nb[1], 0);
 
-    // Calculate the length of padding
-    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
-    int64_t stage_2_pad = frame_size / 2;
+    // convolutions + position encoding, per clip
+    struct ggml_tensor * cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_rows);
 
-    // Initialize a vector and copy data from C array to it.
-    std::vector<float> samples_padded;
-    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
-    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+    for (int c = 0; c < n_clips; ++c) {
+        struct ggml_tensor * mel = ggml_view_2d(ctx0, graph.mel, 2*n_ctx, n_mels, graph.mel->nb[1], c*graph.mel->nb[2]);
 
-    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
-    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+        struct ggml_tensor * x = whisper_build_conv(ctx0, model, mel);
 
-    // reflective pad 200 samples at the beginning of audio
-    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+        x = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, x)));
 
-    mel.n_mel     = n_mel;
-    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
-    // Calculate number of frames + remove the last frame
-    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
-    // Calculate semi-padded sample length to ensure compatibility
-    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
-    mel.data.resize(mel.n_mel * mel.n_len);
+        cur = ggml_set_2d_inplace(ctx0, cur, x, cur->nb[1], c*n_ctx*cur->nb[1]);
+    }
+
+    // encoder
+    for (int il = 0; il < n_layer; ++il) {
+        cur = whisper_build_encoder_layer(ctx0, wctx, model.layers_encoder[il], cur, n_ctx, n_clips);
+    }
 
+    struct ggml_tensor * embd_enc = whisper_build_norm(ctx0, cur, model.e_ln_w, model.e_ln_b, hparams.eps);
 
+    // decoder - the SOT token of each clip
     {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples_padded,
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
-        }
+        const float KQscale = pow(float(n_text_state)/n_text_head, -0.25);
 
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+        cur = ggml_add(ctx0,
+                ggml_get_rows(ctx0, model.d_te, graph.embd),
+                ggml_get_rows(ctx0, model.d_pe, graph.position));
 
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
-        }
-    }
+        struct ggml_tensor * inpL = cur;
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
-        }
-    }
+        for (int il = 0; il < n_text_layer; ++il) {
+            const auto & layer = model.layers_decoder[il];
 
-    mmax -= 8.0;
+            // norm
+            cur = whisper_build_norm(ctx0, inpL, layer.attn_ln_0_w, layer.attn_ln_0_b, hparams.eps);
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
+            // self-attention
+            cur = whisper_build_linear(ctx0, cur, layer.attn_v_w, layer.attn_v_b);
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
-    }
+            // projection
+            cur = whisper_build_linear(ctx0, cur, layer.attn_ln_1_w, layer.attn_ln_1_b);
 
-    wstate.t_mel_us += ggml_time_us() - t_start_us;
+            // add the input
+            struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
 
-    // Dump log_mel_spectrogram
-    if (debug) {
-        std::ofstream outFile("log_mel_spectrogram.json");
-        outFile << "[";
-        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
-            outFile << mel.data[i] << ", ";
-        }
-        outFile << mel.data[mel.data.size() - 1] << "]";
-        outFile.close();
-    }
+            // norm
+            cur = whisper_build_norm(ctx0, inpCA, layer.cross_attn_ln_0_w, layer.cross_attn_ln_0_b, hparams.eps);
 
-    return true;
-}
+            // cross-attention, per clip
+            {
+                struct ggml_tensor * Qcur = whisper_build_linear(ctx0, cur, layer.cross_attn_q_w, layer.cross_attn_q_b);
+                Qcur = ggml_scale(ctx0, Qcur, KQscale);
 
-// split text into tokens
-//
-// ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
-//
-// Regex (Python):
-// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
-//
-// Regex (C++):
-// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
-//
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+                struct ggml_tensor * Kcross = ggml_mul_mat(ctx0, layer.cross_attn_k_w, embd_enc);
+                Kcross = ggml_scale(ctx0, Kcross, KQscale);
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+                struct ggml_tensor * Vcross = whisper_build_linear(ctx0, embd_enc, layer.cross_attn_v_w, layer.cross_attn_v_b);
 
-        std::regex re(pat);
-        std::smatch m;
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_4d(ctx0, Qcur, n_text_state/n_text_head, n_text_head, 1, n_clips),
+                            0, 2, 1, 3);
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
-        }
-    }
+                struct ggml_tensor * K =
+                    ggml_permute(ctx0,
+                            ggml_reshape_4d(ctx0, Kcross, n_text_state/n_text_head, n_text_head, n_ctx, n_clips),
+                            0, 2, 1, 3);
 
-    // find the longest tokens that form the words:
-    std::vector<whisper_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.empty()) continue;
-
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            bool found = false;
-            while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    found = true;
-                    break;
-                }
-                --j;
-            }
-            if (!found) {
-                WHISPER_LOG_ERROR("unknown token\n");
-                ++i;
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                // no masking for cross-attention
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ);
+
+                struct ggml_tensor * V =
+                    ggml_cont(ctx0,
+                            ggml_permute(ctx0,
+                                ggml_reshape_4d(ctx0, Vcross, n_text_state/n_text_head, n_text_head, n_ctx, n_clips),
+                                1, 2, 0, 3));
+
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                cur = ggml_cpy(ctx0,
+                        KQV_merged,
+                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_text_state, n_clips));
             }
+
+            // projection
+            cur = whisper_build_linear(ctx0, cur, layer.cross_attn_ln_1_w, layer.cross_attn_ln_1_b);
+
+            // add the input
+            cur = ggml_add(ctx0, cur, inpCA);
+
+            // feed-forward network
+            inpL = whisper_build_ffn(ctx0, layer, cur, hparams.eps);
         }
+
+        // norm
+        cur = whisper_build_norm(ctx0, inpL, model.d_ln_w, model.d_ln_b, hparams.eps);
     }
 
-    return tokens;
+    // the logits of the language tokens only
+    graph.logits = ggml_mul_mat(ctx0, ggml_get_rows(ctx0, model.d_te, graph.lang), cur);
+
+    ggml_build_forward_expand(gf, graph.logits);
+
+    ggml_free(ctx0);
+
+    return gf;
 }
 
-//
-// interface implementation
-//
+// measure the compute buffer of whisper_lang_batch_internal() once, for all the groups it can be called with
+// a group has n_clips clips of n_ctx frames each, with n_ctx a multiple of WHISPER_LANG_CTX_PAD (or n_audio_ctx)
+// and n_clips*n_ctx <= n_audio_ctx. The memory grows with n_clips, so the largest group of each n_ctx is measured
+static void whisper_allocr_graph_init_lang(whisper_context & wctx, whisper_state & wstate, int n_lang) {
+    auto & allocr = wstate.alloc_lang;
 
-#ifdef WHISPER_USE_COREML
-// replace .bin with -encoder.mlmodelc
-static std::string whisper_get_coreml_path_encoder(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
-    }
+    const int n_audio_ctx = wctx.model.hparams.n_audio_ctx;
+    const int n_nodes     = WHISPER_MAX_NODES + 16*std::max(1, n_audio_ctx/WHISPER_LANG_CTX_PAD);
 
-    // match "-qx_x"
-    pos = path_bin.rfind('-');
-    if (pos != std::string::npos) {
-        auto sub = path_bin.substr(pos);
-        if (sub.size() == 5 && sub[1] == 'q' && sub[3] == '_') {
-            path_bin = path_bin.substr(0, pos);
+    allocr.alloc = ggml_allocr_new_measure_from_backend(wctx.backend);
+    allocr.meta.resize(ggml_tensor_overhead()*n_nodes + ggml_graph_overhead_custom(n_nodes, false));
+
+    whisper_graph_lang_batch graph;
+
+    for (int n_ctx = WHISPER_LANG_CTX_PAD; ; n_ctx += WHISPER_LANG_CTX_PAD) {
+        n_ctx = std::min(n_ctx, n_audio_ctx);
+
+        ggml_allocr_reset(allocr.alloc);
+        ggml_allocr_alloc_graph(allocr.alloc, whisper_build_graph_lang_batch(wctx, allocr, n_audio_ctx/n_ctx, n_ctx, n_lang, graph));
+
+        if (n_ctx == n_audio_ctx) {
+            break;
         }
     }
 
-    path_bin += "-encoder.mlmodelc";
+    WHISPER_LOG_INFO("%s: compute buffer (lang)   = %7.2f MB\n", __func__, whisper_allocr_size(allocr) / 1e6);
 
-    return path_bin;
+    whisper_allocr_graph_realloc(allocr, wctx.backend);
 }
-#endif
 
-#ifdef WHISPER_USE_OPENVINO
-// replace .bin with-encoder-openvino.xml
-static std::string whisper_openvino_get_path_encoder(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
+// language identification of a group of clips with the same audio_ctx
+// mels[c] is the log mel spectrogram of clip c, logits is filled with [n_clips][n_lang] logits of the language tokens
+static bool whisper_lang_batch_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+     const whisper_mel ** mels,
+                    int   n_clips,
+                    int   n_ctx,
+    const whisper_token * lang_tokens,
+                    int   n_lang,
+                    int   n_threads,
+                  float * logits) {
+    const int64_t t_start_us = ggml_time_us();
+
+    auto & allocr = wstate.alloc_lang;
+
+    if (allocr.alloc == nullptr) {
+        whisper_allocr_graph_init_lang(wctx, wstate, n_lang);
     }
 
-    path_bin += "-encoder-openvino.xml";
+    whisper_graph_lang_batch graph;
 
-    return path_bin;
-}
+    ggml_allocr_reset(allocr.alloc);
 
-static std::string whisper_openvino_get_path_cache(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
-    }
+    ggml_cgraph * gf = whisper_build_graph_lang_batch(wctx, allocr, n_clips, n_ctx, n_lang, graph);
 
-    path_bin += "-encoder-openvino-cache";
+    ggml_allocr_alloc_graph(allocr.alloc, gf);
 
-    return path_bin;
-}
-#endif
+    // set the inputs
+    {
+        const int n_mels = wctx.model.hparams.n_mels;
 
-struct whisper_state * whisper_init_state(whisper_context * ctx) {
-    fill_sin_cos_table();
+        wstate.inp_mel.resize(ggml_nelements(graph.mel));
 
-    whisper_state * state = new whisper_state;
+        float * dst = wstate.inp_mel.data();
+        std::fill(wstate.inp_mel.begin(), wstate.inp_mel.end(), 0.0f);
 
-    state->backend = whisper_backend_init(ctx->params);
+        for (int c = 0; c < n_clips; ++c) {
+            const auto & mel = *mels[c];
 
-    // at this point, we don't know yet how many decoders will be used, so we overallocate 3x ctx
-    // in theory, there can be a case where this is not enough, but in practice it should always be enough
-    const int factor = 3;
+            const int n_len = std::min(2*n_ctx, mel.n_len);
 
-    if (!kv_cache_init(ctx->model.hparams, state->kv_self, ctx->backend, ctx->itype, factor*ctx->model.hparams.n_text_ctx)) {
-        WHISPER_LOG_ERROR("%s: kv_cache_init() failed for self-attention cache\n", __func__);
-        delete state;
-        return nullptr;
-    }
+            for (int j = 0; j < n_mels; ++j) {
+                memcpy(dst + (c*n_mels + j)*2*n_ctx, mel.data.data() + j*mel.n_len, n_len*sizeof(float));
+            }
+        }
 
-    {
-        const size_t memory_size = ggml_nbytes(state->kv_self.k) + ggml_nbytes(state->kv_self.v);
-        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
-    }
+        ggml_backend_tensor_set(graph.mel, dst, 0, ggml_nbytes(graph.mel));
 
-    if (!kv_cache_init(ctx->model.hparams, state->kv_cross, ctx->backend, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
-        WHISPER_LOG_ERROR("%s: kv_cache_init() failed for cross-attention cache\n", __func__);
-        delete state;
-        return nullptr;
-    }
+        const whisper_token token_sot = wctx.vocab.token_sot;
 
-    {
-        const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
-        WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1e6);
-    }
+        std::vector<int32_t> inp(n_clips, token_sot);
+        ggml_backend_tensor_set(graph.embd, inp.data(), 0, n_clips*sizeof(int32_t));
 
-#ifdef WHISPER_USE_COREML
-    const auto path_coreml = whisper_get_coreml_path_encoder(ctx->path_model);
+        std::fill(inp.begin(), inp.end(), 0);
+        ggml_backend_tensor_set(graph.position, inp.data(), 0, n_clips*sizeof(int32_t));
 
-    WHISPER_LOG_INFO("%s: loading Core ML model from '%s'\n", __func__, path_coreml.c_str());
-    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
+        ggml_backend_tensor_set(graph.lang, lang_tokens, 0, n_lang*sizeof(int32_t));
+    }
 
-    state->ctx_coreml = whisper_coreml_init(path_coreml.c_str());
-    if (!state->ctx_coreml) {
-        WHISPER_LOG_ERROR("%s: failed to load Core ML model from '%s'\n", __func__, path_coreml.c_str());
-#ifndef WHISPER_COREML_ALLOW_FALLBACK
-        delete state;
-        return nullptr;
-#endif
-    } else {
-        WHISPER_LOG_INFO("%s: Core ML model loaded\n", __func__);
+    if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads, whisper_get_threadpool(wstate, n_threads))) {
+        return false;
     }
-#endif
 
-    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+    ggml_backend_tensor_get(graph.logits, logits, 0, n_clips*n_lang*sizeof(float));
 
-    state->batch = whisper_batch_init(ctx->model.hparams.n_text_ctx, WHISPER_MAX_DECODERS);
+    wstate.t_encode_us += ggml_time_us() - t_start_us;
+    wstate.n_encode++;
 
-    // TAGS: WHISPER_DECODER_INIT
-    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
+    return true;
+}
 
-    state->decoders[0].probs.reserve    (ctx->vocab.n_vocab);
-    state->decoders[0].logits.reserve   (ctx->vocab.n_vocab);
-    state->decoders[0].logprobs.reserve (ctx->vocab.n_vocab);
-    state->decoders[0].logits_id.reserve(ctx->model.hparams.n_vocab);
-
-    state->decoders[0].rng = std::mt19937(0);
-
-    // conv allocator
-    {
-        whisper_allocr_graph_init(state->alloc_conv, ctx->backend,
-                [&]() {
-                    return whisper_build_graph_conv(*ctx, *state, 0);
-                });
-
-        WHISPER_LOG_INFO("%s: compute buffer (conv)   = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_conv) / 1e6);
-    }
+//  500 -> 00:05.000
+// 6000 -> 01:00.000
+static std::string to_timestamp(int64_t t, bool comma = false) {
+    int64_t msec = t * 10;
+    int64_t hr = msec / (1000 * 60 * 60);
+    msec = msec - hr * (1000 * 60 * 60);
+    int64_t min = msec / (1000 * 60);
+    msec = msec - min * (1000 * 60);
+    int64_t sec = msec / 1000;
+    msec = msec - sec * 1000;
 
-    // encoder allocator
-    if (!whisper_encode_external(*state)) {
-        whisper_allocr_graph_init(state->alloc_encode, ctx->backend,
-                [&]() {
-                    return whisper_build_graph_encoder(*ctx, *state);
-                });
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
 
-        WHISPER_LOG_INFO("%s: compute buffer (encode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_encode) / 1e6);
-    }
+    return std::string(buf);
+}
 
-    // cross allocator
-    {
-        whisper_allocr_graph_init(state->alloc_cross, ctx->backend,
-                [&]() {
-                    return whisper_build_graph_cross(*ctx, *state);
-                });
+#define SIN_COS_N_COUNT WHISPER_N_FFT
+static float sin_vals[SIN_COS_N_COUNT];
+static float cos_vals[SIN_COS_N_COUNT];
 
-        WHISPER_LOG_INFO("%s: compute buffer (cross)  = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_cross) / 1e6);
+// In FFT, we frequently use sine and cosine operations with the same values.
+// We can use precalculated values to speed up the process.
+static void fill_sin_cos_table() {
+    static bool is_filled = false;
+    if (is_filled) return;
+    for (int i = 0; i < SIN_COS_N_COUNT; i++) {
+        double theta = (2*M_PI*i)/SIN_COS_N_COUNT;
+        sin_vals[i] = sinf(theta);
+        cos_vals[i] = cosf(theta);
     }
+    is_filled = true;
+}
 
-    // decoder allocator
-    {
-        whisper_allocr_graph_init(state->alloc_decode, ctx->backend,
-                [&]() {
-                    const auto & hparams = ctx->model.hparams;
+// naive Discrete Fourier Transform
+// input is real-valued
+// output is complex-valued
+static void dft(const std::vector<float> & in, std::vector<float> & out) {
+    int N = in.size();
 
-                    // TODO: make sure this is the worst-case scenario
-                    const int n_tokens = hparams.n_text_ctx;
-                    const int n_past   = 0;
+    out.resize(N*2);
+    const int sin_cos_step = SIN_COS_N_COUNT / N;
 
-                    whisper_batch_prep_legacy(state->batch, nullptr, n_tokens, n_past, 0);
+    for (int k = 0; k < N; k++) {
+        float re = 0;
+        float im = 0;
 
-                    return whisper_build_graph_decoder(*ctx, *state, state->batch);
-                });
+        for (int n = 0; n < N; n++) {
+            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
+            re += in[n]*cos_vals[idx]; // cos(t)
+            im -= in[n]*sin_vals[idx]; // sin(t)
+        }
 
-        WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_decode) / 1e6);
+        out[k*2 + 0] = re;
+        out[k*2 + 1] = im;
     }
-
-    whisper_allocr_graph_realloc(state->alloc_conv,   ctx->backend);
-    whisper_allocr_graph_realloc(state->alloc_encode, ctx->backend);
-    whisper_allocr_graph_realloc(state->alloc_cross,  ctx->backend);
-    whisper_allocr_graph_realloc(state->alloc_decode, ctx->backend);
-
-    return state;
 }
 
-int whisper_ctx_init_openvino_encoder(
-        struct whisper_context * ctx,
-                    const char * model_path,
-                    const char * device,
-                    const char * cache_dir) {
-#ifndef WHISPER_USE_OPENVINO
-    (void)(ctx);
-    (void)(model_path);
-    (void)(device);
-    (void)(cache_dir);
-
-    return 1;
-#else
-    if (!model_path && ctx->path_model.empty()) {
-        WHISPER_LOG_ERROR("%s: model_path is nullptr, and ctx has no model_path set.\n", __func__);
-        return 1;
-    }
+// Cooley-Tukey FFT
+// poor man's implementation - use something better
+// input is real-valued
+// output is complex-valued
+static void fft(const std::vector<float> & in, std::vector<float> & out) {
+    out.resize(in.size()*2);
 
-    std::string path_encoder;
-    if (!model_path) {
-        //if model_path is not set, attempt to find it in the same directory as ggml-<model>.bin model
-        path_encoder = whisper_openvino_get_path_encoder(ctx->path_model);
-    } else {
-        path_encoder = model_path;
-    }
+    int N = in.size();
 
-    std::string path_cache;
-    if (!cache_dir) {
-        //if cache_dir is not set, set it as a dir residing next to ggml-<model>.bin
-        path_cache = whisper_openvino_get_path_cache(ctx->path_model);
-    } else {
-        path_cache = cache_dir;
+    if (N == 1) {
+        out[0] = in[0];
+        out[1] = 0;
+        return;
     }
 
-    WHISPER_LOG_INFO("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
-    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
-
-    ctx->state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
-    if (!ctx->state->ctx_openvino) {
-        WHISPER_LOG_ERROR("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
-        return 1;
-    } else {
-        WHISPER_LOG_INFO("%s: OpenVINO model loaded\n", __func__);
+    if (N%2 == 1) {
+        dft(in, out);
+        return;
     }
 
-    return 0;
-#endif
-}
-
-struct whisper_context_params whisper_context_default_params() {
-    struct whisper_context_params result = {
-        /*.use_gpu    =*/ true,
-    };
-    return result;
-}
+    std::vector<float> even;
+    std::vector<float> odd;
 
-struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
-    WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
+    even.reserve(N/2);
+    odd.reserve(N/2);
 
-    auto fin = std::ifstream(path_model, std::ios::binary);
-    if (!fin) {
-        WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
-        return nullptr;
+    for (int i = 0; i < N; i++) {
+        if (i % 2 == 0) {
+            even.push_back(in[i]);
+        } else {
+            odd.push_back(in[i]);
+        }
     }
 
-    whisper_model_loader loader = {};
+    std::vector<float> even_fft;
+    std::vector<float> odd_fft;
 
-    loader.context = &fin;
+    fft(even, even_fft);
+    fft(odd, odd_fft);
 
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->read((char *)output, read_size);
-        return read_size;
-    };
+    const int sin_cos_step = SIN_COS_N_COUNT / N;
+    for (int k = 0; k < N/2; k++) {
+        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
+        float re = cos_vals[idx]; // cos(t)
+        float im = -sin_vals[idx]; // sin(t)
 
-    loader.eof = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        return fin->eof();
-    };
+        float re_odd = odd_fft[2*k + 0];
+        float im_odd = odd_fft[2*k + 1];
 
-    loader.close = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->close();
-    };
+        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
+        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
 
-    auto ctx = whisper_init_with_params_no_state(&loader, params);
+        out[2*(k + N/2) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
+        out[2*(k + N/2) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+    }
+}
 
-    if (ctx) {
-        ctx->path_model = path_model;
+static bool hann_window(int length, bool periodic, std::vector<float> & output) {
+    if (output.size() < static_cast<size_t>(length)) {
+        output.resize(length);
+    }
+    int offset = -1;
+    if (periodic) {
+        offset = 0;
+    }
+    for (int i = 0; i < length; i++) {
+        output[i] = 0.5*(1.0 - cosf((2.0*M_PI*i)/(length + offset)));
     }
 
-    return ctx;
+    return true;
 }
 
-struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * buffer, size_t buffer_size, struct whisper_context_params params) {
-    struct buf_context {
-        uint8_t* buffer;
-        size_t size;
-        size_t current_offset;
-    };
-
-    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
+static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const std::vector<float> & samples,
+                                              int n_samples, int frame_size, int frame_step, int n_threads,
+                                              const whisper_filters & filters, whisper_mel & mel) {
+    std::vector<float> fft_in(frame_size, 0.0);
+    std::vector<float> fft_out(2 * frame_step);
+    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
+    int n_fft = 1 + (frame_size / 2);
+    int i = ith;
 
-    WHISPER_LOG_INFO("%s: loading model from buffer\n", __func__);
+    // calculate FFT only when fft_in are not all zero
+    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
+        const int offset = i * frame_step;
 
-    whisper_model_loader loader = {};
+        // apply Hanning window (~10% faster)
+        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
+            fft_in[j] = hann[j] * samples[offset + j];
+        }
+        // fill the rest with zeros
+        if (n_samples - offset < frame_size) {
+            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
+        }
 
-    loader.context = &ctx;
+        // FFT
+        fft(fft_in, fft_out);
 
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+        // Calculate modulus^2 of complex numbers
+        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
+        for (int j = 0; j < frame_size; j++) {
+            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
+        }
 
-        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+        // mel spectrogram
+        for (int j = 0; j < mel.n_mel; j++) {
+            double sum = 0.0;
 
-        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
-        buf->current_offset += size_to_copy;
-
-        return size_to_copy;
-    };
+            // unroll loop (suggested by GH user @lunixbochs)
+            int k = 0;
+            for (k = 0; k < n_fft - 3; k += 4) {
+                sum +=
+                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
+                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
+                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
+                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
+            }
 
-    loader.eof = [](void * ctx) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+            // handle n_fft remainder
+            for (; k < n_fft; k++) {
+                sum += fft_out[k] * filters.data[j * n_fft + k];
+            }
 
-        return buf->current_offset >= buf->size;
-    };
+            sum = log10(std::max(sum, 1e-10));
 
-    loader.close = [](void * /*ctx*/) { };
+            mel.data[j * mel.n_len + i] = sum;
+        }
+    }
 
-    return whisper_init_with_params_no_state(&loader, params);
+    // Otherwise fft_out are all zero
+    double sum = log10(1e-10);
+    for (; i < mel.n_len; i += n_threads) {
+        for (int j = 0; j < mel.n_mel; j++) {
+            mel.data[j * mel.n_len + i] = sum;
+        }
+    }
 }
 
-struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
-    ggml_time_init();
+// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
+static bool log_mel_spectrogram(
+              whisper_state & wstate,
+              const float * samples,
+              const int   n_samples,
+              const int   /*sample_rate*/,
+              const int   frame_size,
+              const int   frame_step,
+              const int   n_mel,
+              const int   n_threads,
+              const whisper_filters & filters,
+              const bool   debug,
+              whisper_mel & mel) {
+    const int64_t t_start_us = ggml_time_us();
 
-    whisper_context * ctx = new whisper_context;
-    ctx->params = params;
+    // Hanning window (Use cosf to eliminate difference)
+    // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
+    // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
+    std::vector<float> hann;
+    hann_window(frame_size, true, hann);
 
-    if (!whisper_model_load(loader, *ctx)) {
-        loader->close(loader->context);
-        WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
-        delete ctx;
-        return nullptr;
-    }
 
-    loader->close(loader->context);
+    // Calculate the length of padding
+    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
+    int64_t stage_2_pad = frame_size / 2;
 
-    return ctx;
-}
+    // Initialize a vector and copy data from C array to it.
+    std::vector<float> samples_padded;
+    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
+    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
 
-struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_from_file_with_params_no_state(path_model, params);
-    if (!ctx) {
-        return nullptr;
-    }
+    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
+    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
-    }
+    // reflective pad 200 samples at the beginning of audio
+    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
 
-    return ctx;
-}
+    mel.n_mel     = n_mel;
+    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
+    // Calculate number of frames + remove the last frame
+    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
+    // Calculate semi-padded sample length to ensure compatibility
+    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
+    mel.data.resize(mel.n_mel * mel.n_len);
 
-struct whisper_context * whisper_init_from_buffer_with_params(void * buffer, size_t buffer_size, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, params);
-    if (!ctx) {
-        return nullptr;
-    }
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
-    }
+    {
+        std::vector<std::thread> workers(n_threads - 1);
+        for (int iw = 0; iw < n_threads - 1; ++iw) {
+            workers[iw] = std::thread(
+                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples_padded,
+                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
+                    std::cref(filters), std::ref(mel));
+        }
 
-    return ctx;
-}
+        // main thread
+        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
 
-struct whisper_context * whisper_init_with_params(struct whisper_model_loader * loader, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_with_params_no_state(loader, params);
-    if (!ctx) {
-        return nullptr;
+        for (int iw = 0; iw < n_threads - 1; ++iw) {
+            workers[iw].join();
+        }
     }
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+    // clamping and normalization
+    double mmax = -1e20;
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] > mmax) {
+            mmax = mel.data[i];
+        }
     }
 
-    return ctx;
-}
-
-struct whisper_context * whisper_init_from_file(const char * path_model) {
-    return whisper_init_from_file_with_params(path_model, whisper_context_default_params());
-}
+    mmax -= 8.0;
 
-struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
-    return whisper_init_from_buffer_with_params(buffer, buffer_size, whisper_context_default_params());
-}
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] < mmax) {
+            mel.data[i] = mmax;
+        }
 
-struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
-    return whisper_init_with_params(loader, whisper_context_default_params());
-}
+        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+    }
 
-struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
-    return whisper_init_from_file_with_params_no_state(path_model, whisper_context_default_params());
-}
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
 
-struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
-    return whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, whisper_context_default_params());
-}
+    // Dump log_mel_spectrogram
+    if (debug) {
+        std::ofstream outFile("log_mel_spectrogram.json");
+        outFile << "[";
+        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
+            outFile << mel.data[i] << ", ";
+        }
+        outFile << mel.data[mel.data.size() - 1] << "]";
+        outFile.close();
+    }
 
-struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
-    return whisper_init_with_params_no_state(loader, whisper_context_default_params());
+    return true;
 }
 
-void whisper_free_state(struct whisper_state * state)
-{
-    if (state) {
-        kv_cache_free(state->kv_self);
-        kv_cache_free(state->kv_cross);
+// split text into tokens
+//
+// ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
+//
+// Regex (Python):
+// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
+//
+// Regex (C++):
+// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
+//
+static bool whisper_is_space(uint8_t c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+static bool whisper_is_alpha(uint8_t c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+static bool whisper_is_digit(uint8_t c) { return c >= '0' && c <= '9'; }
 
-#ifdef WHISPER_USE_COREML
-        if (state->ctx_coreml != nullptr) {
-            whisper_coreml_free(state->ctx_coreml);
-            state->ctx_coreml = nullptr;
+// the end of the word that starts at i0, equivalent to the regex:
+//
+//   's|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+
+//
+// with the classes of the "C" locale - the bytes of the multi-byte UTF-8 characters are neither letters nor digits
+static int whisper_word_end(const std::string & text, int i0) {
+    const int n = text.size();
+
+    if (text[i0] == '\'') {
+        for (const char * suffix : { "s", "t", "re", "ve", "m", "ll", "d" }) {
+            const int len = strlen(suffix);
+            if (text.compare(i0 + 1, len, suffix) == 0) {
+                return i0 + 1 + len;
+            }
         }
-#endif
+    }
 
-#ifdef WHISPER_USE_OPENVINO
-        if (state->ctx_openvino != nullptr) {
-            whisper_openvino_free(state->ctx_openvino);
-            state->ctx_openvino = nullptr;
-        }
-#endif
+    // optional leading space, followed by a run of letters, digits or other characters
+    const int i1 = text[i0] == ' ' ? i0 + 1 : i0;
 
-        whisper_batch_free(state->batch);
+    if (i1 < n && !whisper_is_space(text[i1])) {
+        const bool alpha = whisper_is_alpha(text[i1]);
+        const bool digit = whisper_is_digit(text[i1]);
 
-        whisper_allocr_free(state->alloc_conv);
-        whisper_allocr_free(state->alloc_encode);
-        whisper_allocr_free(state->alloc_cross);
-        whisper_allocr_free(state->alloc_decode);
+        int i = i1 + 1;
+        while (i < n && !whisper_is_space(text[i]) && whisper_is_alpha(text[i]) == alpha && whisper_is_digit(text[i]) == digit) {
+            ++i;
+        }
 
-        ggml_backend_free(state->backend);
+        return i;
+    }
 
-        delete state;
+    // whitespace - leave the last one to the next word, unless the whitespace is at the end of the text
+    int i = i0 + 1;
+    while (i < n && whisper_is_space(text[i])) {
+        ++i;
     }
+
+    return i < n && i - i0 > 1 ? i - 1 : i;
 }
 
-void whisper_free(struct whisper_context * ctx) {
-    if (ctx) {
-        if (ctx->model.ctx) {
-            ggml_free(ctx->model.ctx);
-        }
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
+    std::vector<whisper_vocab::id> tokens;
 
-        for (auto & buffer : ctx->model.buffers) {
-            if (buffer) {
-                ggml_backend_buffer_free(buffer);
+    const int n = text.size();
+
+    // split the text into words and find the longest tokens that form them
+    for (int i0 = 0; i0 < n; ) {
+        const int i1 = whisper_word_end(text, i0);
+
+        int i = i0;
+        while (i < i1) {
+            whisper_vocab::id token = -1;
+
+            int j_token = i;
+            int32_t node = -1;
+
+            for (int j = i; j < i1; ++j) {
+                node = whisper_vocab_trie_child(vocab, node, text[j]);
+                if (node < 0) {
+                    break;
+                }
+
+                if (vocab.trie[node].token >= 0) {
+                    token   = vocab.trie[node].token;
+                    j_token = j + 1;
+                }
             }
-        }
 
-        whisper_free_state(ctx->state);
+            if (token < 0) {
+                WHISPER_LOG_ERROR("unknown token\n");
+                ++i;
+                continue;
+            }
 
-        ggml_backend_free(ctx->backend);
+            tokens.push_back(token);
+            i = j_token;
+        }
 
-        delete ctx;
+        i0 = i1;
     }
-}
 
-void whisper_free_context_params(struct whisper_context_params * params) {
-    if (params) {
-        delete params;
-    }
+    return tokens;
 }
 
-void whisper_free_params(struct whisper_full_params * params) {
-    if (params) {
-        delete params;
-    }
-}
+//
+// interface implementation
+//
 
-int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
-        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
-        return -1;
+#ifdef WHISPER_USE_COREML
+// replace .bin with -encoder.mlmodelc
+static std::string whisper_get_coreml_path_encoder(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
     }
 
-    return 0;
+    // match "-qx_x"
+    pos = path_bin.rfind('-');
+    if (pos != std::string::npos) {
+        auto sub = path_bin.substr(pos);
+        if (sub.size() == 5 && sub[1] == 'q' && sub[3] == '_') {
+            path_bin = path_bin.substr(0, pos);
+        }
+    }
+
+    path_bin += "-encoder.mlmodelc";
+
+    return path_bin;
 }
+#endif
 
-int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+#ifdef WHISPER_USE_OPENVINO
+// replace .bin with-encoder-openvino.xml
+static std::string whisper_openvino_get_path_encoder(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
+
+    path_bin += "-encoder-openvino.xml";
+
+    return path_bin;
 }
 
-// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
-int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
-        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
-        return -1;
+static std::string whisper_openvino_get_path_cache(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
+
+    path_bin += "-encoder-openvino-cache";
+
+    return path_bin;
+}
+#endif
+
+struct whisper_state * whisper_init_state(whisper_context * ctx) {
+    fill_sin_cos_table();
+
+    whisper_state * state = new whisper_state;
+
+    state->backend = whisper_backend_init(ctx->params);
+    state->threadpool_spin_us = ctx->params.threadpool_spin_us;
+
+    // at this point, we don't know yet how many decoders will be used, so we overallocate 3x ctx
+    // in theory, there can be a case where this is not enough, but in practice it should always be enough
+    const int factor = 3;
+
+    if (!kv_cache_init(ctx->model.hparams, state->kv_self, ctx->backend, ctx->itype, factor*ctx->model.hparams.n_text_ctx)) {
+        WHISPER_LOG_ERROR("%s: kv_cache_init() failed for self-attention cache\n", __func__);
+        delete state;
+        return nullptr;
+    }
+
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_self.k) + ggml_nbytes(state->kv_self.v);
+        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
+    }
+
+    if (!kv_cache_init(ctx->model.hparams, state->kv_cross, ctx->backend, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
+        WHISPER_LOG_ERROR("%s: kv_cache_init() failed for cross-attention cache\n", __func__);
+        delete state;
+        return nullptr;
+    }
+
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
+        WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1e6);
+    }
+
+#ifdef WHISPER_USE_COREML
+    const auto path_coreml = whisper_get_coreml_path_encoder(ctx->path_model);
+
+    WHISPER_LOG_INFO("%s: loading Core ML model from '%s'\n", __func__, path_coreml.c_str());
+    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
+
+    state->ctx_coreml = whisper_coreml_init(path_coreml.c_str());
+    if (!state->ctx_coreml) {
+        WHISPER_LOG_ERROR("%s: failed to load Core ML model from '%s'\n", __func__, path_coreml.c_str());
+#ifndef WHISPER_COREML_ALLOW_FALLBACK
+        delete state;
+        return nullptr;
+#endif
+    } else {
+        WHISPER_LOG_INFO("%s: Core ML model loaded\n", __func__);
+    }
+#endif
+
+    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+
+    state->batch = whisper_batch_init(ctx->model.hparams.n_text_ctx, WHISPER_MAX_DECODERS);
+
+    // TAGS: WHISPER_DECODER_INIT
+    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
+
+    state->decoders[0].probs.reserve    (ctx->vocab.n_vocab);
+    state->decoders[0].logits.reserve   (ctx->vocab.n_vocab);
+    state->decoders[0].logprobs.reserve (ctx->vocab.n_vocab);
+    state->decoders[0].logits_id.reserve(whisper_lang_max_id() + 1);
+    state->decoders[0].probs_cdf.reserve(ctx->model.hparams.n_vocab);
+
+    state->decoders[0].rng = std::mt19937(0);
+
+    // conv allocator
+    {
+        whisper_allocr_graph_init(state->alloc_conv, ctx->backend,
+                [&]() {
+                    return whisper_build_graph_conv(*ctx, *state, 0);
+                });
+
+        WHISPER_LOG_INFO("%s: compute buffer (conv)   = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_conv) / 1e6);
+    }
+
+    // encoder allocator
+    if (!whisper_encode_external(*state)) {
+        whisper_allocr_graph_init(state->alloc_encode, ctx->backend,
+                [&]() {
+                    return whisper_build_graph_encoder(*ctx, *state);
+                });
+
+        WHISPER_LOG_INFO("%s: compute buffer (encode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_encode) / 1e6);
+    }
+
+    // cross allocator
+    {
+        whisper_allocr_graph_init(state->alloc_cross, ctx->backend,
+                [&]() {
+                    return whisper_build_graph_cross(*ctx, *state);
+                });
+
+        WHISPER_LOG_INFO("%s: compute buffer (cross)  = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_cross) / 1e6);
+    }
+
+    // decoder allocator
+    {
+        whisper_allocr_graph_init_decoder(*ctx, *state);
+
+        WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_decode) / 1e6);
+    }
+
+    whisper_allocr_graph_realloc(state->alloc_conv,   ctx->backend);
+    whisper_allocr_graph_realloc(state->alloc_encode, ctx->backend);
+    whisper_allocr_graph_realloc(state->alloc_cross,  ctx->backend);
+    whisper_allocr_graph_realloc(state->alloc_decode, ctx->backend);
+
+    return state;
+}
+
+int whisper_ctx_init_openvino_encoder(
+        struct whisper_context * ctx,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir) {
+#ifndef WHISPER_USE_OPENVINO
+    (void)(ctx);
+    (void)(model_path);
+    (void)(device);
+    (void)(cache_dir);
+
+    return 1;
+#else
+    if (!model_path && ctx->path_model.empty()) {
+        WHISPER_LOG_ERROR("%s: model_path is nullptr, and ctx has no model_path set.\n", __func__);
+        return 1;
+    }
+
+    std::string path_encoder;
+    if (!model_path) {
+        //if model_path is not set, attempt to find it in the same directory as ggml-<model>.bin model
+        path_encoder = whisper_openvino_get_path_encoder(ctx->path_model);
+    } else {
+        path_encoder = model_path;
+    }
+
+    std::string path_cache;
+    if (!cache_dir) {
+        //if cache_dir is not set, set it as a dir residing next to ggml-<model>.bin
+        path_cache = whisper_openvino_get_path_cache(ctx->path_model);
+    } else {
+        path_cache = cache_dir;
+    }
+
+    WHISPER_LOG_INFO("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
+    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
+
+    ctx->state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
+    if (!ctx->state->ctx_openvino) {
+        WHISPER_LOG_ERROR("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
+        return 1;
+    } else {
+        WHISPER_LOG_INFO("%s: OpenVINO model loaded\n", __func__);
     }
 
     return 0;
+#endif
 }
 
-// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
-int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_phase_vocoder_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+static bool whisper_aheads_init(whisper_context & ctx) {
+    const auto & hparams = ctx.model.hparams;
+    const auto & params  = ctx.params;
+
+    auto & aheads = ctx.aheads;
+
+    aheads.clear();
+
+    switch (params.dtw_aheads_preset) {
+        case WHISPER_AHEADS_NONE:
+            {
+                WHISPER_LOG_ERROR("%s: dtw_token_timestamps requires the alignment heads (dtw_aheads_preset)\n", __func__);
+                return false;
+            }
+        case WHISPER_AHEADS_N_TOP_MOST:
+            {
+                const int n_top = params.dtw_n_top > 0 ? std::min(params.dtw_n_top, hparams.n_text_layer) : hparams.n_text_layer/2;
+
+                for (int il = hparams.n_text_layer - n_top; il < hparams.n_text_layer; ++il) {
+                    for (int h = 0; h < hparams.n_text_head; ++h) {
+                        aheads.push_back({ il, h });
+                    }
+                }
+            } break;
+        case WHISPER_AHEADS_CUSTOM:
+            {
+                aheads.assign(params.dtw_aheads.heads, params.dtw_aheads.heads + params.dtw_aheads.n_heads);
+            } break;
+        default:
+            {
+                const auto & preset = g_aheads.at(params.dtw_aheads_preset);
+                aheads.assign(preset.heads, preset.heads + preset.n_heads);
+            } break;
+    };
+
+    for (const auto & ahead : aheads) {
+        if (ahead.n_text_layer < 0 || ahead.n_text_layer >= hparams.n_text_layer ||
+            ahead.n_head       < 0 || ahead.n_head       >= hparams.n_text_head) {
+            WHISPER_LOG_ERROR("%s: alignment head (%d, %d) does not exist in the model (%d layers, %d heads) - wrong preset?\n",
+                    __func__, ahead.n_text_layer, ahead.n_head, hparams.n_text_layer, hparams.n_text_head);
+            aheads.clear();
+            return false;
+        }
+    }
+
+    if (aheads.empty()) {
+        WHISPER_LOG_ERROR("%s: no alignment heads\n", __func__);
+        return false;
+    }
+
+    WHISPER_LOG_INFO("%s: using %d alignment heads for the DTW token timestamps\n", __func__, (int) aheads.size());
+
+    return true;
 }
 
-// same as whisper_pcm_to_mel, but applies WSOLA to speed up the audio x2
-// TODO
+struct whisper_context_params whisper_context_default_params() {
+    struct whisper_context_params result = {
+        /*.use_gpu              =*/ true,
+        /*.threadpool_spin_us   =*/ WHISPER_THREADPOOL_SPIN_US,
 
-// same as whisper_pcm_to_mel, but applies HPTSM to speed up the audio x2
-// TODO
+        /*.dtw_token_timestamps =*/ false,
+        /*.dtw_aheads_preset    =*/ WHISPER_AHEADS_NONE,
+        /*.dtw_n_top            =*/ -1,
+        /*.dtw_aheads           =*/ { 0, nullptr },
+    };
+    return result;
+}
 
-// same as whisper_pcm_to_mel, but applies PV (with phase lock) to speed up the audio x2
-// TODO
+struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
+    WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
 
-int whisper_set_mel_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-                   const float * data,
-                           int   n_len,
-                           int   n_mel) {
-    if (n_mel != ctx->model.filters.n_mel) {
-        WHISPER_LOG_ERROR("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, ctx->model.filters.n_mel);
+    auto fin = std::ifstream(path_model, std::ios::binary);
+    if (!fin) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
+        return nullptr;
+    }
+
+    whisper_model_loader loader = {};
+
+    loader.context = &fin;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->read((char *)output, read_size);
+        return read_size;
+    };
+
+    loader.eof = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        return fin->eof();
+    };
+
+    loader.close = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->close();
+    };
+
+    auto ctx = whisper_init_with_params_no_state(&loader, params);
+
+    if (ctx) {
+        ctx->path_model = path_model;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * buffer, size_t buffer_size, struct whisper_context_params params) {
+    struct buf_context {
+        uint8_t* buffer;
+        size_t size;
+        size_t current_offset;
+    };
+
+    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
+
+    WHISPER_LOG_INFO("%s: loading model from buffer\n", __func__);
+
+    whisper_model_loader loader = {};
+
+    loader.context = &ctx;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+
+        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+
+        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
+        buf->current_offset += size_to_copy;
+
+        return size_to_copy;
+    };
+
+    loader.eof = [](void * ctx) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+
+        return buf->current_offset >= buf->size;
+    };
+
+    loader.close = [](void * /*ctx*/) { };
+
+    return whisper_init_with_params_no_state(&loader, params);
+}
+
+struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    ggml_time_init();
+
+    whisper_context * ctx = new whisper_context;
+    ctx->params = params;
+
+    if (!whisper_model_load(loader, *ctx)) {
+        loader->close(loader->context);
+        WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
+        delete ctx;
+        return nullptr;
+    }
+
+    loader->close(loader->context);
+
+    if (params.dtw_token_timestamps && !whisper_aheads_init(*ctx)) {
+        WHISPER_LOG_ERROR("%s: failed to init the alignment heads for the DTW token timestamps\n", __func__);
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_from_file_with_params_no_state(path_model, params);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_buffer_with_params(void * buffer, size_t buffer_size, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, params);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_with_params(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_with_params_no_state(loader, params);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_file(const char * path_model) {
+    return whisper_init_from_file_with_params(path_model, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
+    return whisper_init_from_buffer_with_params(buffer, buffer_size, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
+    return whisper_init_with_params(loader, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
+    return whisper_init_from_file_with_params_no_state(path_model, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
+    return whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, whisper_context_default_params());
+}
+
+struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
+    return whisper_init_with_params_no_state(loader, whisper_context_default_params());
+}
+
+void whisper_free_state(struct whisper_state * state)
+{
+    if (state) {
+        kv_cache_free(state->kv_self);
+        kv_cache_free(state->kv_cross);
+
+#ifdef WHISPER_USE_COREML
+        if (state->ctx_coreml != nullptr) {
+            whisper_coreml_free(state->ctx_coreml);
+            state->ctx_coreml = nullptr;
+        }
+#endif
+
+#ifdef WHISPER_USE_OPENVINO
+        if (state->ctx_openvino != nullptr) {
+            whisper_openvino_free(state->ctx_openvino);
+            state->ctx_openvino = nullptr;
+        }
+#endif
+
+        whisper_batch_free(state->batch);
+
+        whisper_allocr_free(state->alloc_conv);
+        whisper_allocr_free(state->alloc_encode);
+        whisper_allocr_free(state->alloc_cross);
+        whisper_allocr_free(state->alloc_decode);
+        whisper_allocr_free(state->alloc_lang);
+
+        ggml_backend_free(state->backend);
+
+        ggml_threadpool_free(state->threadpool);
+
+        delete state;
+    }
+}
+
+void whisper_free(struct whisper_context * ctx) {
+    if (ctx) {
+        if (ctx->model.ctx) {
+            ggml_free(ctx->model.ctx);
+        }
+
+        for (auto & buffer : ctx->model.buffers) {
+            if (buffer) {
+                ggml_backend_buffer_free(buffer);
+            }
+        }
+
+        whisper_free_state(ctx->state);
+
+        for (auto * state : ctx->state_pool) {
+            whisper_free_state(state);
+        }
+
+        whisper_allocr_free(ctx->alloc_batch);
+
+        ggml_backend_free(ctx->backend);
+
+        delete ctx;
+    }
+}
+
+void whisper_free_context_params(struct whisper_context_params * params) {
+    if (params) {
+        delete params;
+    }
+}
+
+void whisper_free_params(struct whisper_full_params * params) {
+    if (params) {
+        delete params;
+    }
+}
+
+int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    state->kv_cross_seek = -1;
+
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
+        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
+int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    state->kv_cross_seek = -1;
+
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
+        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
         return -1;
     }
 
-    state->mel.n_len     = n_len;
-    state->mel.n_len_org = n_len;
-    state->mel.n_mel     = n_mel;
+    return 0;
+}
+
+// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
+int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_phase_vocoder_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+// same as whisper_pcm_to_mel, but applies WSOLA to speed up the audio x2
+// TODO
+
+// same as whisper_pcm_to_mel, but applies HPTSM to speed up the audio x2
+// TODO
+
+// same as whisper_pcm_to_mel, but applies PV (with phase lock) to speed up the audio x2
+// TODO
+
+int whisper_set_mel_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                   const float * data,
+                           int   n_len,
+                           int   n_mel) {
+    if (n_mel != ctx->model.filters.n_mel) {
+        WHISPER_LOG_ERROR("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, ctx->model.filters.n_mel);
+        return -1;
+    }
+
+    state->kv_cross_seek = -1;
+
+    state->mel.n_len     = n_len;
+    state->mel.n_len_org = n_len;
+    state->mel.n_mel     = n_mel;
+
+    state->mel.data.resize(n_len*n_mel);
+    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+
+    return 0;
+}
+
+int whisper_set_mel(
+        struct whisper_context * ctx,
+        const float * data,
+        int n_len,
+        int n_mel) {
+    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
+}
+
+int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *state, offset, n_threads, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    whisper_batch_prep_legacy(state->batch, tokens, n_tokens, n_past, 0);
+
+    whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+
+    if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return 1;
+    }
+
+    return 0;
+}
+
+int whisper_decode_batch(
+        struct whisper_context * ctx,
+         struct whisper_state ** states,
+         const whisper_token  ** tokens,
+                    const int  * n_tokens,
+                    const int  * n_past,
+                           int   n_states,
+                           int   n_threads) {
+    if (n_states <= 0) {
+        WHISPER_LOG_ERROR("%s: invalid number of states %d\n", __func__, n_states);
+        return -1;
+    }
+
+    for (int s = 0; s < n_states; ++s) {
+        if (n_tokens[s] <= 0 || n_tokens[s] > ctx->model.hparams.n_text_ctx) {
+            WHISPER_LOG_ERROR("%s: invalid number of tokens %d for state %d\n", __func__, n_tokens[s], s);
+            return -1;
+        }
+
+        for (int t = 0; t < s; ++t) {
+            if (states[t] == states[s]) {
+                WHISPER_LOG_ERROR("%s: state %d is used more than once\n", __func__, s);
+                return -1;
+            }
+        }
+    }
+
+    // the states with long batches (e.g. prompts) are decoded on their own, the others in groups of
+    // WHISPER_BATCH_MAX_STATES, for which the compute buffer of the context is sized
+    std::vector<whisper_state *> group;
+
+    for (int s = 0; s < n_states; ++s) {
+        whisper_batch_prep_legacy(states[s]->batch, tokens[s], n_tokens[s], n_past[s], 0);
+
+        whisper_kv_cache_seq_rm(states[s]->kv_self, 0, n_past[s], -1);
+
+        if (n_tokens[s] > WHISPER_MAX_DECODERS) {
+            if (!whisper_decode_internal(*ctx, *states[s], states[s]->batch, n_threads, nullptr, nullptr)) {
+                WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+                return 1;
+            }
+            continue;
+        }
+
+        group.push_back(states[s]);
+    }
+
+    for (size_t i0 = 0; i0 < group.size(); i0 += WHISPER_BATCH_MAX_STATES) {
+        const int n_group = std::min(group.size() - i0, (size_t) WHISPER_BATCH_MAX_STATES);
+
+        // a single state uses its own decoder graph
+        const bool ok = n_group == 1 ?
+            whisper_decode_internal(*ctx, *group[i0], group[i0]->batch, n_threads, nullptr, nullptr) :
+            whisper_decode_batch_internal(*ctx, group.data() + i0, n_group, n_threads);
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int whisper_set_vocab_subset_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens) {
+    const int n_vocab = ctx->vocab.n_vocab;
+
+    std::vector<int32_t> vocab_subset;
+
+    if (tokens != nullptr && n_tokens > 0) {
+        std::vector<bool> active(n_vocab, false);
+
+        for (int i = 0; i < n_tokens; ++i) {
+            if (tokens[i] < 0 || tokens[i] >= n_vocab) {
+                WHISPER_LOG_ERROR("%s: invalid token id %d (n_vocab = %d)\n", __func__, tokens[i], n_vocab);
+                return -1;
+            }
+            active[tokens[i]] = true;
+        }
+
+        // the special and timestamp tokens are always needed for decoding
+        for (int i = ctx->vocab.token_eot; i < n_vocab; ++i) {
+            active[i] = true;
+        }
+
+        for (int i = 0; i < n_vocab; ++i) {
+            if (active[i]) {
+                vocab_subset.push_back(i);
+            }
+        }
+
+        // no benefit from a subset covering most of the vocabulary
+        if (2*vocab_subset.size() > (size_t) n_vocab) {
+            vocab_subset.clear();
+        }
+    }
+
+    if (vocab_subset.size() == state->vocab_subset.size()) {
+        state->vocab_subset = std::move(vocab_subset);
+        return 0;
+    }
+
+    state->vocab_subset = std::move(vocab_subset);
+
+    // the size of the output projection changed - re-measure the decoder compute buffer
+    whisper_allocr_free(state->alloc_decode);
+    whisper_allocr_graph_init_decoder(*ctx, *state);
+    whisper_allocr_graph_realloc(state->alloc_decode, ctx->backend);
+
+    return 0;
+}
+
+// make room for n_outputs flagged tokens per decoder batch
+// the decoder compute buffer is re-measured when the max number of outputs grows
+static void whisper_reserve_outputs(whisper_context & ctx, whisper_state & state, int n_outputs) {
+    if (n_outputs <= state.n_outputs_max) {
+        return;
+    }
+
+    state.n_outputs_max = n_outputs;
+
+    whisper_allocr_free(state.alloc_decode);
+    whisper_allocr_graph_init_decoder(ctx, state);
+    whisper_allocr_graph_realloc(state.alloc_decode, ctx.backend);
+}
+
+int whisper_set_vocab_subset(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
+        return -1;
+    }
+
+    return whisper_set_vocab_subset_with_state(ctx, ctx->state, tokens, n_tokens);
+}
+
+int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
+        return -1;
+    }
+
+    return whisper_decode_with_state(ctx, ctx->state, tokens, n_tokens, n_past, n_threads);
+}
+
+int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
+    const auto res = tokenize(ctx->vocab, text);
+
+    if (n_max_tokens < (int) res.size()) {
+        WHISPER_LOG_ERROR("%s: too many resulting tokens: %d (max %d)\n", __func__, (int) res.size(), n_max_tokens);
+        return -1;
+    }
+
+    for (int i = 0; i < (int) res.size(); i++) {
+        tokens[i] = res[i];
+    }
+
+    return res.size();
+}
+
+int whisper_lang_max_id() {
+    auto max_id = 0;
+    for (const auto & kv : g_lang) {
+        max_id = std::max(max_id, kv.second.first);
+    }
+
+    return max_id;
+}
+
+int whisper_lang_id(const char * lang) {
+    if (!g_lang.count(lang)) {
+        for (const auto & kv : g_lang) {
+            if (kv.second.second == lang) {
+                return kv.second.first;
+            }
+        }
+
+        WHISPER_LOG_ERROR("%s: unknown language '%s'\n", __func__, lang);
+        return -1;
+    }
+    return g_lang.at(lang).first;
+}
+
+const char * whisper_lang_str(int id) {
+    for (const auto & kv : g_lang) {
+        if (kv.second.first == id) {
+            return kv.first.c_str();
+        }
+    }
+
+    WHISPER_LOG_ERROR("%s: unknown language id %d\n", __func__, id);
+    return nullptr;
+}
+
+const char * whisper_lang_str_full(int id) {
+   for (const auto & kv : g_lang) {
+        if (kv.second.first == id) {
+            return kv.second.second.c_str();
+        }
+    }
+
+    WHISPER_LOG_ERROR("%s: unknown language id %d\n", __func__, id);
+    return nullptr;
+}
+
+int whisper_lang_auto_detect_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    const int seek = offset_ms/10;
+
+    if (seek < 0) {
+        WHISPER_LOG_ERROR("%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
+        return -1;
+    }
+
+    if (seek >= state->mel.n_len_org) {
+        WHISPER_LOG_ERROR("%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
+        return -2;
+    }
+
+    // run the encoder - the window is kept in kv_cross, so the transcription of the window does not encode it again
+    if (!whisper_encode_cached(*ctx, *state, seek, n_threads, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+        return -6;
+    }
+
+    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
+
+    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
+        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+        return -7;
+    }
+
+    auto & logits_id = state->decoders[0].logits_id;
+    logits_id.clear();
+
+    for (const auto & kv : g_lang) {
+        const auto token_lang = whisper_token_lang(ctx, kv.second.first);
+        logits_id.emplace_back(state->logits[token_lang], kv.second.first);
+    }
+
+    // sort descending
+    {
+        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
+        std::sort(logits_id.begin(), logits_id.end(), [](const pair_type & a, const pair_type & b) {
+            return a.first > b.first;
+        });
+    }
+
+    // softmax
+    {
+        const auto max = logits_id[0].first;
+
+        double sum = 0.0f;
+        for (auto & kv : logits_id) {
+            kv.first = exp(kv.first - max);
+            sum += kv.first;
+        }
+
+        for (auto & kv : logits_id) {
+            kv.first /= sum;
+        }
+    }
+
+    {
+        for (const auto & prob : logits_id) {
+            if (lang_probs) {
+                lang_probs[prob.second] = prob.first;
+            }
+
+            //printf("%s: lang %2d (%3s): %f\n", __func__, prob.second, whisper_lang_str(prob.second), prob.first);
+        }
+    }
+
+    return logits_id[0].second;
+}
+
+int whisper_lang_auto_detect(
+        struct whisper_context * ctx,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
+}
+
+int whisper_lang_detect_batch_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                  const float ** samples,
+                     const int * n_samples,
+                           int   n_clips,
+                           int   n_threads,
+                           int * lang_ids,
+                         float * lang_probs) {
+    const int n_audio_ctx = ctx->model.hparams.n_audio_ctx;
+    const int n_lang      = whisper_lang_max_id() + 1;
+
+    std::vector<whisper_token> lang_tokens(n_lang);
+    for (int i = 0; i < n_lang; ++i) {
+        lang_tokens[i] = whisper_token_lang(ctx, i);
+    }
+
+    // the log mel spectrogram and the reduced audio_ctx of each clip - at most 30 s of each clip are used
+    std::vector<whisper_mel> mels(n_clips);
+    std::vector<int>         n_ctx(n_clips);
+
+    for (int c = 0; c < n_clips; ++c) {
+        if (samples[c] == nullptr || n_samples[c] <= 0) {
+            WHISPER_LOG_ERROR("%s: clip %d has no audio\n", __func__, c);
+            return -1;
+        }
+
+        if (!log_mel_spectrogram(*state, samples[c], n_samples[c], WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, mels[c])) {
+            WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram of clip %d\n", __func__, c);
+            return -2;
+        }
+
+        const int n_frames = std::min(mels[c].n_len_org, 2*n_audio_ctx);
+
+        n_ctx[c] = std::min(n_audio_ctx, (int) GGML_PAD((n_frames + 1)/2, WHISPER_LANG_CTX_PAD));
+    }
+
+    // group the clips by length, so that the padding of each group is small
+    // the number of encoded frames of a group does not exceed the audio_ctx of the model
+    std::vector<int> order(n_clips);
+    for (int c = 0; c < n_clips; ++c) {
+        order[c] = c;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return n_ctx[a] < n_ctx[b]; });
+
+    std::vector<const whisper_mel *> mels_group;
+    std::vector<float>               logits;
+
+    for (int i0 = 0; i0 < n_clips; ) {
+        int i1 = i0 + 1;
+        while (i1 < n_clips && (i1 - i0 + 1)*n_ctx[order[i1]] <= n_audio_ctx) {
+            i1++;
+        }
+
+        const int n_group     = i1 - i0;
+        const int n_ctx_group = n_ctx[order[i1 - 1]];
+
+        mels_group.clear();
+        for (int i = i0; i < i1; ++i) {
+            mels_group.push_back(&mels[order[i]]);
+        }
+
+        logits.resize(n_group*n_lang);
+
+        if (!whisper_lang_batch_internal(*ctx, *state, mels_group.data(), n_group, n_ctx_group, lang_tokens.data(), n_lang, n_threads, logits.data())) {
+            WHISPER_LOG_ERROR("%s: failed to evaluate the clips\n", __func__);
+            return -6;
+        }
+
+        // softmax over the languages
+        for (int i = i0; i < i1; ++i) {
+            const int c = order[i];
+
+            const float * lc = logits.data() + (i - i0)*n_lang;
+
+            int best = 0;
+            for (int l = 1; l < n_lang; ++l) {
+                if (lc[l] > lc[best]) {
+                    best = l;
+                }
+            }
+
+            if (lang_ids) {
+                lang_ids[c] = best;
+            }
+
+            if (lang_probs) {
+                float * pc = lang_probs + c*n_lang;
+
+                double sum = 0.0;
+                for (int l = 0; l < n_lang; ++l) {
+                    pc[l] = exp(lc[l] - lc[best]);
+                    sum += pc[l];
+                }
+
+                for (int l = 0; l < n_lang; ++l) {
+                    pc[l] /= sum;
+                }
+            }
+        }
+
+        i0 = i1;
+    }
+
+    return 0;
+}
+
+int whisper_lang_detect_batch(
+        struct whisper_context * ctx,
+                  const float ** samples,
+                     const int * n_samples,
+                           int   n_clips,
+                           int   n_threads,
+                           int * lang_ids,
+                         float * lang_probs) {
+    return whisper_lang_detect_batch_with_state(ctx, ctx->state, samples, n_samples, n_clips, n_threads, lang_ids, lang_probs);
+}
+
+int whisper_model_n_vocab(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_vocab;
+}
+
+int whisper_model_n_audio_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_ctx;
+}
+
+int whisper_model_n_audio_state(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_state;
+}
+
+int whisper_model_n_audio_head(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_head;
+}
+
+int whisper_model_n_audio_layer(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_layer;
+}
+
+int whisper_model_n_text_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_ctx;
+}
+
+int whisper_model_n_text_state(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_state;
+}
+
+int whisper_model_n_text_head(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_head;
+}
+
+int whisper_model_n_text_layer(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_layer;
+}
+
+int whisper_model_n_mels(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_mels;
+}
+
+int whisper_model_ftype(struct whisper_context * ctx) {
+    return ctx->model.hparams.ftype;
+}
+
+int whisper_model_type(struct whisper_context * ctx) {
+    return ctx->model.type;
+}
+
+const char *whisper_model_type_readable(struct whisper_context * ctx) {
+    switch (ctx->model.type) {
+    case e_model::MODEL_TINY:
+        return "tiny";
+    case e_model::MODEL_BASE:
+        return "base";
+    case e_model::MODEL_SMALL:
+        return "small";
+    case e_model::MODEL_MEDIUM:
+        return "medium";
+    case e_model::MODEL_LARGE:
+        return "large";
+    default:
+        return "unknown";
+    }
+}
+
+int whisper_n_len_from_state(struct whisper_state * state) {
+    return state->mel.n_len_org;
+}
+
+int whisper_n_len(struct whisper_context * ctx) {
+    return ctx->state->mel.n_len_org;
+}
+
+int whisper_n_vocab(struct whisper_context * ctx) {
+    return ctx->vocab.n_vocab;
+}
+
+int whisper_n_text_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_ctx;
+}
+
+int whisper_n_audio_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_ctx;
+}
+
+int whisper_is_multilingual(struct whisper_context * ctx) {
+    return ctx->vocab.is_multilingual() ? 1 : 0;
+}
+
+float * whisper_get_logits(struct whisper_context * ctx) {
+    return ctx->state->logits.data();
+}
+
+float * whisper_get_logits_from_state(struct whisper_state * state) {
+    return state->logits.data();
+}
+
+const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
+    return ctx->vocab.id_to_token.at(token).c_str();
+}
+
+whisper_token whisper_token_eot(struct whisper_context * ctx) {
+    return ctx->vocab.token_eot;
+}
+
+whisper_token whisper_token_sot(struct whisper_context * ctx) {
+    return ctx->vocab.token_sot;
+}
+
+whisper_token whisper_token_solm(struct whisper_context * ctx) {
+    return ctx->vocab.token_solm;
+}
+
+whisper_token whisper_token_prev(struct whisper_context * ctx) {
+    return ctx->vocab.token_prev;
+}
+
+whisper_token whisper_token_nosp(struct whisper_context * ctx) {
+    return ctx->vocab.token_nosp;
+}
+
+whisper_token whisper_token_not(struct whisper_context * ctx) {
+    return ctx->vocab.token_not;
+}
+
+whisper_token whisper_token_beg(struct whisper_context * ctx) {
+    return ctx->vocab.token_beg;
+}
+
+whisper_token whisper_token_lang(struct whisper_context * ctx, int lang_id) {
+    return whisper_token_sot(ctx) + 1 + lang_id;
+}
+
+whisper_token whisper_token_translate(struct whisper_context * ctx) {
+    return ctx->vocab.token_translate;
+}
+
+whisper_token whisper_token_transcribe(struct whisper_context * ctx) {
+    return ctx->vocab.token_transcribe;
+}
+
+void whisper_print_timings(struct whisper_context * ctx) {
+    const int64_t t_end_us = ggml_time_us();
+
+    WHISPER_LOG_INFO("\n");
+    WHISPER_LOG_INFO("%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us / 1000.0f);
+    if (ctx->state != nullptr) {
+
+        const int32_t n_sample = std::max(1, ctx->state->n_sample);
+        const int32_t n_encode = std::max(1, ctx->state->n_encode);
+        const int32_t n_decode = std::max(1, ctx->state->n_decode);
+        const int32_t n_batchd = std::max(1, ctx->state->n_batchd);
+        const int32_t n_prompt = std::max(1, ctx->state->n_prompt);
+
+        WHISPER_LOG_INFO("%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
+        WHISPER_LOG_INFO("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
+        WHISPER_LOG_INFO("%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
+        WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
+        WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
+        WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
+        WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
+    }
+    WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
+}
+
+void whisper_reset_timings(struct whisper_context * ctx) {
+    ctx->t_start_us = ggml_time_us();
+    if (ctx->state != nullptr) {
+        ctx->state->t_mel_us = 0;
+        ctx->state->t_sample_us = 0;
+        ctx->state->t_encode_us = 0;
+        ctx->state->t_decode_us = 0;
+        ctx->state->t_batchd_us = 0;
+        ctx->state->t_prompt_us = 0;
+        ctx->state->n_sample = 0;
+        ctx->state->n_encode = 0;
+        ctx->state->n_decode = 0;
+        ctx->state->n_batchd = 0;
+        ctx->state->n_prompt = 0;
+    }
+}
+
+static int whisper_has_coreml(void) {
+#ifdef WHISPER_USE_COREML
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static int whisper_has_openvino(void) {
+#ifdef WHISPER_USE_OPENVINO
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+const char * whisper_print_system_info(void) {
+    static std::string s;
+
+    s  = "";
+    s += "AVX = "       + std::to_string(ggml_cpu_has_avx())       + " | ";
+    s += "AVX2 = "      + std::to_string(ggml_cpu_has_avx2())      + " | ";
+    s += "AVX512 = "    + std::to_string(ggml_cpu_has_avx512())    + " | ";
+    s += "FMA = "       + std::to_string(ggml_cpu_has_fma())       + " | ";
+    s += "NEON = "      + std::to_string(ggml_cpu_has_neon())      + " | ";
+    s += "ARM_FMA = "   + std::to_string(ggml_cpu_has_arm_fma())   + " | ";
+    s += "METAL = "     + std::to_string(ggml_cpu_has_metal())     + " | ";
+    s += "F16C = "      + std::to_string(ggml_cpu_has_f16c())      + " | ";
+    s += "FP16_VA = "   + std::to_string(ggml_cpu_has_fp16_va())   + " | ";
+    s += "WASM_SIMD = " + std::to_string(ggml_cpu_has_wasm_simd()) + " | ";
+    s += "BLAS = "      + std::to_string(ggml_cpu_has_blas())      + " | ";
+    s += "SSE3 = "      + std::to_string(ggml_cpu_has_sse3())      + " | ";
+    s += "SSSE3 = "     + std::to_string(ggml_cpu_has_ssse3())     + " | ";
+    s += "VSX = "       + std::to_string(ggml_cpu_has_vsx())       + " | ";
+    s += "CUDA = "      + std::to_string(ggml_cpu_has_cublas())    + " | ";
+    s += "COREML = "    + std::to_string(whisper_has_coreml())     + " | ";
+    s += "OPENVINO = "  + std::to_string(whisper_has_openvino())   + " | ";
+
+    return s.c_str();
+}
+
+//////////////////////////////////
+// Grammar - ported from llama.cpp
+//////////////////////////////////
+
+// Decodes a UTF-8 string which may end in an incomplete sequence. Adds a terminating 0 for use as
+// pointer. If an invalid sequence is encountered, returns `whisper_partial_utf8.n_remain == -1`.
+std::pair<std::vector<uint32_t>, whisper_partial_utf8> decode_utf8(
+        const char         * src,
+        whisper_partial_utf8   partial_start) {
+    static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+    const char          * pos      = src;
+    std::vector<uint32_t> code_points;
+    uint32_t              value    = partial_start.value;
+    int                   n_remain = partial_start.n_remain;
+
+    // continue previous decode, if applicable
+    while (*pos != 0 && n_remain > 0) {
+        uint8_t next_byte = static_cast<uint8_t>(*pos);
+        if ((next_byte >> 6) != 2) {
+            // invalid sequence, abort
+            code_points.push_back(0);
+            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, -1 });
+        }
+        value = (value << 6) + (next_byte & 0x3F);
+        ++pos;
+        --n_remain;
+    }
+
+    if (partial_start.n_remain > 0 && n_remain == 0) {
+        code_points.push_back(value);
+    }
+
+    // decode any subsequent utf-8 sequences, which may end in an incomplete one
+    while (*pos != 0) {
+        uint8_t  first_byte = static_cast<uint8_t>(*pos);
+        uint8_t  highbits   = first_byte >> 4;
+                 n_remain   = lookup[highbits] - 1;
+
+        if (n_remain < 0) {
+            // invalid sequence, abort
+            code_points.clear();
+            code_points.push_back(0);
+            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, n_remain });
+        }
+
+        uint8_t  mask       = (1 << (7 - n_remain)) - 1;
+                 value      = first_byte & mask;
+        ++pos;
+        while (*pos != 0 && n_remain > 0) {
+            value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
+            ++pos;
+            --n_remain;
+        }
+        if (n_remain == 0) {
+            code_points.push_back(value);
+        }
+    }
+    code_points.push_back(0);
+
+    return std::make_pair(std::move(code_points), whisper_partial_utf8{ value, n_remain });
+}
+
+// returns true iff pos points to the end of one of the definitions of a rule
+static bool whisper_grammar_is_end_of_sequence(const whisper_grammar_element * pos) {
+    switch (pos->type) {
+        case WHISPER_GRETYPE_END: return true;  // NOLINT
+        case WHISPER_GRETYPE_ALT: return true;  // NOLINT
+        default:                return false;
+    }
+}
+
+// returns true iff chr satisfies the char range at pos (regular or inverse range)
+// asserts that pos is pointing to a char range element
+static std::pair<bool, const whisper_grammar_element *> whisper_grammar_match_char(
+        const whisper_grammar_element * pos,
+        const uint32_t                chr) {
+
+    bool found            = false;
+    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
+
+    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT); // NOLINT
+
+    do {
+        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
+            // inclusive range, e.g. [a-z]
+            found = found || (pos->value <= chr && chr <= pos[1].value);
+            pos += 2;
+        } else {
+            // exact char match, e.g. [a] or "a"
+            found = found || pos->value == chr;
+            pos += 1;
+        }
+    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
+
+    return std::make_pair(found == is_positive_char, pos);
+}
+
+// returns true iff some continuation of the given partial UTF-8 sequence could satisfy the char
+// range at pos (regular or inverse range)
+// asserts that pos is pointing to a char range element
+static bool whisper_grammar_match_partial_char(
+        const whisper_grammar_element * pos,
+        const whisper_partial_utf8      partial_utf8) {
+
+    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
+    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT);
+
+    uint32_t partial_value = partial_utf8.value;
+    int      n_remain      = partial_utf8.n_remain;
+
+    // invalid sequence or 7-bit char split across 2 bytes (overlong)
+    if (n_remain < 0 || (n_remain == 1 && partial_value < 2)) {
+        return false;
+    }
+
+    // range of possible code points this partial UTF-8 sequence could complete to
+    uint32_t low  = partial_value << (n_remain * 6);
+    uint32_t high = low | ((1 << (n_remain * 6)) - 1);
+
+    if (low == 0) {
+        if (n_remain == 2) {
+            low = 1 << 11;
+        } else if (n_remain == 3) {
+            low = 1 << 16;
+        }
+    }
+
+    do {
+        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
+            // inclusive range, e.g. [a-z]
+            if (pos->value <= high && low <= pos[1].value) {
+                return is_positive_char;
+            }
+            pos += 2;
+        } else {
+            // exact char match, e.g. [a] or "a"
+            if (low <= pos->value && pos->value <= high) {
+                return is_positive_char;
+            }
+            pos += 1;
+        }
+    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
+
+    return !is_positive_char;
+}
+
+
+// transforms a grammar pushdown stack into N possible stacks, all ending
+// at a character range (terminal element)
+static void whisper_grammar_advance_stack(
+        const std::vector<std::vector<whisper_grammar_element>>   & rules,
+        const std::vector<const whisper_grammar_element *>        & stack,
+        std::vector<std::vector<const whisper_grammar_element *>> & new_stacks) {
+
+    if (stack.empty()) {
+        new_stacks.push_back(stack);
+        return;
+    }
+
+    const whisper_grammar_element * pos = stack.back();
+
+    switch (pos->type) {
+        case WHISPER_GRETYPE_RULE_REF: {
+            const size_t                  rule_id = static_cast<size_t>(pos->value);
+            const whisper_grammar_element * subpos  = rules[rule_id].data();
+            do {
+                // init new stack without the top (pos)
+                std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
+                if (!whisper_grammar_is_end_of_sequence(pos + 1)) {
+                    // if this rule ref is followed by another element, add that to stack
+                    new_stack.push_back(pos + 1);
+                }
+                if (!whisper_grammar_is_end_of_sequence(subpos)) {
+                    // if alternate is nonempty, add to stack
+                    new_stack.push_back(subpos);
+                }
+                whisper_grammar_advance_stack(rules, new_stack, new_stacks);
+                while (!whisper_grammar_is_end_of_sequence(subpos)) {
+                    // scan to end of alternate def
+                    subpos++;
+                }
+                if (subpos->type == WHISPER_GRETYPE_ALT) {
+                    // there's another alternate def of this rule to process
+                    subpos++;
+                } else {
+                    break;
+                }
+            } while (true);
+            break;
+        }
+        case WHISPER_GRETYPE_CHAR:
+        case WHISPER_GRETYPE_CHAR_NOT:
+            new_stacks.push_back(stack);
+            break;
+        default:
+            // end of alternate (WHISPER_GRETYPE_END, WHISPER_GRETYPE_ALT) or middle of char range
+            // (WHISPER_GRETYPE_CHAR_ALT, WHISPER_GRETYPE_CHAR_RNG_UPPER); stack should never be left on
+            // those
+            WHISPER_ASSERT(false);
+    }
+}
+
+// takes a set of possible pushdown stacks on a grammar, which are required to
+// be positioned at a character range (see `whisper_grammar_advance_stack`), and
+// produces the N possible stacks if the given char is accepted at those
+// positions
+static std::vector<std::vector<const whisper_grammar_element *>> whisper_grammar_accept(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const uint32_t                                                  chr) {
+
+    std::vector<std::vector<const whisper_grammar_element *>> new_stacks;
+
+    for (const auto & stack : stacks) {
+        if (stack.empty()) {
+            continue;
+        }
+
+        auto match = whisper_grammar_match_char(stack.back(), chr);
+        if (match.first) {
+            const whisper_grammar_element * pos = match.second;
+
+            // update top of stack to next element, if any
+            std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
+            if (!whisper_grammar_is_end_of_sequence(pos)) {
+                new_stack.push_back(pos);
+            }
+            whisper_grammar_advance_stack(rules, new_stack, new_stacks);
+        }
+    }
+
+    return new_stacks;
+}
 
-    state->mel.data.resize(n_len*n_mel);
-    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const std::vector<whisper_grammar_candidate>                    & candidates);
 
-    return 0;
-}
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates_for_stack(
+        const std::vector<std::vector<whisper_grammar_element>> & rules,
+        const std::vector<const whisper_grammar_element *>      & stack,
+        const std::vector<whisper_grammar_candidate>            & candidates) {
 
-int whisper_set_mel(
-        struct whisper_context * ctx,
-        const float * data,
-        int n_len,
-        int n_mel) {
-    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
-}
+    std::vector<whisper_grammar_candidate> rejects;
 
-int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *state, offset, n_threads, nullptr, nullptr)) {
-        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
-        return -1;
+    if (stack.empty()) {
+        for (auto tok : candidates) {
+            if (*tok.code_points != 0 || tok.partial_utf8.n_remain != 0) {
+                rejects.push_back(tok);
+            }
+        }
+        return rejects;
     }
 
-    return 0;
-}
+    const whisper_grammar_element * stack_pos = stack.back();
 
-int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads, nullptr, nullptr)) {
-        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
-        return -1;
+    std::vector<whisper_grammar_candidate> next_candidates;
+    for (auto tok : candidates) {
+        if (*tok.code_points == 0) {
+            // reached end of full codepoints in token, reject iff it ended in a partial sequence
+            // that cannot satisfy this position in grammar
+            if (tok.partial_utf8.n_remain != 0 && !whisper_grammar_match_partial_char(stack_pos, tok.partial_utf8)) {
+                rejects.push_back(tok);
+            }
+        } else if (whisper_grammar_match_char(stack_pos, *tok.code_points).first) {
+            next_candidates.push_back({ tok.id, tok.code_points + 1, tok.partial_utf8 });
+        } else {
+            rejects.push_back(tok);
+        }
     }
 
-    return 0;
-}
-
-int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    whisper_batch_prep_legacy(state->batch, tokens, n_tokens, n_past, 0);
+    const auto * stack_pos_after = whisper_grammar_match_char(stack_pos, 0).second;
 
-    whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+    // update top of stack to next element, if any
+    std::vector<const whisper_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
+    if (!whisper_grammar_is_end_of_sequence(stack_pos_after)) {
+        stack_after.push_back(stack_pos_after);
+    }
+    std::vector<std::vector<const whisper_grammar_element *>> next_stacks;
+    whisper_grammar_advance_stack(rules, stack_after, next_stacks);
 
-    if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, nullptr, nullptr)) {
-        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
-        return 1;
+    auto next_rejects = whisper_grammar_reject_candidates(rules, next_stacks, next_candidates);
+    for (auto tok : next_rejects) {
+        rejects.push_back({ tok.id, tok.code_points - 1, tok.partial_utf8 });
     }
 
-    return 0;
+    return rejects;
 }
 
-int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    if (ctx->state == nullptr) {
-        WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
-        return -1;
+static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        const std::vector<whisper_grammar_candidate>                    & candidates) {
+    if (candidates.empty() || stacks.empty()) {
+        return std::vector<whisper_grammar_candidate>();
     }
 
-    return whisper_decode_with_state(ctx, ctx->state, tokens, n_tokens, n_past, n_threads);
+    auto rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+
+    for (size_t i = 1, size = stacks.size(); i < size; ++i) {
+        rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
+    }
+    return rejects;
 }
 
-int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
-    const auto res = tokenize(ctx->vocab, text);
+static std::shared_ptr<whisper_grammar_compiled> whisper_grammar_compile(
+    const whisper_context            & ctx,
+    const whisper_grammar_element ** rules,
+                           size_t    n_rules,
+                           size_t    i_start_rule) {
+    auto result = std::make_shared<whisper_grammar_compiled>();
 
-    if (n_max_tokens < (int) res.size()) {
-        WHISPER_LOG_ERROR("%s: too many resulting tokens: %d (max %d)\n", __func__, (int) res.size(), n_max_tokens);
-        return -1;
-    }
+    const whisper_grammar_element * pos;
 
-    for (int i = 0; i < (int) res.size(); i++) {
-        tokens[i] = res[i];
+    // copy rule definitions into vectors
+    auto & vec_rules = result->rules;
+    vec_rules.resize(n_rules);
+    for (size_t i = 0; i < n_rules; i++) {
+        for (pos = rules[i]; pos->type != WHISPER_GRETYPE_END; pos++) {
+            vec_rules[i].push_back(*pos);
+        }
+        vec_rules[i].push_back({WHISPER_GRETYPE_END, 0});
     }
 
-    return res.size();
-}
+    // loop over alternates of start rule to build initial stacks
+    auto & stacks = result->stacks;
+    pos = vec_rules[i_start_rule].data();
+    do {
+        std::vector<const whisper_grammar_element *> stack;
+        if (!whisper_grammar_is_end_of_sequence(pos)) {
+            // if alternate is nonempty, add to stack
+            stack.push_back(pos);
+        }
+        whisper_grammar_advance_stack(vec_rules, stack, stacks);
+        while (!whisper_grammar_is_end_of_sequence(pos)) {
+            // scan to end of alternate def
+            pos++;
+        }
+        if (pos->type == WHISPER_GRETYPE_ALT) {
+            // there's another alternate def of this rule to process
+            pos++;
+        } else {
+            break;
+        }
+    } while (true);
 
-int whisper_lang_max_id() {
-    auto max_id = 0;
-    for (const auto & kv : g_lang) {
-        max_id = std::max(max_id, kv.second.first);
-    }
+    // decode the vocabulary once
+    const whisper_token eot = ctx.vocab.token_eot;
 
-    return max_id;
-}
+    result->code_points.resize(eot);
+    result->candidates.reserve(eot);
 
-int whisper_lang_id(const char * lang) {
-    if (!g_lang.count(lang)) {
-        for (const auto & kv : g_lang) {
-            if (kv.second.second == lang) {
-                return kv.second.first;
-            }
+    for (whisper_token id = 0; id < eot; ++id) {
+        const auto it = ctx.vocab.id_to_token.find(id);
+        if (it == ctx.vocab.id_to_token.end() || it->second.empty()) {
+            continue;
         }
 
-        WHISPER_LOG_ERROR("%s: unknown language '%s'\n", __func__, lang);
-        return -1;
-    }
-    return g_lang.at(lang).first;
-}
+        auto decoded = decode_utf8(it->second.c_str(), { 0, 0 });
 
-const char * whisper_lang_str(int id) {
-    for (const auto & kv : g_lang) {
-        if (kv.second.first == id) {
-            return kv.first.c_str();
-        }
+        result->code_points[id] = std::move(decoded.first);
+        result->candidates.push_back({ id, result->code_points[id].data(), decoded.second });
     }
 
-    WHISPER_LOG_ERROR("%s: unknown language id %d\n", __func__, id);
-    return nullptr;
+    return result;
 }
 
-const char * whisper_lang_str_full(int id) {
-   for (const auto & kv : g_lang) {
-        if (kv.second.first == id) {
-            return kv.second.second.c_str();
-        }
+static struct whisper_grammar whisper_grammar_init(const std::shared_ptr<whisper_grammar_compiled> & compiled) {
+    if (!compiled) {
+        return {};
     }
 
-    WHISPER_LOG_ERROR("%s: unknown language id %d\n", __func__, id);
-    return nullptr;
+    return { compiled, compiled->stacks, {} };
 }
 
-int whisper_lang_auto_detect_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-                           int   offset_ms,
-                           int   n_threads,
-                         float * lang_probs) {
-    const int seek = offset_ms/10;
+// the key of a grammar state in whisper_grammar_compiled::masks
+static std::string whisper_grammar_state_key(const whisper_grammar & grammar) {
+    // the decoding of the candidates depends on the value of the partial sequence only if it is incomplete
+    const int32_t n_remain = grammar.partial_utf8.n_remain;
+    const int32_t value    = n_remain > 0 ? grammar.partial_utf8.value : 0;
 
-    if (seek < 0) {
-        WHISPER_LOG_ERROR("%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
-        return -1;
-    }
+    std::string key;
+    key.append((const char *) &n_remain, sizeof(n_remain));
+    key.append((const char *) &value,    sizeof(value));
 
-    if (seek >= state->mel.n_len_org) {
-        WHISPER_LOG_ERROR("%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len_org*10);
-        return -2;
+    for (const auto & stack : grammar.stacks) {
+        const int32_t n = stack.size();
+        key.append((const char *) &n, sizeof(n));
+        key.append((const char *) stack.data(), n*sizeof(stack[0]));
     }
 
-    // run the encoder
-    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
-        WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
-        return -6;
-    }
+    return key;
+}
 
-    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
+static void whisper_suppress_invalid_grammar(
+             whisper_context  & ctx,
+    const whisper_full_params & params,
+           std::vector<float> & logits,
+    const     whisper_grammar & grammar) {
 
-    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
-        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-        return -7;
+    if (!grammar.compiled || grammar.stacks.empty()) {
+        return;
     }
 
-    auto & logits_id = state->decoders[0].logits_id;
-    logits_id.clear();
-
-    for (const auto & kv : g_lang) {
-        const auto token_lang = whisper_token_lang(ctx, kv.second.first);
-        logits_id.emplace_back(state->logits[token_lang], kv.second.first);
-    }
+    //bool allow_eot = false;
+    //for (const auto & stack : grammar.stacks) {
+    //    if (stack.empty()) {
+    //        allow_eot = true;
+    //        break;
+    //    }
+    //}
 
-    // sort descending
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::sort(logits_id.begin(), logits_id.end(), [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
+    auto & compiled = *grammar.compiled;
 
-    // softmax
-    {
-        const auto max = logits_id[0].first;
+    const whisper_token eot = whisper_token_eot(&ctx);
 
-        double sum = 0.0f;
-        for (auto & kv : logits_id) {
-            kv.first = exp(kv.first - max);
-            sum += kv.first;
-        }
+    const std::string key = whisper_grammar_state_key(grammar);
 
-        for (auto & kv : logits_id) {
-            kv.first /= sum;
-        }
-    }
+    const std::vector<uint32_t> * mask = nullptr;
 
     {
-        for (const auto & prob : logits_id) {
-            if (lang_probs) {
-                lang_probs[prob.second] = prob.first;
-            }
+        std::lock_guard<std::mutex> lock(compiled.mutex);
 
-            //printf("%s: lang %2d (%3s): %f\n", __func__, prob.second, whisper_lang_str(prob.second), prob.first);
+        const auto it = compiled.masks.find(key);
+        if (it != compiled.masks.end()) {
+            mask = &it->second;
         }
     }
 
-    return logits_id[0].second;
-}
+    std::vector<uint32_t> mask_new;
 
-int whisper_lang_auto_detect(
-        struct whisper_context * ctx,
-                           int   offset_ms,
-                           int   n_threads,
-                         float * lang_probs) {
-    return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
-}
+    if (mask == nullptr) {
+        std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
+        std::vector<whisper_grammar_candidate>                              candidates_grammar;
 
-int whisper_model_n_vocab(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_vocab;
-}
+        if (grammar.partial_utf8.n_remain > 0) {
+            for (whisper_token id = 0; id < eot; ++id) {
+                const std::string & text = ctx.vocab.id_to_token[id];
+                if (!text.empty()) {
+                    candidates_decoded.push_back(decode_utf8(text.c_str(), grammar.partial_utf8));
+                    candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+                }
+            }
+        }
 
-int whisper_model_n_audio_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_ctx;
-}
+        const auto rejects = whisper_grammar_reject_candidates(compiled.rules, grammar.stacks,
+                grammar.partial_utf8.n_remain > 0 ? candidates_grammar : compiled.candidates);
 
-int whisper_model_n_audio_state(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_state;
-}
+        mask_new.assign((eot + 31)/32, 0xFFFFFFFF);
 
-int whisper_model_n_audio_head(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_head;
-}
+        for (const auto & reject : rejects) {
+            mask_new[reject.id/32] &= ~(1u << (reject.id%32));
+        }
 
-int whisper_model_n_audio_layer(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_layer;
-}
+        std::lock_guard<std::mutex> lock(compiled.mutex);
 
-int whisper_model_n_text_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_ctx;
-}
+        if ((int) compiled.masks.size() < whisper_grammar_compiled::n_states_max) {
+            mask = &compiled.masks.emplace(key, std::move(mask_new)).first->second;
+        } else {
+            mask = &mask_new;
+        }
+    }
 
-int whisper_model_n_text_state(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_state;
-}
+    for (whisper_token id = 0; id < eot; ++id) {
+        if (((*mask)[id/32] >> (id%32) & 1) == 0) {
+            logits[id] -= params.grammar_penalty;
+        }
+    }
 
-int whisper_model_n_text_head(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_head;
+    // when the grammar allows a continuation, we penalize the end-of-text token
+    //if (!allow_eot) {
+    //    logits[eot] -= params.grammar_penalty;
+    //}
+    //fprintf(stderr, "Allowed: (%zu tokens)\n", size - rejects.size());
 }
 
-int whisper_model_n_text_layer(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_layer;
-}
+static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
+    if (!grammar.compiled || grammar.stacks.empty()) {
+        return;
+    }
 
-int whisper_model_n_mels(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_mels;
-}
+    //fprintf(stderr, "Accept: '%s'\n", ctx.vocab.id_to_token[token].c_str());
 
-int whisper_model_ftype(struct whisper_context * ctx) {
-    return ctx->model.hparams.ftype;
-}
+    const std::string & text = ctx.vocab.id_to_token[token];
 
-int whisper_model_type(struct whisper_context * ctx) {
-    return ctx->model.type;
-}
+    if (text.rfind("[_", 0) == 0) {
+        // fprintf(stderr, " (skipped)\n");
+        return;
+    }
+    // fprintf(stderr, "\n");
 
-const char *whisper_model_type_readable(struct whisper_context * ctx) {
-    switch (ctx->model.type) {
-    case e_model::MODEL_TINY:
-        return "tiny";
-    case e_model::MODEL_BASE:
-        return "base";
-    case e_model::MODEL_SMALL:
-        return "small";
-    case e_model::MODEL_MEDIUM:
-        return "medium";
-    case e_model::MODEL_LARGE:
-        return "large";
-    default:
-        return "unknown";
+    // Note terminating 0 in decoded string
+    const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
+    const auto & code_points = decoded.first;
+    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
+        grammar.stacks = whisper_grammar_accept(grammar.compiled->rules, grammar.stacks, *it);
     }
+    grammar.partial_utf8 = decoded.second;
 }
 
-int whisper_n_len_from_state(struct whisper_state * state) {
-    return state->mel.n_len_org;
-}
+//////////////
+// END grammar
+//////////////
 
-int whisper_n_len(struct whisper_context * ctx) {
-    return ctx->state->mel.n_len_org;
-}
+////////////////////////////////////////////////////////////////////////////
 
-int whisper_n_vocab(struct whisper_context * ctx) {
-    return ctx->vocab.n_vocab;
-}
+struct whisper_context_params * whisper_context_default_params_by_ref() {
+    struct whisper_context_params params = whisper_context_default_params();
 
-int whisper_n_text_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_ctx;
+    struct whisper_context_params* result = new whisper_context_params();
+    *result = params;
+    return result;
 }
 
-int whisper_n_audio_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_ctx;
-}
+struct whisper_full_params * whisper_full_default_params_by_ref(enum whisper_sampling_strategy strategy) {
+    struct whisper_full_params params = whisper_full_default_params(strategy);
 
-int whisper_is_multilingual(struct whisper_context * ctx) {
-    return ctx->vocab.is_multilingual() ? 1 : 0;
+    struct whisper_full_params* result = new whisper_full_params();
+    *result = params;
+    return result;
 }
 
-float * whisper_get_logits(struct whisper_context * ctx) {
-    return ctx->state->logits.data();
-}
+struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
+    struct whisper_full_params result = {
+        /*.strategy          =*/ strategy,
 
-float * whisper_get_logits_from_state(struct whisper_state * state) {
-    return state->logits.data();
-}
+        /*.n_threads         =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+        /*.n_max_text_ctx    =*/ 16384,
+        /*.offset_ms         =*/ 0,
+        /*.duration_ms       =*/ 0,
 
-const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
-    return ctx->vocab.id_to_token.at(token).c_str();
-}
+        /*.translate         =*/ false,
+        /*.no_context        =*/ true,
+        /*.no_timestamps     =*/ false,
+        /*.single_segment    =*/ false,
+        /*.print_special     =*/ false,
+        /*.print_progress    =*/ true,
+        /*.print_realtime    =*/ false,
+        /*.print_timestamps  =*/ true,
 
-whisper_token whisper_token_eot(struct whisper_context * ctx) {
-    return ctx->vocab.token_eot;
-}
+        /*.token_timestamps  =*/ false,
+        /*.thold_pt          =*/ 0.01f,
+        /*.thold_ptsum       =*/ 0.01f,
+        /*.max_len           =*/ 0,
+        /*.split_on_word     =*/ false,
+        /*.max_tokens        =*/ 0,
 
-whisper_token whisper_token_sot(struct whisper_context * ctx) {
-    return ctx->vocab.token_sot;
-}
+        /*.speed_up          =*/ false,
+        /*.debug_mode        =*/ false,
+        /*.audio_ctx         =*/ 0,
+        /*.audio_ctx_auto    =*/ false,
 
-whisper_token whisper_token_solm(struct whisper_context * ctx) {
-    return ctx->vocab.token_solm;
-}
+        /*.tdrz_enable       =*/ false,
 
-whisper_token whisper_token_prev(struct whisper_context * ctx) {
-    return ctx->vocab.token_prev;
-}
+        /*.vad_split         =*/ false,
+        /*.vad_n_parallel    =*/ 1,
+        /*.vad_thold         =*/ 0.6f,
 
-whisper_token whisper_token_nosp(struct whisper_context * ctx) {
-    return ctx->vocab.token_nosp;
-}
+        /*.skip_silence      =*/ false,
+        /*.skip_silence_ms   =*/ 30000,
+        /*.skip_silence_thold =*/ 0.1f,
 
-whisper_token whisper_token_not(struct whisper_context * ctx) {
-    return ctx->vocab.token_not;
-}
+        /*.initial_prompt    =*/ nullptr,
+        /*.prompt_tokens     =*/ nullptr,
+        /*.prompt_n_tokens   =*/ 0,
 
-whisper_token whisper_token_beg(struct whisper_context * ctx) {
-    return ctx->vocab.token_beg;
-}
+        /*.language          =*/ "en",
+        /*.detect_language   =*/ false,
 
-whisper_token whisper_token_lang(struct whisper_context * ctx, int lang_id) {
-    return whisper_token_sot(ctx) + 1 + lang_id;
-}
+        /*.suppress_blank    =*/ true,
+        /*.suppress_non_speech_tokens =*/ false,
 
-whisper_token whisper_token_translate(struct whisper_context * ctx) {
-    return ctx->vocab.token_translate;
-}
+        /*.temperature       =*/  0.0f,
+        /*.max_initial_ts    =*/  1.0f,
+        /*.length_penalty    =*/ -1.0f,
 
-whisper_token whisper_token_transcribe(struct whisper_context * ctx) {
-    return ctx->vocab.token_transcribe;
-}
+        /*.temperature_inc   =*/  0.2f,
+        /*.entropy_thold     =*/  2.4f,
+        /*.logprob_thold     =*/ -1.0f,
+        /*.no_speech_thold   =*/  0.6f,
+        /*.repetition_max_period =*/ 10,
 
-void whisper_print_timings(struct whisper_context * ctx) {
-    const int64_t t_end_us = ggml_time_us();
+        /*.fallback_speculative =*/ false,
 
-    WHISPER_LOG_INFO("\n");
-    WHISPER_LOG_INFO("%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us / 1000.0f);
-    if (ctx->state != nullptr) {
+        /*.greedy            =*/ {
+            /*.best_of   =*/ -1,
+        },
 
-        const int32_t n_sample = std::max(1, ctx->state->n_sample);
-        const int32_t n_encode = std::max(1, ctx->state->n_encode);
-        const int32_t n_decode = std::max(1, ctx->state->n_decode);
-        const int32_t n_batchd = std::max(1, ctx->state->n_batchd);
-        const int32_t n_prompt = std::max(1, ctx->state->n_prompt);
+        /*.beam_search      =*/ {
+            /*.beam_size =*/ -1,
 
-        WHISPER_LOG_INFO("%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
-        WHISPER_LOG_INFO("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
-        WHISPER_LOG_INFO("%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
-        WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
-        WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
-        WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
-        WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
-    }
-    WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
-}
+            /*.patience  =*/ -1.0f,
+        },
 
-void whisper_reset_timings(struct whisper_context * ctx) {
-    ctx->t_start_us = ggml_time_us();
-    if (ctx->state != nullptr) {
-        ctx->state->t_mel_us = 0;
-        ctx->state->t_sample_us = 0;
-        ctx->state->t_encode_us = 0;
-        ctx->state->t_decode_us = 0;
-        ctx->state->t_batchd_us = 0;
-        ctx->state->t_prompt_us = 0;
-        ctx->state->n_sample = 0;
-        ctx->state->n_encode = 0;
-        ctx->state->n_decode = 0;
-        ctx->state->n_batchd = 0;
-        ctx->state->n_prompt = 0;
-    }
-}
+        /*.new_segment_callback           =*/ nullptr,
+        /*.new_segment_callback_user_data =*/ nullptr,
 
-static int whisper_has_coreml(void) {
-#ifdef WHISPER_USE_COREML
-    return 1;
-#else
-    return 0;
-#endif
-}
+        /*.progress_callback           =*/ nullptr,
+        /*.progress_callback_user_data =*/ nullptr,
+
+        /*.encoder_begin_callback           =*/ nullptr,
+        /*.encoder_begin_callback_user_data =*/ nullptr,
+
+        /*.abort_callback                   =*/ nullptr,
+        /*.abort_callback_user_data         =*/ nullptr,
+
+        /*.logits_filter_callback           =*/ nullptr,
+        /*.logits_filter_callback_user_data =*/ nullptr,
+
+        /*.grammar_rules   =*/ nullptr,
+        /*.n_grammar_rules =*/ 0,
+        /*.i_start_rule    =*/ 0,
+        /*.grammar_penalty =*/ 100.0f,
+    };
+
+    switch (strategy) {
+        case WHISPER_SAMPLING_GREEDY:
+            {
+                result.greedy = {
+                    /*.best_of   =*/ 5,
+                };
+            } break;
+        case WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                result.beam_search = {
+                    /*.beam_size =*/ 5,
 
-static int whisper_has_openvino(void) {
-#ifdef WHISPER_USE_OPENVINO
-    return 1;
-#else
-    return 0;
-#endif
+                    /*.patience  =*/ -1.0f,
+                };
+            } break;
+    }
+
+    return result;
 }
 
-const char * whisper_print_system_info(void) {
-    static std::string s;
+// forward declarations
+static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
+static void whisper_exp_compute_token_level_timestamps(
+        struct whisper_context & ctx,
+          struct whisper_state & state,
+                           int   i_segment,
+                         float   thold_pt,
+                         float   thold_ptsum);
 
-    s  = "";
-    s += "AVX = "       + std::to_string(ggml_cpu_has_avx())       + " | ";
-    s += "AVX2 = "      + std::to_string(ggml_cpu_has_avx2())      + " | ";
-    s += "AVX512 = "    + std::to_string(ggml_cpu_has_avx512())    + " | ";
-    s += "FMA = "       + std::to_string(ggml_cpu_has_fma())       + " | ";
-    s += "NEON = "      + std::to_string(ggml_cpu_has_neon())      + " | ";
-    s += "ARM_FMA = "   + std::to_string(ggml_cpu_has_arm_fma())   + " | ";
-    s += "METAL = "     + std::to_string(ggml_cpu_has_metal())     + " | ";
-    s += "F16C = "      + std::to_string(ggml_cpu_has_f16c())      + " | ";
-    s += "FP16_VA = "   + std::to_string(ggml_cpu_has_fp16_va())   + " | ";
-    s += "WASM_SIMD = " + std::to_string(ggml_cpu_has_wasm_simd()) + " | ";
-    s += "BLAS = "      + std::to_string(ggml_cpu_has_blas())      + " | ";
-    s += "SSE3 = "      + std::to_string(ggml_cpu_has_sse3())      + " | ";
-    s += "SSSE3 = "     + std::to_string(ggml_cpu_has_ssse3())     + " | ";
-    s += "VSX = "       + std::to_string(ggml_cpu_has_vsx())       + " | ";
-    s += "CUDA = "      + std::to_string(ggml_cpu_has_cublas())    + " | ";
-    s += "COREML = "    + std::to_string(whisper_has_coreml())     + " | ";
-    s += "OPENVINO = "  + std::to_string(whisper_has_openvino())   + " | ";
+static inline bool should_split_on_word(const char * txt, bool split_on_word) {
+    if (!split_on_word) return true;
 
-    return s.c_str();
+    return txt[0] == ' ';
 }
 
-//////////////////////////////////
-// Grammar - ported from llama.cpp
-//////////////////////////////////
+// wrap the last segment to max_len characters
+// returns the number of new segments
+static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
+    auto segment = state.result_all.back();
 
-// Decodes a UTF-8 string which may end in an incomplete sequence. Adds a terminating 0 for use as
-// pointer. If an invalid sequence is encountered, returns `whisper_partial_utf8.n_remain == -1`.
-std::pair<std::vector<uint32_t>, whisper_partial_utf8> decode_utf8(
-        const char         * src,
-        whisper_partial_utf8   partial_start) {
-    static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
-    const char          * pos      = src;
-    std::vector<uint32_t> code_points;
-    uint32_t              value    = partial_start.value;
-    int                   n_remain = partial_start.n_remain;
+    int res = 1;
+    int acc = 0;
 
-    // continue previous decode, if applicable
-    while (*pos != 0 && n_remain > 0) {
-        uint8_t next_byte = static_cast<uint8_t>(*pos);
-        if ((next_byte >> 6) != 2) {
-            // invalid sequence, abort
-            code_points.push_back(0);
-            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, -1 });
+    std::string text;
+
+    for (int i = 0; i < (int) segment.tokens.size(); i++) {
+        const auto & token = segment.tokens[i];
+        if (token.id >= whisper_token_eot(&ctx)) {
+            continue;
         }
-        value = (value << 6) + (next_byte & 0x3F);
-        ++pos;
-        --n_remain;
-    }
 
-    if (partial_start.n_remain > 0 && n_remain == 0) {
-        code_points.push_back(value);
-    }
+        const auto txt = whisper_token_to_str(&ctx, token.id);
+        const int cur = strlen(txt);
 
-    // decode any subsequent utf-8 sequences, which may end in an incomplete one
-    while (*pos != 0) {
-        uint8_t  first_byte = static_cast<uint8_t>(*pos);
-        uint8_t  highbits   = first_byte >> 4;
-                 n_remain   = lookup[highbits] - 1;
+        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
+            state.result_all.back().text = std::move(text);
+            state.result_all.back().t1 = token.t0;
+            state.result_all.back().tokens.resize(i);
+            state.result_all.back().speaker_turn_next = false;
 
-        if (n_remain < 0) {
-            // invalid sequence, abort
-            code_points.clear();
-            code_points.push_back(0);
-            return std::make_pair(std::move(code_points), whisper_partial_utf8{ 0, n_remain });
-        }
+            state.result_all.push_back({});
+            state.result_all.back().t0 = token.t0;
+            state.result_all.back().t1 = segment.t1;
 
-        uint8_t  mask       = (1 << (7 - n_remain)) - 1;
-                 value      = first_byte & mask;
-        ++pos;
-        while (*pos != 0 && n_remain > 0) {
-            value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
-            ++pos;
-            --n_remain;
-        }
-        if (n_remain == 0) {
-            code_points.push_back(value);
+            // add tokens [i, end] to the new segment
+            state.result_all.back().tokens.insert(
+                state.result_all.back().tokens.end(),
+                    segment.tokens.begin() + i,
+                    segment.tokens.end());
+
+            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+
+            acc = 0;
+            text = "";
+
+            segment = state.result_all.back();
+            i = -1;
+
+            res++;
+        } else {
+            acc += cur;
+            text += txt;
         }
     }
-    code_points.push_back(0);
 
-    return std::make_pair(std::move(code_points), whisper_partial_utf8{ value, n_remain });
-}
+    state.result_all.back().text = std::move(text);
 
-// returns true iff pos points to the end of one of the definitions of a rule
-static bool whisper_grammar_is_end_of_sequence(const whisper_grammar_element * pos) {
-    switch (pos->type) {
-        case WHISPER_GRETYPE_END: return true;  // NOLINT
-        case WHISPER_GRETYPE_ALT: return true;  // NOLINT
-        default:                return false;
-    }
+    return res;
 }
 
-// returns true iff chr satisfies the char range at pos (regular or inverse range)
-// asserts that pos is pointing to a char range element
-static std::pair<bool, const whisper_grammar_element *> whisper_grammar_match_char(
-        const whisper_grammar_element * pos,
-        const uint32_t                chr) {
+// [EXPERIMENTAL] DTW token timestamps
+// append the cross-attention weights of the output row i_out of the last decode to aheads_rows
+// returns the index of the new row
+static int32_t whisper_aheads_push(const whisper_context & ctx, whisper_state & state, int i_out) {
+    const int n_aheads    = ctx.aheads.size();
+    const int n_audio_ctx = state.aheads_n_audio_ctx;
+    const int n_outputs   = state.aheads_cross.size()/(n_aheads*n_audio_ctx);
 
-    bool found            = false;
-    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
+    const int32_t row = state.aheads_rows.size()/(n_aheads*n_audio_ctx);
 
-    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT); // NOLINT
+    state.aheads_rows.resize(state.aheads_rows.size() + n_aheads*n_audio_ctx);
 
-    do {
-        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
-            // inclusive range, e.g. [a-z]
-            found = found || (pos->value <= chr && chr <= pos[1].value);
-            pos += 2;
-        } else {
-            // exact char match, e.g. [a] or "a"
-            found = found || pos->value == chr;
-            pos += 1;
-        }
-    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
+    ggml_fp16_t * dst = state.aheads_rows.data() + row*n_aheads*n_audio_ctx;
 
-    return std::make_pair(found == is_positive_char, pos);
+    for (int h = 0; h < n_aheads; ++h) {
+        ggml_fp32_to_fp16_row(state.aheads_cross.data() + (h*n_outputs + i_out)*n_audio_ctx, dst + h*n_audio_ctx, n_audio_ctx);
+    }
+
+    return row;
 }
 
-// returns true iff some continuation of the given partial UTF-8 sequence could satisfy the char
-// range at pos (regular or inverse range)
-// asserts that pos is pointing to a char range element
-static bool whisper_grammar_match_partial_char(
-        const whisper_grammar_element * pos,
-        const whisper_partial_utf8      partial_utf8) {
+// [EXPERIMENTAL] token-level timestamps with dynamic time warping over the cross-attention weights of the alignment heads
+// sets t0 and t1 of the tokens of the sequence, the window starts at seek and has n_frames audio frames
+// ref: https://github.com/openai/whisper/blob/ba3f3cd54b0e5b8ce1ab3de13e32122d0d5f98ab/whisper/timing.py#L163-L226
+static void whisper_dtw_token_timestamps(
+        const whisper_context & ctx,
+        const whisper_state   & state,
+             whisper_sequence & sequence,
+                          int   seek,
+                          int   n_frames) {
+    const int n_aheads    = ctx.aheads.size();
+    const int n_audio_ctx = state.aheads_n_audio_ctx;
 
-    bool is_positive_char = pos->type == WHISPER_GRETYPE_CHAR;
-    WHISPER_ASSERT(is_positive_char || pos->type == WHISPER_GRETYPE_CHAR_NOT);
+    const whisper_token token_eot = ctx.vocab.token_eot;
+    const whisper_token token_beg = ctx.vocab.token_beg;
 
-    uint32_t partial_value = partial_utf8.value;
-    int      n_remain      = partial_utf8.n_remain;
+    auto & tokens = sequence.tokens;
 
-    // invalid sequence or 7-bit char split across 2 bytes (overlong)
-    if (n_remain < 0 || (n_remain == 1 && partial_value < 2)) {
-        return false;
+    const int n_tokens = std::min(tokens.size(), sequence.aheads.size());
+
+    // the rows of the text tokens, followed by the row of the token after the last one, which marks its end
+    std::vector<int32_t> rows;
+    for (int k = 0; k < n_tokens; ++k) {
+        if (tokens[k].id < token_eot) {
+            rows.push_back(k);
+        }
     }
 
-    // range of possible code points this partial UTF-8 sequence could complete to
-    uint32_t low  = partial_value << (n_remain * 6);
-    uint32_t high = low | ((1 << (n_remain * 6)) - 1);
+    if (rows.empty() || n_audio_ctx == 0) {
+        return;
+    }
 
-    if (low == 0) {
-        if (n_remain == 2) {
-            low = 1 << 11;
-        } else if (n_remain == 3) {
-            low = 1 << 16;
-        }
+    const bool has_end = rows.back() + 1 < (int) sequence.aheads.size();
+
+    if (has_end) {
+        rows.push_back(rows.back() + 1);
     }
 
-    do {
-        if (pos[1].type == WHISPER_GRETYPE_CHAR_RNG_UPPER) {
-            // inclusive range, e.g. [a-z]
-            if (pos->value <= high && low <= pos[1].value) {
-                return is_positive_char;
-            }
-            pos += 2;
-        } else {
-            // exact char match, e.g. [a] or "a"
-            if (low <= pos->value && pos->value <= high) {
-                return is_positive_char;
-            }
-            pos += 1;
+    for (const int k : rows) {
+        if (sequence.aheads[k] < 0) {
+            return;
         }
-    } while (pos->type == WHISPER_GRETYPE_CHAR_ALT);
+    }
 
-    return !is_positive_char;
-}
+    const int n_rows = rows.size();
+    const int n_cols = std::max(1, std::min(n_audio_ctx, n_frames));
 
+    // the weights of each head, normalized over the tokens and smoothed with a median filter over the frames
+    // then averaged over the heads
+    std::vector<float> matrix(n_rows*n_cols, 0.0f);
 
-// transforms a grammar pushdown stack into N possible stacks, all ending
-// at a character range (terminal element)
-static void whisper_grammar_advance_stack(
-        const std::vector<std::vector<whisper_grammar_element>>   & rules,
-        const std::vector<const whisper_grammar_element *>        & stack,
-        std::vector<std::vector<const whisper_grammar_element *>> & new_stacks) {
+    {
+        std::vector<float> w(n_rows*n_cols);
+        std::vector<float> tmp(n_cols);
+        std::vector<float> win;
 
-    if (stack.empty()) {
-        new_stacks.push_back(stack);
-        return;
-    }
+        for (int h = 0; h < n_aheads; ++h) {
+            for (int r = 0; r < n_rows; ++r) {
+                const ggml_fp16_t * src = state.aheads_rows.data() + (sequence.aheads[rows[r]]*n_aheads + h)*n_audio_ctx;
 
-    const whisper_grammar_element * pos = stack.back();
+                ggml_fp16_to_fp32_row(src, w.data() + r*n_cols, n_cols);
+            }
 
-    switch (pos->type) {
-        case WHISPER_GRETYPE_RULE_REF: {
-            const size_t                  rule_id = static_cast<size_t>(pos->value);
-            const whisper_grammar_element * subpos  = rules[rule_id].data();
-            do {
-                // init new stack without the top (pos)
-                std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
-                if (!whisper_grammar_is_end_of_sequence(pos + 1)) {
-                    // if this rule ref is followed by another element, add that to stack
-                    new_stack.push_back(pos + 1);
-                }
-                if (!whisper_grammar_is_end_of_sequence(subpos)) {
-                    // if alternate is nonempty, add to stack
-                    new_stack.push_back(subpos);
+            for (int c = 0; c < n_cols; ++c) {
+                double sum  = 0.0;
+                double sum2 = 0.0;
+                for (int r = 0; r < n_rows; ++r) {
+                    sum  += w[r*n_cols + c];
+                    sum2 += w[r*n_cols + c]*w[r*n_cols + c];
                 }
-                whisper_grammar_advance_stack(rules, new_stack, new_stacks);
-                while (!whisper_grammar_is_end_of_sequence(subpos)) {
-                    // scan to end of alternate def
-                    subpos++;
+
+                const double mean = sum/n_rows;
+                const double std  = sqrt(std::max(0.0, sum2/n_rows - mean*mean));
+
+                for (int r = 0; r < n_rows; ++r) {
+                    w[r*n_cols + c] = std > 1e-9 ? (w[r*n_cols + c] - mean)/std : 0.0f;
                 }
-                if (subpos->type == WHISPER_GRETYPE_ALT) {
-                    // there's another alternate def of this rule to process
-                    subpos++;
-                } else {
-                    break;
+            }
+
+            // median filter of width 7 with reflect padding
+            const int hw = 3;
+
+            for (int r = 0; r < n_rows; ++r) {
+                float * x = w.data() + r*n_cols;
+
+                if (n_cols > hw) {
+                    for (int c = 0; c < n_cols; ++c) {
+                        win.clear();
+                        for (int d = -hw; d <= hw; ++d) {
+                            int i = c + d;
+                            i = i < 0 ? -i : i;
+                            i = i >= n_cols ? 2*(n_cols - 1) - i : i;
+                            win.push_back(x[i]);
+                        }
+                        std::nth_element(win.begin(), win.begin() + hw, win.end());
+                        tmp[c] = win[hw];
+                    }
+                    std::copy(tmp.begin(), tmp.end(), x);
                 }
-            } while (true);
-            break;
+
+                for (int c = 0; c < n_cols; ++c) {
+                    matrix[r*n_cols + c] += x[c]/n_aheads;
+                }
+            }
         }
-        case WHISPER_GRETYPE_CHAR:
-        case WHISPER_GRETYPE_CHAR_NOT:
-            new_stacks.push_back(stack);
-            break;
-        default:
-            // end of alternate (WHISPER_GRETYPE_END, WHISPER_GRETYPE_ALT) or middle of char range
-            // (WHISPER_GRETYPE_CHAR_ALT, WHISPER_GRETYPE_CHAR_RNG_UPPER); stack should never be left on
-            // those
-            WHISPER_ASSERT(false);
     }
-}
 
-// takes a set of possible pushdown stacks on a grammar, which are required to
-// be positioned at a character range (see `whisper_grammar_advance_stack`), and
-// produces the N possible stacks if the given char is accepted at those
-// positions
-static std::vector<std::vector<const whisper_grammar_element *>> whisper_grammar_accept(
-        const std::vector<std::vector<whisper_grammar_element>>         & rules,
-        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
-        const uint32_t                                                  chr) {
+    // DTW over -matrix
+    std::vector<int32_t> jumps(n_rows, 0);
 
-    std::vector<std::vector<const whisper_grammar_element *>> new_stacks;
+    {
+        const int N = n_rows;
+        const int M = n_cols;
 
-    for (const auto & stack : stacks) {
-        if (stack.empty()) {
-            continue;
-        }
+        std::vector<float>  cost((N + 1)*(M + 1), INFINITY);
+        std::vector<int8_t> trace((N + 1)*(M + 1), -1);
 
-        auto match = whisper_grammar_match_char(stack.back(), chr);
-        if (match.first) {
-            const whisper_grammar_element * pos = match.second;
+        cost[0] = 0.0f;
 
-            // update top of stack to next element, if any
-            std::vector<const whisper_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
-            if (!whisper_grammar_is_end_of_sequence(pos)) {
-                new_stack.push_back(pos);
+        for (int j = 1; j <= M; ++j) {
+            for (int i = 1; i <= N; ++i) {
+                const float c0 = cost[(i - 1)*(M + 1) + j - 1];
+                const float c1 = cost[(i - 1)*(M + 1) + j];
+                const float c2 = cost[i*(M + 1) + j - 1];
+
+                float c;
+                int8_t t;
+
+                if (c0 < c1 && c0 < c2) {
+                    c = c0; t = 0;
+                } else if (c1 < c0 && c1 < c2) {
+                    c = c1; t = 1;
+                } else {
+                    c = c2; t = 2;
+                }
+
+                cost [i*(M + 1) + j] = -matrix[(i - 1)*M + j - 1] + c;
+                trace[i*(M + 1) + j] = t;
             }
-            whisper_grammar_advance_stack(rules, new_stack, new_stacks);
         }
-    }
 
-    return new_stacks;
-}
-
-static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
-        const std::vector<std::vector<whisper_grammar_element>>         & rules,
-        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
-        const std::vector<whisper_grammar_candidate>                    & candidates);
+        // backtrace - the first frame of each row of the path is where the token starts
+        int i = N;
+        int j = M;
 
-static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates_for_stack(
-        const std::vector<std::vector<whisper_grammar_element>> & rules,
-        const std::vector<const whisper_grammar_element *>      & stack,
-        const std::vector<whisper_grammar_candidate>            & candidates) {
+        while (i > 0 || j > 0) {
+            if (i > 0 && j > 0) {
+                jumps[i - 1] = j - 1;
+            }
 
-    std::vector<whisper_grammar_candidate> rejects;
+            const int8_t t = i == 0 ? 2 : j == 0 ? 1 : trace[i*(M + 1) + j];
 
-    if (stack.empty()) {
-        for (auto tok : candidates) {
-            if (*tok.code_points != 0 || tok.partial_utf8.n_remain != 0) {
-                rejects.push_back(tok);
+            if (t == 0) {
+                --i; --j;
+            } else if (t == 1) {
+                --i;
+            } else {
+                --j;
             }
         }
-        return rejects;
     }
 
-    const whisper_grammar_element * stack_pos = stack.back();
+    // frames are 20 ms, the timestamps are in units of 10 ms
+    int64_t t_prev = seek;
 
-    std::vector<whisper_grammar_candidate> next_candidates;
-    for (auto tok : candidates) {
-        if (*tok.code_points == 0) {
-            // reached end of full codepoints in token, reject iff it ended in a partial sequence
-            // that cannot satisfy this position in grammar
-            if (tok.partial_utf8.n_remain != 0 && !whisper_grammar_match_partial_char(stack_pos, tok.partial_utf8)) {
-                rejects.push_back(tok);
-            }
-        } else if (whisper_grammar_match_char(stack_pos, *tok.code_points).first) {
-            next_candidates.push_back({ tok.id, tok.code_points + 1, tok.partial_utf8 });
+    for (int k = 0, r = 0; k < n_tokens; ++k) {
+        auto & token = tokens[k];
+
+        if (token.id < token_eot) {
+            token.t0 = seek + 2*jumps[r];
+            token.t1 = r + 1 < n_rows ? seek + 2*jumps[r + 1] : seek + 2*n_cols;
+            ++r;
+        } else if (token.id >= token_beg) {
+            token.t0 = token.t1 = seek + 2*(token.id - token_beg);
         } else {
-            rejects.push_back(tok);
+            token.t0 = token.t1 = t_prev;
         }
+
+        t_prev = token.t1;
     }
+}
 
-    const auto * stack_pos_after = whisper_grammar_match_char(stack_pos, 0).second;
+// log_softmax of the logits in 5 passes over the vocabulary: max, exp and sum, each split at n_text so that the text
+// and timestamp parts are reduced separately, then the normalization
+// - fills logprobs and probs (probs[i] = expf(logprobs[i]))
+// - returns the logsumexp of logprobs[n_text:] (-INFINITY if all of these tokens are suppressed)
+// - max_text_logprob is set to the max of logprobs[:n_text]
+static float whisper_log_softmax(
+        const float * logits,
+              float * logprobs,
+              float * probs,
+                int   n_logits,
+                int   n_text,
+              float & max_text_logprob) {
+    float max_text = -INFINITY;
+    float max_ts   = -INFINITY;
 
-    // update top of stack to next element, if any
-    std::vector<const whisper_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
-    if (!whisper_grammar_is_end_of_sequence(stack_pos_after)) {
-        stack_after.push_back(stack_pos_after);
+    for (int i = 0; i < n_text; ++i) {
+        max_text = std::max(max_text, logits[i]);
     }
-    std::vector<std::vector<const whisper_grammar_element *>> next_stacks;
-    whisper_grammar_advance_stack(rules, stack_after, next_stacks);
-
-    auto next_rejects = whisper_grammar_reject_candidates(rules, next_stacks, next_candidates);
-    for (auto tok : next_rejects) {
-        rejects.push_back({ tok.id, tok.code_points - 1, tok.partial_utf8 });
+    for (int i = n_text; i < n_logits; ++i) {
+        max_ts = std::max(max_ts, logits[i]);
     }
 
-    return rejects;
-}
+    const float logit_max = std::max(max_text, max_ts);
 
-static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
-        const std::vector<std::vector<whisper_grammar_element>>         & rules,
-        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
-        const std::vector<whisper_grammar_candidate>                    & candidates) {
-    if (candidates.empty() || stacks.empty()) {
-        return std::vector<whisper_grammar_candidate>();
+    // suppressed tokens are -INFINITY, so they contribute expf(-INFINITY) = 0.0f
+    float sum_text = 0.0f;
+    float sum_ts   = 0.0f;
+
+    for (int i = 0; i < n_text; ++i) {
+        probs[i] = expf(logits[i] - logit_max);
+        sum_text += probs[i];
+    }
+    for (int i = n_text; i < n_logits; ++i) {
+        probs[i] = expf(logits[i] - logit_max);
+        sum_ts += probs[i];
     }
 
-    auto rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+    const float sum       = sum_text + sum_ts;
+    const float scale     = 1.0f/sum;
+    const float logsumexp = logf(sum) + logit_max;
 
-    for (size_t i = 1, size = stacks.size(); i < size; ++i) {
-        rejects = whisper_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
+    for (int i = 0; i < n_logits; ++i) {
+        logprobs[i] = logits[i] - logsumexp;
+        probs[i]   *= scale;
     }
-    return rejects;
+
+    max_text_logprob = max_text - logsumexp;
+
+    return sum_ts > 0.0f ? logf(sum_ts) + logit_max - logsumexp : -INFINITY;
 }
 
-static struct whisper_grammar whisper_grammar_init(
-            const whisper_grammar_element ** rules,
-                                 size_t      n_rules,
-                                 size_t      i_start_rule) {
-    const whisper_grammar_element * pos;
+// process the logits for the selected decoder
+// - applies logit filters
+// - computes logprobs and probs
+static void whisper_process_logits(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+              struct whisper_decoder & decoder,
+    const struct whisper_full_params   params,
+                               float   temperature) {
+    const auto & vocab      = ctx.vocab;
+    const auto & tokens_cur = decoder.sequence.tokens;
 
-    // copy rule definitions into vectors
-    std::vector<std::vector<whisper_grammar_element>> vec_rules(n_rules);
-    for (size_t i = 0; i < n_rules; i++) {
-        for (pos = rules[i]; pos->type != WHISPER_GRETYPE_END; pos++) {
-            vec_rules[i].push_back(*pos);
+    const bool is_initial = tokens_cur.size() == 0;
+    const int  n_logits   = vocab.id_to_token.size();
+
+    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+
+    // extract the logits for the last token
+    // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
+    auto & probs    = decoder.probs;
+    auto & logits   = decoder.logits;
+    auto & logprobs = decoder.logprobs;
+    {
+        logits.resize(n_logits);
+
+        const float * logits_src = state.logits.data() + decoder.i_batch*n_logits;
+
+        if (temperature > 0.0f) {
+            const float scale = 1.0f/temperature;
+            for (int i = 0; i < n_logits; i++) {
+                logits[i] = logits_src[i]*scale;
+            }
+        } else {
+            memcpy(logits.data(), logits_src, n_logits*sizeof(float));
         }
-        vec_rules[i].push_back({WHISPER_GRETYPE_END, 0});
+
+        // will be populated a bit later
+        probs.resize(n_logits);
+        logprobs.resize(n_logits);
     }
 
-    // loop over alternates of start rule to build initial stacks
-    std::vector<std::vector<const whisper_grammar_element *>> stacks;
-    pos = rules[i_start_rule];
-    do {
-        std::vector<const whisper_grammar_element *> stack;
-        if (!whisper_grammar_is_end_of_sequence(pos)) {
-            // if alternate is nonempty, add to stack
-            stack.push_back(pos);
-        }
-        whisper_grammar_advance_stack(vec_rules, stack, stacks);
-        while (!whisper_grammar_is_end_of_sequence(pos)) {
-            // scan to end of alternate def
-            pos++;
+    // apply logit filters here
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
+    {
+        // suppress blank
+        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
+        if (params.suppress_blank) {
+            if (is_initial) {
+                logits[vocab.token_eot] = -INFINITY;
+                if (vocab.token_space >= 0) {
+                    logits[vocab.token_space] = -INFINITY;
+                }
+            }
         }
-        if (pos->type == WHISPER_GRETYPE_ALT) {
-            // there's another alternate def of this rule to process
-            pos++;
-        } else {
-            break;
+
+        // suppress <|notimestamps|>, sot, nosp, task, prev and lang tokens
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+        for (const auto id : vocab.suppress_special) {
+            logits[id] = -INFINITY;
         }
-    } while (true);
 
-    return { std::move(vec_rules), std::move(stacks), {} };
-}
+        if (params.no_timestamps) {
+            std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
+        }
 
-static void whisper_suppress_invalid_grammar(
-             whisper_context  & ctx,
-    const whisper_full_params & params,
-           std::vector<float> & logits,
-    const     whisper_grammar & grammar) {
+        // [TDRZ] when tinydiarize is disabled, suppress solm token
+        if (params.tdrz_enable == false) {
+            logits[vocab.token_solm] = -INFINITY;
+        }
 
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
-        return;
-    }
+        if (params.logits_filter_callback) {
+            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
+        }
 
-    //bool allow_eot = false;
-    //for (const auto & stack : grammar.stacks) {
-    //    if (stack.empty()) {
-    //        allow_eot = true;
-    //        break;
-    //    }
-    //}
+        // suppress non-speech tokens
+        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+        if (params.suppress_non_speech_tokens) {
+            for (const auto id : vocab.suppress_non_speech) {
+                logits[id] = -INFINITY;
+            }
+        }
 
-    const whisper_token eot = whisper_token_eot(&ctx);
+        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
+        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
+        {
+            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
+            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
 
-    std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
-    std::vector<whisper_grammar_candidate>                              candidates_grammar;
+            //WHISPER_LOG_INFO("last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
 
-    for (whisper_token id = 0; id < eot; ++id) {
-        const std::string & text = ctx.vocab.id_to_token[id];
-        if (!text.empty()) {
-            candidates_decoded.push_back(decode_utf8(text.c_str(), grammar.partial_utf8));
-            candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+            if (last_was_timestamp) {
+                if (penultimate_was_timestamp) {
+                    std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
+                } else {
+                    std::fill(logits.begin(), logits.begin() + vocab.token_eot, -INFINITY);
+                }
+            }
         }
-    }
 
-    const auto rejects = whisper_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
-
-    for (const auto & reject : rejects) {
-        logits[reject.id] -= params.grammar_penalty;
-    }
+        // the initial timestamp cannot be larger than max_initial_ts
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
+        if (is_initial && params.max_initial_ts > 0.0f) {
+            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
+            const int   tid0      = std::round(params.max_initial_ts/precision);
 
-    // when the grammar allows a continuation, we penalize the end-of-text token
-    //if (!allow_eot) {
-    //    logits[eot] -= params.grammar_penalty;
-    //}
-    //fprintf(stderr, "Allowed: (%zu tokens)\n", size - rejects.size());
-}
+            if (vocab.token_beg + tid0 + 1 < n_logits) {
+                std::fill(logits.begin() + vocab.token_beg + tid0 + 1, logits.end(), -INFINITY);
+            }
+        }
 
-static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
-        return;
-    }
+        // condition timestamp tokens to be increasing
+        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
+        if (decoder.has_ts) {
+            const int tid0 = decoder.seek_delta/2;
 
-    //fprintf(stderr, "Accept: '%s'\n", ctx.vocab.id_to_token[token].c_str());
+            std::fill(logits.begin() + vocab.token_beg, logits.begin() + std::min(vocab.token_beg + tid0, n_logits), -INFINITY);
+        }
 
-    const std::string & text = ctx.vocab.id_to_token[token];
+        // populate the logprobs and probs arrays (log_softmax)
+        float max_text_token_logprob = -INFINITY;
 
-    if (text.rfind("[_", 0) == 0) {
-        // fprintf(stderr, " (skipped)\n");
-        return;
-    }
-    // fprintf(stderr, "\n");
+        // logsumexp over timestamps
+        const float timestamp_logprob = whisper_log_softmax(logits.data(), logprobs.data(), probs.data(), n_logits, vocab.token_beg, max_text_token_logprob);
 
-    // Note terminating 0 in decoded string
-    const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
-    const auto & code_points = decoded.first;
-    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        grammar.stacks = whisper_grammar_accept(grammar.rules, grammar.stacks, *it);
-    }
-    grammar.partial_utf8 = decoded.second;
-}
+        // if sum of probability over timestamps is above any other token, sample timestamp
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
+        {
+            //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
-//////////////
-// END grammar
-//////////////
+            if (timestamp_logprob > max_text_token_logprob) {
+                std::fill(logits.begin(),   logits.begin()   + vocab.token_beg, -INFINITY);
+                std::fill(logprobs.begin(), logprobs.begin() + vocab.token_beg, -INFINITY);
+                std::fill(probs.begin(),    probs.begin()    + vocab.token_beg, 0.0f);
+            } else {
+                if (params.n_grammar_rules > 0) {
+                    whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
 
-////////////////////////////////////////////////////////////////////////////
+                    // re-populate the logprobs and probs arrays (log_softmax)
+                    whisper_log_softmax(logits.data(), logprobs.data(), probs.data(), n_logits, vocab.token_beg, max_text_token_logprob);
+                }
+            }
+        }
+    }
 
-struct whisper_context_params * whisper_context_default_params_by_ref() {
-    struct whisper_context_params params = whisper_context_default_params();
+#if 0
+    // print first 100 logits - token string : logit
+    //for (int i = 0; i < 10; i++) {
+    //    const auto token   = vocab.id_to_token.at(i);
+    //    const auto prob    = probs[i];
+    //    const auto logit   = logits[i];
+    //    const auto logprob = logprobs[i];
+    //    printf("%16s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
+    //}
 
-    struct whisper_context_params* result = new whisper_context_params();
-    *result = params;
-    return result;
-}
+    // print sorted
+    {
+        std::vector<std::pair<float, int>> pairs;
 
-struct whisper_full_params * whisper_full_default_params_by_ref(enum whisper_sampling_strategy strategy) {
-    struct whisper_full_params params = whisper_full_default_params(strategy);
+        for (int i = 0; i < n_logits; ++i) {
+            pairs.push_back(std::make_pair(probs[i], i));
+        }
 
-    struct whisper_full_params* result = new whisper_full_params();
-    *result = params;
-    return result;
-}
+        std::sort(pairs.begin(), pairs.end(), [](const std::pair<float, int>& a, const std::pair<float, int>& b) {
+            return a.first > b.first;
+        });
 
-struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
-    struct whisper_full_params result = {
-        /*.strategy          =*/ strategy,
+        for (int i = 0; i < 10; i++) {
+            const auto token   = vocab.id_to_token.at(pairs[i].second);
+            const auto prob    = pairs[i].first;
+            const auto logit   = logits[pairs[i].second];
+            const auto logprob = logprobs[pairs[i].second];
+            printf("%16s : id=%6d prob=%9.5f logit=%9.5f logprob=%9.5f '%s'\n", token.c_str(), pairs[i].second, prob, logit, logprob, token.c_str());
+        }
 
-        /*.n_threads         =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
-        /*.n_max_text_ctx    =*/ 16384,
-        /*.offset_ms         =*/ 0,
-        /*.duration_ms       =*/ 0,
+        printf("----------------\n");
+    }
 
-        /*.translate         =*/ false,
-        /*.no_context        =*/ true,
-        /*.no_timestamps     =*/ false,
-        /*.single_segment    =*/ false,
-        /*.print_special     =*/ false,
-        /*.print_progress    =*/ true,
-        /*.print_realtime    =*/ false,
-        /*.print_timestamps  =*/ true,
+    // "And", "and", " And", " and"
+    //printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
+    //printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
+    //printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
+    //printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
+    //printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
 
-        /*.token_timestamps  =*/ false,
-        /*.thold_pt          =*/ 0.01f,
-        /*.thold_ptsum       =*/ 0.01f,
-        /*.max_len           =*/ 0,
-        /*.split_on_word     =*/ false,
-        /*.max_tokens        =*/ 0,
+    //printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
+    //printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
+    //printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
+    //printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
+    //printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
 
-        /*.speed_up          =*/ false,
-        /*.debug_mode        =*/ false,
-        /*.audio_ctx         =*/ 0,
+    //printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
+    //printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
+    //printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
+    //printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
+    //printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
+#endif
+}
 
-        /*.tdrz_enable       =*/ false,
+// sample an index with probability proportional to probs[i]
+// single pass over the probs, without the allocations of std::discrete_distribution
+static int whisper_sample_discrete(const std::vector<float> & probs, std::mt19937 & rng) {
+    double sum = 0.0;
+    for (const float p : probs) {
+        sum += p;
+    }
 
-        /*.initial_prompt    =*/ nullptr,
-        /*.prompt_tokens     =*/ nullptr,
-        /*.prompt_n_tokens   =*/ 0,
+    const double u = std::uniform_real_distribution<double>(0.0, sum)(rng);
 
-        /*.language          =*/ "en",
-        /*.detect_language   =*/ false,
+    int last = 0;
 
-        /*.suppress_blank    =*/ true,
-        /*.suppress_non_speech_tokens =*/ false,
+    double cur = 0.0;
+    for (int i = 0; i < (int) probs.size(); ++i) {
+        if (probs[i] <= 0.0f) {
+            continue;
+        }
 
-        /*.temperature       =*/  0.0f,
-        /*.max_initial_ts    =*/  1.0f,
-        /*.length_penalty    =*/ -1.0f,
+        cur += probs[i];
+        last = i;
 
-        /*.temperature_inc   =*/  0.2f,
-        /*.entropy_thold     =*/  2.4f,
-        /*.logprob_thold     =*/ -1.0f,
-        /*.no_speech_thold   =*/  0.6f,
+        if (u < cur) {
+            break;
+        }
+    }
 
-        /*.greedy            =*/ {
-            /*.best_of   =*/ -1,
-        },
+    return last;
+}
 
-        /*.beam_search      =*/ {
-            /*.beam_size =*/ -1,
+static whisper_token_data whisper_sample_token(
+            whisper_context & ctx,
+      const whisper_decoder & decoder,
+                       bool   best) {
+    whisper_token_data result = {
+        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
+    };
 
-            /*.patience  =*/ -1.0f,
-        },
+    const auto & vocab = ctx.vocab;
 
-        /*.new_segment_callback           =*/ nullptr,
-        /*.new_segment_callback_user_data =*/ nullptr,
+    const auto & probs    = decoder.probs;
+    const auto & logprobs = decoder.logprobs;
 
-        /*.progress_callback           =*/ nullptr,
-        /*.progress_callback_user_data =*/ nullptr,
+    const int n_logits = vocab.n_vocab;
 
-        /*.encoder_begin_callback           =*/ nullptr,
-        /*.encoder_begin_callback_user_data =*/ nullptr,
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
 
-        /*.abort_callback                   =*/ nullptr,
-        /*.abort_callback_user_data         =*/ nullptr,
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
+            }
 
-        /*.logits_filter_callback           =*/ nullptr,
-        /*.logits_filter_callback_user_data =*/ nullptr,
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                result.tid = i;
+            }
+        }
 
-        /*.grammar_rules   =*/ nullptr,
-        /*.n_grammar_rules =*/ 0,
-        /*.i_start_rule    =*/ 0,
-        /*.grammar_penalty =*/ 100.0f,
-    };
+        result.pt    = max_ts/(sum_ts + 1e-10);
+        result.ptsum = sum_ts;
+    }
 
-    switch (strategy) {
-        case WHISPER_SAMPLING_GREEDY:
-            {
-                result.greedy = {
-                    /*.best_of   =*/ 5,
-                };
-            } break;
-        case WHISPER_SAMPLING_BEAM_SEARCH:
-            {
-                result.beam_search = {
-                    /*.beam_size =*/ 5,
+    if (best) {
+        for (int i = 0; i < n_logits; ++i) {
+            if (result.p < probs[i]) {
+                result.id   = i;
+                result.p    = probs[i];
+                result.plog = logprobs[i];
+            }
+        }
+    } else {
+        result.id   = whisper_sample_discrete(probs, decoder.rng);
+        result.p    = probs[result.id];
+        result.plog = logprobs[result.id];
+    }
 
-                    /*.patience  =*/ -1.0f,
-                };
-            } break;
+    if (result.id >= vocab.token_beg) {
+        result.tid = result.id;
+        result.pt  = result.p;
     }
 
     return result;
 }
 
-// forward declarations
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
-static void whisper_exp_compute_token_level_timestamps(
-        struct whisper_context & ctx,
-          struct whisper_state & state,
-                           int   i_segment,
-                         float   thold_pt,
-                         float   thold_ptsum);
+static std::vector<whisper_token_data> whisper_sample_token_topk(
+            whisper_context & ctx,
+            whisper_decoder & decoder,
+                        int   k) {
+    const auto & vocab = ctx.vocab;
 
-static inline bool should_split_on_word(const char * txt, bool split_on_word) {
-    if (!split_on_word) return true;
+    const auto & probs    = decoder.probs;
+    const auto & logprobs = decoder.logprobs;
 
-    return txt[0] == ' ';
-}
+    const int n_logits = vocab.n_vocab;
 
-// wrap the last segment to max_len characters
-// returns the number of new segments
-static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
-    auto segment = state.result_all.back();
+    std::vector<whisper_token_data> result;
+    result.reserve(k);
 
-    int res = 1;
-    int acc = 0;
+    whisper_token tid = vocab.token_beg;
 
-    std::string text;
+    float pt    = 0.0;
+    float ptsum = 0.0;
 
-    for (int i = 0; i < (int) segment.tokens.size(); i++) {
-        const auto & token = segment.tokens[i];
-        if (token.id >= whisper_token_eot(&ctx)) {
-            continue;
-        }
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
 
-        const auto txt = whisper_token_to_str(&ctx, token.id);
-        const int cur = strlen(txt);
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
+            }
 
-        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
-            state.result_all.back().text = std::move(text);
-            state.result_all.back().t1 = token.t0;
-            state.result_all.back().tokens.resize(i);
-            state.result_all.back().speaker_turn_next = false;
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                tid = i;
+            }
+        }
+
+        pt    = max_ts/(sum_ts + 1e-10);
+        ptsum = sum_ts;
+    }
 
-            state.result_all.push_back({});
-            state.result_all.back().t0 = token.t0;
-            state.result_all.back().t1 = segment.t1;
+    // build the CDF once, then each of the k samples is a binary search
+    auto & cdf = decoder.probs_cdf;
 
-            // add tokens [i, end] to the new segment
-            state.result_all.back().tokens.insert(
-                state.result_all.back().tokens.end(),
-                    segment.tokens.begin() + i,
-                    segment.tokens.end());
+    cdf.resize(n_logits);
+    {
+        double sum = 0.0;
+        for (int i = 0; i < n_logits; ++i) {
+            sum += probs[i];
+            cdf[i] = sum;
+        }
+    }
 
-            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+    std::uniform_real_distribution<double> dist(0.0, cdf.back());
 
-            acc = 0;
-            text = "";
+    for (int i = 0; i < k; ++i) {
+        // the first token whose cumulative probability exceeds the sample - never a token with zero probability
+        const int id = std::min<int>(std::upper_bound(cdf.begin(), cdf.end(), dist(decoder.rng)) - cdf.begin(), n_logits - 1);
+        //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
 
-            segment = state.result_all.back();
-            i = -1;
+        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
 
-            res++;
-        } else {
-            acc += cur;
-            text += txt;
+        if (result[i].id >= vocab.token_beg) {
+            result[i].tid = result[i].id;
+            result[i].pt  = result[i].p;
         }
     }
 
-    state.result_all.back().text = std::move(text);
-
-    return res;
+    return result;
 }
 
-static const std::vector<std::string> non_speech_tokens = {
-    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
-};
-
-// process the logits for the selected decoder
-// - applies logit filters
-// - computes logprobs and probs
-// TODO: optimize
-static void whisper_process_logits(
-              struct whisper_context & ctx,
-               struct whisper_state  & state,
-              struct whisper_decoder & decoder,
-    const struct whisper_full_params   params,
-                               float   temperature) {
-    const auto & vocab      = ctx.vocab;
-    const auto & tokens_cur = decoder.sequence.tokens;
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
+static void whisper_sequence_score(
+        const struct whisper_full_params & params,
+                        whisper_sequence & sequence) {
+    if (sequence.result_len == 0) {
+        return;
+    }
 
-    const bool is_initial = tokens_cur.size() == 0;
-    const int  n_logits   = vocab.id_to_token.size();
+    double result = 0.0f;
 
-    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+    for (int i = 0; i < sequence.result_len; ++i) {
+        result += sequence.tokens[i].plog;
+    }
 
-    // extract the logits for the last token
-    // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
-    auto & probs    = decoder.probs;
-    auto & logits   = decoder.logits;
-    auto & logprobs = decoder.logprobs;
-    {
-        logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits*sizeof(float));
+    sequence.sum_logprobs = result;
+    sequence.avg_logprobs = result/sequence.result_len;
 
-        if (temperature > 0.0f) {
-            for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
-            }
-        }
+    double penalty = sequence.result_len;
 
-        // will be populated a bit later
-        probs.resize(n_logits);
-        logprobs.resize(n_logits);
+    if (params.length_penalty > 0.0f) {
+        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
     }
 
-    // apply logit filters here
-    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
+    sequence.score = result/penalty;
+
+    // compute the entropy of the sequence of the last 32 tokens
     {
-        // suppress blank
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
-        if (params.suppress_blank) {
-            if (is_initial) {
-                logits[vocab.token_eot]           = -INFINITY;
-                logits[vocab.token_to_id.at(" ")] = -INFINITY;
-            }
-        }
+        const int n = 32;
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
-        if (params.no_timestamps) {
-            for (int i = vocab.token_beg; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
+        int cnt = 0;
+        double entropy = 0.0f;
+
+        std::map<whisper_token, int> token_counts;
+        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
+            token_counts[sequence.tokens[i].id]++;
+            cnt++;
         }
 
-        // suppress sot and nosp tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_nosp] = -INFINITY; // TODO: ignore this token for now
+        for (const auto & kv : token_counts) {
+            const auto p = kv.second/(double)cnt;
+            entropy -= p*log(p);
 
-        // [TDRZ] when tinydiarize is disabled, suppress solm token
-        if (params.tdrz_enable == false) {
-            logits[vocab.token_solm] = -INFINITY;
+            //WHISPER_LOG_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
         }
 
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
-        logits[vocab.token_prev]       = -INFINITY;
+        sequence.entropy = entropy;
+    }
+}
 
-        // suppress lang tokens
-        for (size_t i = 0; i < g_lang.size(); ++i) {
-            logits[whisper_token_lang(&ctx, i)] = -INFINITY;
-        }
+// remove the stretches of at least n_min frames of [i0, i1) in which the energy of the spectrogram stays below thold
+// times its mean energy, keeping n_pad frames of each stretch on both sides
+// returns the removed frames as (start, length) in the frames of the original spectrogram
+static std::vector<std::pair<int, int>> whisper_mel_skip_silence(whisper_mel & mel, int i0, int i1, int n_min, int n_pad, float thold) {
+    std::vector<std::pair<int, int>> result;
 
-        // suppress prev token
-        logits[vocab.token_prev] = -INFINITY;
+    i0 = std::max(0, i0);
+    i1 = std::min(mel.n_len_org, i1);
 
-        if (params.logits_filter_callback) {
-            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
-        }
+    if (i1 - i0 < n_min || n_min <= 2*n_pad) {
+        return result;
+    }
 
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_non_speech_tokens) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
+    // the amplitude of the frames, from the normalized log mel: (log10(power) + 4)/4
+    std::vector<float> energy(i1 - i0);
 
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
+    double sum = 0.0;
+    for (int i = i0; i < i1; ++i) {
+        double power = 0.0;
+        for (int j = 0; j < mel.n_mel; ++j) {
+            power += expf(float(M_LN10)*(4.0f*mel.data[j*mel.n_len + i] - 4.0f));
         }
 
-        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
-        {
-            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
-            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+        energy[i - i0] = sqrt(power/mel.n_mel);
+        sum += energy[i - i0];
+    }
 
-            //WHISPER_LOG_INFO("last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
+    const float thold_abs = thold*sum/(i1 - i0);
 
-            if (last_was_timestamp) {
-                if (penultimate_was_timestamp) {
-                    for (int i = vocab.token_beg; i < n_logits; ++i) {
-                        logits[i] = -INFINITY;
-                    }
-                } else {
-                    for (int i = 0; i < vocab.token_eot; ++i) {
-                        logits[i] = -INFINITY;
-                    }
-                }
-            }
+    for (int i = i0; i < i1; ) {
+        if (energy[i - i0] >= thold_abs) {
+            ++i;
+            continue;
         }
 
-        // the initial timestamp cannot be larger than max_initial_ts
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
-        if (is_initial && params.max_initial_ts > 0.0f) {
-            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
-            const int   tid0      = std::round(params.max_initial_ts/precision);
+        int j = i;
+        while (j < i1 && energy[j - i0] < thold_abs) {
+            ++j;
+        }
 
-            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
+        if (j - i >= n_min) {
+            result.push_back({ i + n_pad, j - i - 2*n_pad });
         }
 
-        // condition timestamp tokens to be increasing
-        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
-        if (decoder.has_ts) {
-            const int tid0 = decoder.seek_delta/2;
+        i = j;
+    }
 
-            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
+    if (result.empty()) {
+        return result;
+    }
 
-        // populate the logprobs array (log_softmax)
-        {
-            const float logit_max = *std::max_element(logits.begin(), logits.end());
-            float logsumexp = 0.0f;
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logsumexp += expf(logits[i] - logit_max);
-                }
-            }
-            logsumexp = logf(logsumexp) + logit_max;
+    // compact the spectrogram
+    int n_removed = 0;
+    for (const auto & r : result) {
+        n_removed += r.second;
+    }
 
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logprobs[i] = logits[i] - logsumexp;
-                } else {
-                    logprobs[i] = -INFINITY;
-                }
-            }
+    const int n_len = mel.n_len - n_removed;
+
+    std::vector<float> data(mel.n_mel*n_len);
+
+    for (int j = 0; j < mel.n_mel; ++j) {
+        const float * src = mel.data.data() + j*mel.n_len;
+              float * dst = data.data()     + j*n_len;
+
+        int i_src = 0;
+        for (const auto & r : result) {
+            dst = std::copy(src + i_src, src + r.first, dst);
+            i_src = r.first + r.second;
         }
+        std::copy(src + i_src, src + mel.n_len, dst);
+    }
 
-        // if sum of probability over timestamps is above any other token, sample timestamp
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
-        {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
+    mel.n_len      = n_len;
+    mel.n_len_org -= n_removed;
+    mel.data       = std::move(data);
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+    return result;
+}
 
-            //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+// reset a state that is reused for a new transcription, so that the result does not depend on the previous ones
+static void whisper_state_reset(whisper_state & state) {
+    state.prompt_past.clear();
+    state.decoders[0].rng = std::mt19937(0);
 
-            if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
-                }
-            } else {
-                if (params.n_grammar_rules > 0) {
-                    whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
+    state.t_mel_us    = 0;
+    state.t_sample_us = 0;
+    state.t_encode_us = 0;
+    state.t_decode_us = 0;
+    state.t_batchd_us = 0;
+    state.t_prompt_us = 0;
 
-                    // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
+    state.n_sample = 0;
+    state.n_encode = 0;
+    state.n_decode = 0;
+    state.n_batchd = 0;
+    state.n_prompt = 0;
+}
 
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
-                }
-            }
-        }
-    }
+// a state from the pool of the context, reset to the start of a transcription
+static whisper_state * whisper_state_pool_get(whisper_context * ctx) {
+    whisper_state * state = nullptr;
 
-    // compute probs
     {
-        for (int i = 0; i < n_logits; ++i) {
-            if (logits[i] == -INFINITY) {
-                probs[i] = 0.0f;
-            } else {
-                probs[i] = expf(logprobs[i]);
-            }
+        std::lock_guard<std::mutex> lock(ctx->state_pool_mutex);
+
+        if (!ctx->state_pool.empty()) {
+            state = ctx->state_pool.back();
+            ctx->state_pool.pop_back();
         }
     }
 
-#if 0
-    // print first 100 logits - token string : logit
-    //for (int i = 0; i < 10; i++) {
-    //    const auto token   = vocab.id_to_token.at(i);
-    //    const auto prob    = probs[i];
-    //    const auto logit   = logits[i];
-    //    const auto logprob = logprobs[i];
-    //    printf("%16s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
-    //}
+    if (state == nullptr) {
+        return whisper_init_state(ctx);
+    }
 
-    // print sorted
-    {
-        std::vector<std::pair<float, int>> pairs;
+    whisper_state_reset(*state);
 
-        for (int i = 0; i < n_logits; ++i) {
-            pairs.push_back(std::make_pair(probs[i], i));
-        }
+    return state;
+}
 
-        std::sort(pairs.begin(), pairs.end(), [](const std::pair<float, int>& a, const std::pair<float, int>& b) {
-            return a.first > b.first;
-        });
+static void whisper_state_pool_put(whisper_context * ctx, whisper_state * state) {
+    std::lock_guard<std::mutex> lock(ctx->state_pool_mutex);
 
-        for (int i = 0; i < 10; i++) {
-            const auto token   = vocab.id_to_token.at(pairs[i].second);
-            const auto prob    = pairs[i].first;
-            const auto logit   = logits[pairs[i].second];
-            const auto logprob = logprobs[pairs[i].second];
-            printf("%16s : id=%6d prob=%9.5f logit=%9.5f logprob=%9.5f '%s'\n", token.c_str(), pairs[i].second, prob, logit, logprob, token.c_str());
-        }
+    ctx->state_pool.push_back(state);
+}
 
-        printf("----------------\n");
+// the speech regions of whisper_full_params::vad_split as [i0, i1) sample ranges of at most 30 s
+// - the energy of the 10 ms frames is smoothed over 100 ms and compared with the mean energy of the audio
+// - the speech is padded with 200 ms on each side
+// - speech longer than 30 s is split at the quietest frame of its last 10 s
+// - consecutive regions are merged as long as they fit in 30 s, so that the decoder gets as much context as possible
+static std::vector<std::pair<int, int>> whisper_vad_regions(const float * samples, int n_samples, float vad_thold) {
+    const int n_frame  = WHISPER_SAMPLE_RATE/100;
+    const int n_frames = (n_samples + n_frame - 1)/n_frame;
+
+    const int n_smooth = 10;
+    const int n_pad    = 20;
+    const int n_max    = 100*WHISPER_CHUNK_SIZE;
+    const int n_min    = 110; // whisper_full() skips inputs shorter than 1 s
+
+    std::vector<std::pair<int, int>> result;
+
+    if (n_frames == 0) {
+        return result;
     }
 
-    // "And", "and", " And", " and"
-    //printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
-    //printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
-    //printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
-    //printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
-    //printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
+    std::vector<double> energy(n_frames + 1, 0.0); // prefix sums of the frame energies
 
-    //printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
-    //printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
-    //printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
-    //printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
-    //printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
+    for (int f = 0; f < n_frames; ++f) {
+        const int i0 = f*n_frame;
+        const int i1 = std::min(n_samples, i0 + n_frame);
 
-    //printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
-    //printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
-    //printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
-    //printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
-    //printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
-#endif
-}
+        double sum = 0.0;
+        for (int i = i0; i < i1; ++i) {
+            sum += fabsf(samples[i]);
+        }
+
+        energy[f + 1] = energy[f] + sum/(i1 - i0);
+    }
+
+    const double thold = vad_thold*energy[n_frames]/n_frames;
 
-static whisper_token_data whisper_sample_token(
-            whisper_context & ctx,
-      const whisper_decoder & decoder,
-                       bool   best) {
-    whisper_token_data result = {
-        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
+    auto smoothed = [&](int f) {
+        const int f0 = std::max(0, f - n_smooth/2);
+        const int f1 = std::min(n_frames, f0 + n_smooth);
+
+        return (energy[f1] - energy[f0])/(f1 - f0);
     };
 
-    const auto & vocab = ctx.vocab;
+    // padded speech runs
+    std::vector<std::pair<int, int>> runs;
+    for (int f = 0; f < n_frames; ) {
+        if (smoothed(f) <= thold) {
+            ++f;
+            continue;
+        }
 
-    const auto & probs    = decoder.probs;
-    const auto & logprobs = decoder.logprobs;
+        int f1 = f;
+        while (f1 < n_frames && smoothed(f1) > thold) {
+            ++f1;
+        }
 
-    const int n_logits = vocab.n_vocab;
+        const int r0 = std::max(0,        f  - n_pad);
+        const int r1 = std::min(n_frames, f1 + n_pad);
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+        if (!runs.empty() && r0 <= runs.back().second) {
+            runs.back().second = r1;
+        } else {
+            runs.push_back({ r0, r1 });
+        }
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
+        f = f1;
+    }
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                result.tid = i;
+    // split the long runs
+    std::vector<std::pair<int, int>> parts;
+    for (auto run : runs) {
+        while (run.second - run.first > n_max) {
+            int f_split = run.first + n_max;
+            for (int f = run.first + n_max - 1; f >= run.first + (2*n_max)/3; --f) {
+                if (smoothed(f) < smoothed(f_split)) {
+                    f_split = f;
+                }
             }
+
+            parts.push_back({ run.first, f_split });
+            run.first = f_split;
         }
 
-        result.pt    = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
+        parts.push_back(run);
     }
 
-    if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
-            }
+    // merge the consecutive parts that fit in a window
+    for (const auto & part : parts) {
+        if (!result.empty() && part.second - result.back().first <= n_max) {
+            result.back().second = part.second;
+        } else {
+            result.push_back(part);
         }
-    } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
-
-        result.id   = dist(decoder.rng);
-        result.p    = probs[result.id];
-        result.plog = logprobs[result.id];
     }
 
-    if (result.id >= vocab.token_beg) {
-        result.tid = result.id;
-        result.pt  = result.p;
+    for (auto & r : result) {
+        if (r.second - r.first < n_min) {
+            r.second = std::min(n_frames, r.first + n_min);
+            r.first  = std::max(0, r.second - n_min);
+        }
+
+        r.first  = r.first*n_frame;
+        r.second = std::min(n_samples, r.second*n_frame);
     }
 
     return result;
 }
 
-static std::vector<whisper_token_data> whisper_sample_token_topk(
-            whisper_context & ctx,
-            whisper_decoder & decoder,
-                        int   k) {
-    const auto & vocab = ctx.vocab;
+// whisper_full_params::vad_split - transcribe the speech regions of the audio concurrently and merge the results
+// each region runs the whole whisper_full_with_state() loop on its own state, on its own thread
+// the decoder steps of the regions are not batched with whisper_decode_batch(): the sampling, the fallbacks and the
+// seeking of whisper_full_with_state() would have to be driven step by step for all the regions at once
+static int whisper_full_vad(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    const int i_beg = std::min(n_samples, (WHISPER_SAMPLE_RATE*params.offset_ms)/1000);
+    const int i_end = params.duration_ms == 0 ? n_samples : std::min(n_samples, i_beg + (int) ((WHISPER_SAMPLE_RATE*(int64_t) params.duration_ms)/1000));
 
-    const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
-    const auto & logprobs = decoder.logprobs;
+    auto regions = whisper_vad_regions(samples + i_beg, i_end - i_beg, params.vad_thold);
+    for (auto & r : regions) {
+        r.first  += i_beg;
+        r.second += i_beg;
+    }
 
-    const int n_logits = vocab.n_vocab;
+    const int n_regions = regions.size();
 
-    auto & logits_id = decoder.logits_id;
+    WHISPER_LOG_INFO("%s: %d speech regions\n", __func__, n_regions);
+    for (int i = 0; i < n_regions; ++i) {
+        WHISPER_LOG_DEBUG("%s: region %d - [%s --> %s]\n", __func__, i,
+                to_timestamp((100*(int64_t) regions[i].first)/WHISPER_SAMPLE_RATE).c_str(),
+                to_timestamp((100*(int64_t) regions[i].second)/WHISPER_SAMPLE_RATE).c_str());
+    }
 
-    logits_id.resize(n_logits);
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id[i].first = logits[i];
-        logits_id[i].second = i;
+    if (n_regions == 0) {
+        return 0;
     }
 
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::partial_sort(
-                logits_id.begin(),
-                logits_id.begin() + k, logits_id.end(),
-                [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
+    // the first worker uses the given state, the others take one from the pool of the context
+    const int n_workers = std::max(1, std::min(params.vad_n_parallel, n_regions));
+
+    std::vector<whisper_state *> states = { state, };
+    for (int i = 1; i < n_workers; ++i) {
+        whisper_state * s = whisper_state_pool_get(ctx);
+        if (s == nullptr) {
+            break;
+        }
+        states.push_back(s);
     }
 
-    std::vector<whisper_token_data> result;
-    result.reserve(k);
+    auto params_region = params;
 
-    whisper_token tid = vocab.token_beg;
+    params_region.vad_split      = false;
+    params_region.offset_ms      = 0;
+    params_region.duration_ms    = 0;
+    params_region.print_progress = false;
+    params_region.print_realtime = false;
 
-    float pt    = 0.0;
-    float ptsum = 0.0;
+    params_region.new_segment_callback           = nullptr;
+    params_region.new_segment_callback_user_data = nullptr;
+    params_region.progress_callback              = nullptr;
+    params_region.progress_callback_user_data    = nullptr;
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+    std::vector<std::vector<whisper_segment>> results(n_regions);
+    std::vector<int>                          ret    (n_regions, 0);
+    std::vector<int>                          lang_id(n_regions, 0);
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
+    std::atomic<int> i_next(0);
+    std::atomic<int> n_done(0);
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                tid = i;
-            }
-        }
+    // the regions are independent - each starts without the text of the previous ones, as the initial prompt
+    // the timings of the regions add up in the state of the worker
+    auto worker = [&](whisper_state * s, bool is_main) {
+        for (int i = i_next++; i < n_regions; i = i_next++) {
+            s->prompt_past.clear();
+            s->decoders[0].rng = std::mt19937(0);
 
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
-    }
+            ret[i] = whisper_full_with_state(ctx, s, params_region, samples + regions[i].first, regions[i].second - regions[i].first);
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
+            results[i] = std::move(s->result_all);
+            s->result_all.clear();
 
-    for (int i = 0; i < k; ++i) {
-        const auto id = dist(decoder.rng);
-        //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
+            lang_id[i] = s->lang_id;
 
-        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
+            const int n_cur = ++n_done;
 
-        if (result[i].id >= vocab.token_beg) {
-            result[i].tid = result[i].id;
-            result[i].pt  = result[i].p;
+            if (is_main && params.progress_callback) {
+                params.progress_callback(ctx, state, (100*n_cur)/n_regions, params.progress_callback_user_data);
+            }
         }
-    }
+    };
 
-    return result;
-}
+    const int n_states = states.size();
 
-// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
-static void whisper_sequence_score(
-        const struct whisper_full_params & params,
-                        whisper_sequence & sequence) {
-    if (sequence.result_len == 0) {
-        return;
+    std::vector<std::thread> workers(n_states - 1);
+    for (int i = 1; i < n_states; ++i) {
+        workers[i - 1] = std::thread(worker, states[i], false);
     }
 
-    double result = 0.0f;
+    worker(state, true);
 
-    for (int i = 0; i < sequence.result_len; ++i) {
-        result += sequence.tokens[i].plog;
+    for (auto & w : workers) {
+        w.join();
     }
 
-    sequence.sum_logprobs = result;
-    sequence.avg_logprobs = result/sequence.result_len;
+    for (int i = 1; i < n_states; ++i) {
+        state->t_mel_us    += states[i]->t_mel_us;
+        state->t_sample_us += states[i]->t_sample_us;
+        state->t_encode_us += states[i]->t_encode_us;
+        state->t_decode_us += states[i]->t_decode_us;
+        state->t_batchd_us += states[i]->t_batchd_us;
+        state->t_prompt_us += states[i]->t_prompt_us;
 
-    double penalty = sequence.result_len;
+        state->n_sample += states[i]->n_sample;
+        state->n_encode += states[i]->n_encode;
+        state->n_decode += states[i]->n_decode;
+        state->n_batchd += states[i]->n_batchd;
+        state->n_prompt += states[i]->n_prompt;
 
-    if (params.length_penalty > 0.0f) {
-        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
+        whisper_state_pool_put(ctx, states[i]);
     }
 
-    sequence.score = result/penalty;
+    state->lang_id = lang_id[0];
 
-    // compute the entropy of the sequence of the last 32 tokens
-    {
-        const int n = 32;
+    // stitch the results - the timestamps of a region are relative to its start
+    const bool has_token_times = params.token_timestamps || !ctx->aheads.empty();
 
-        int cnt = 0;
-        double entropy = 0.0f;
+    auto & result_all = state->result_all;
 
-        std::map<whisper_token, int> token_counts;
-        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
-            token_counts[sequence.tokens[i].id]++;
-            cnt++;
+    for (int i = 0; i < n_regions; ++i) {
+        if (ret[i] != 0) {
+            WHISPER_LOG_ERROR("%s: region %d failed with error %d\n", __func__, i, ret[i]);
+            return ret[i];
         }
 
-        for (const auto & kv : token_counts) {
-            const auto p = kv.second/(double)cnt;
-            entropy -= p*log(p);
+        const int64_t t_start = (100*(int64_t) regions[i].first)/WHISPER_SAMPLE_RATE;
+        const int64_t t_end   = (100*(int64_t) regions[i].second)/WHISPER_SAMPLE_RATE;
 
-            //WHISPER_LOG_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+        for (auto & segment : results[i]) {
+            segment.t0 = std::min(segment.t0 + t_start, t_end);
+            segment.t1 = std::min(segment.t1 + t_start, t_end);
+
+            if (has_token_times) {
+                for (auto & token : segment.tokens) {
+                    token.t0 = std::min(token.t0 + t_start, t_end);
+                    token.t1 = std::min(token.t1 + t_start, t_end);
+                }
+            }
+
+            result_all.push_back(std::move(segment));
+
+            if (params.print_realtime) {
+                const auto & seg = result_all.back();
+                if (params.print_timestamps) {
+                    printf("[%s --> %s]  %s\n", to_timestamp(seg.t0).c_str(), to_timestamp(seg.t1).c_str(), seg.text.c_str());
+                } else {
+                    printf("%s", seg.text.c_str());
+                    fflush(stdout);
+                }
+            }
+
+            if (params.new_segment_callback) {
+                params.new_segment_callback(ctx, state, 1, params.new_segment_callback_user_data);
+            }
         }
+    }
 
-        sequence.entropy = entropy;
+    return 0;
+}
+
+// the audio context for a window of n_frames mel frames with whisper_full_params::audio_ctx_auto (0 = use default)
+// it is rounded up to a few fixed sizes, so that the cached decoder graph and the encoded windows shared between the
+// states are reused across inputs of similar length - the compute buffers are measured for the full audio context
+static int whisper_audio_ctx_auto(const whisper_context & ctx, int n_frames) {
+    static const int sizes[] = { 128, 192, 256, 384, 512, 768, 1024, };
+
+    const int n_audio_ctx = ctx.model.hparams.n_audio_ctx;
+    const int n_ctx       = (n_frames + 1)/2 + WHISPER_AUDIO_CTX_AUTO_PAD;
+
+    for (const int size : sizes) {
+        if (size >= n_audio_ctx) {
+            break;
+        }
+        if (n_ctx <= size) {
+            return size;
+        }
     }
+
+    return 0;
 }
 
 int whisper_full_with_state(
@@ -5012,6 +7380,11 @@ int whisper_full_with_state(
 
     result_all.clear();
 
+    // long-form transcription over the speech regions
+    if (params.vad_split && n_samples > 0 && !params.detect_language && !params.speed_up) {
+        return whisper_full_vad(ctx, state, params, samples, n_samples);
+    }
+
     if (n_samples > 0) {
         // compute log mel spectrogram
         if (params.speed_up) {
@@ -5026,10 +7399,87 @@ int whisper_full_with_state(
         }
     }
 
+    // remove the long silences from the spectrogram before any encoder pass
+    // skip_map: the compacted frame t is the original frame t + shift of the last stretch that starts at or before t
+    std::vector<std::pair<int, int>>         skipped;
+    std::vector<std::pair<int64_t, int64_t>> skip_map;
+    if (params.skip_silence) {
+        const int i0 = params.offset_ms/10;
+        const int i1 = params.duration_ms == 0 ? whisper_n_len_from_state(state) : i0 + params.duration_ms/10;
+
+        skipped = whisper_mel_skip_silence(state->mel, i0, i1, params.skip_silence_ms/10, 100, params.skip_silence_thold);
+
+        int64_t n_removed = 0;
+        for (const auto & r : skipped) {
+            skip_map.push_back({ r.first - n_removed, n_removed + r.second });
+            n_removed += r.second;
+        }
+
+        if (n_removed > 0) {
+            state->kv_cross_seek = -1;
+
+            if (params.duration_ms > 0) {
+                params.duration_ms -= 10*n_removed;
+            }
+
+            WHISPER_LOG_INFO("%s: skipped %d stretches of silence (%s)\n", __func__, (int) skipped.size(), to_timestamp(n_removed).c_str());
+        }
+    }
+
+    auto skip_time = [&](int64_t t, bool is_end) {
+        int64_t shift = 0;
+        for (const auto & e : skip_map) {
+            if (is_end ? e.first >= t : e.first > t) {
+                break;
+            }
+            shift = e.second;
+        }
+
+        return t + shift;
+    };
+
+    // map the timestamps of the last n_new segments back to the original audio
+    auto skip_segments = [&](int n_new) {
+        if (skip_map.empty()) {
+            return;
+        }
+
+        const bool has_token_times = params.token_timestamps || !ctx->aheads.empty();
+
+        for (int i = (int) result_all.size() - n_new; i < (int) result_all.size(); ++i) {
+            auto & segment = result_all[i];
+
+            segment.t0 = skip_time(segment.t0, false);
+            segment.t1 = skip_time(segment.t1, true);
+
+            if (has_token_times) {
+                for (auto & token : segment.tokens) {
+                    token.t0 = skip_time(token.t0, false);
+                    token.t1 = skip_time(token.t1, true);
+                }
+            }
+        }
+    };
+
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = params.audio_ctx;
+
+    const bool audio_ctx_auto = params.audio_ctx_auto && params.audio_ctx == 0;
+
     // auto-detect language if not specified
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
 
+        // the language is detected from the first window - with the same audio context as the first window decoded
+        // below when there is no offset, so that its encoder pass is reused
+        if (audio_ctx_auto) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_auto(*ctx, params.duration_ms == 0 ? whisper_n_len_from_state(state) : params.duration_ms/10);
+        }
+
         const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
         if (lang_id < 0) {
             WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
@@ -5051,6 +7501,18 @@ int whisper_full_with_state(
         if (n_samples > 0) {
             state->energy = get_signal_energy(samples, n_samples, 32);
         }
+
+        // remove the skipped stretches also from an energy set by the caller (e.g. whisper_full_multi())
+        if (!state->energy.empty()) {
+            for (auto it = skipped.rbegin(); it != skipped.rend(); ++it) {
+                auto & energy = state->energy;
+
+                const int i0 = std::min((int) energy.size(), WHISPER_HOP_LENGTH*it->first);
+                const int i1 = std::min((int) energy.size(), WHISPER_HOP_LENGTH*(it->first + it->second));
+
+                energy.erase(energy.begin() + i0, energy.begin() + i1);
+            }
+        }
     }
 
     const int seek_start = params.offset_ms/10;
@@ -5096,8 +7558,17 @@ int whisper_full_with_state(
         return -4;
     }
 
+    // the speculative fallback runs the decoders of the next temperature next to the greedy decoder
+    const bool spec_fallback =
+        params.fallback_speculative &&
+        params.strategy == WHISPER_SAMPLING_GREEDY &&
+        temperatures.size() > 1 &&
+        1 + std::max(1, params.greedy.best_of) <= WHISPER_MAX_DECODERS;
+
+    const int n_decoders_alloc = spec_fallback ? std::max(n_decoders, 1 + std::max(1, params.greedy.best_of)) : n_decoders;
+
     // TAGS: WHISPER_DECODER_INIT
-    for (int j = 1; j < n_decoders; j++) {
+    for (int j = 1; j < n_decoders_alloc; j++) {
         auto & decoder = state->decoders[j];
 
         decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
@@ -5105,7 +7576,7 @@ int whisper_full_with_state(
         decoder.probs.resize   (ctx->vocab.n_vocab);
         decoder.logits.resize  (ctx->vocab.n_vocab);
         decoder.logprobs.resize(ctx->vocab.n_vocab);
-        decoder.logits_id.reserve(ctx->model.hparams.n_vocab);
+        decoder.probs_cdf.reserve(ctx->model.hparams.n_vocab);
 
         decoder.rng = std::mt19937(0);
     }
@@ -5138,13 +7609,6 @@ int whisper_full_with_state(
         }
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
-
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
 
@@ -5166,30 +7630,154 @@ int whisper_full_with_state(
             WHISPER_LOG_WARN("%s: using distilled model - forcing no_timestamps\n", __func__);
             params.no_timestamps = true;
         }
-    }
+    }
+
+    if (params.no_timestamps) {
+        prompt_init.push_back(whisper_token_not(ctx));
+    }
+
+    int seek = seek_start;
+
+    std::vector<whisper_token> prompt;
+    prompt.reserve(whisper_n_text_ctx(ctx));
+
+    // the prompt decoded for the current window and its logits for the last token
+    // reused by the temperature fallbacks when the prompt does not change
+    std::vector<whisper_token> prompt_cached;
+    std::vector<float>         logits_prompt;
+    std::vector<ggml_fp16_t>   aheads_prompt; // DTW token timestamps: the cross-attention weights of the prompt
+
+    // the probability of the no-speech token at the SOT position of the current prompt
+    float no_speech_prob        = 0.0f;
+    float no_speech_prob_prompt = 0.0f;
+
+    // a beam search candidate is the parent decoder extended with one token
+    // the sequence and the grammar state of the parent are copied only for the selected candidates
+    struct beam_candidate {
+        int decoder_idx;
+        int seek_delta;
+
+        bool has_ts;
+
+        whisper_token_data token;
+        double sum_logprobs_all;
+    };
+
+    // the state of a beam that continues from another decoder
+    // kept across the iterations so that the copies reuse the already allocated memory
+    struct beam_parent {
+        whisper_sequence sequence;
+
+        std::vector<std::vector<const whisper_grammar_element *>> stacks;
+        whisper_partial_utf8 partial_utf8;
+    };
+
+    std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
+    std::vector<beam_candidate> beam_candidates;
+
+    std::vector<const beam_candidate *> beam_selected(n_decoders);
+    std::vector<beam_parent>            beam_parents(n_decoders);
+
+    // the grammar is compiled once and shared by all decoders
+    std::shared_ptr<whisper_grammar_compiled> grammar;
+    if (params.grammar_rules != nullptr) {
+        grammar = whisper_grammar_compile(*ctx, params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
+    }
+
+    // TAGS: WHISPER_DECODER_INIT
+    auto decoder_reset = [&](whisper_decoder & decoder) {
+        decoder.sequence.tokens.clear();
+        decoder.sequence.repetition.reset();
+        decoder.sequence.aheads.clear();
+        decoder.sequence.result_len       = 0;
+        decoder.sequence.sum_logprobs_all = 0.0;
+        decoder.sequence.sum_logprobs     = -INFINITY;
+        decoder.sequence.avg_logprobs     = -INFINITY;
+        decoder.sequence.entropy          = 0.0;
+        decoder.sequence.score            = -INFINITY;
+
+        decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
+
+        // the first row of aheads_rows is the one of the prompt
+        decoder.aheads_row = 0;
+
+        decoder.failed    = false;
+        decoder.completed = false;
+        decoder.has_ts    = false;
+
+        decoder.grammar = whisper_grammar_init(grammar);
+    };
+
+    // rank the resulting sequences of the first n decoders and select the best one
+    auto decoders_rank = [&](int n) {
+        int best_id = 0;
+
+        double best_score = -INFINITY;
+
+        for (int j = 0; j < n; ++j) {
+            auto & decoder = state->decoders[j];
+
+            if (decoder.failed) {
+                continue;
+            }
+
+            decoder.sequence.tokens.resize(decoder.sequence.result_len);
+            whisper_sequence_score(params, decoder.sequence);
+
+            WHISPER_LOG_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
+                    __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
+
+            if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
+                WHISPER_LOG_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
+                        __func__, j, decoder.sequence.entropy, params.entropy_thold);
+
+                decoder.failed = true;
+                state->n_fail_h++;
+
+                continue;
+            }
+
+            if (best_score < decoder.sequence.score) {
+                best_score = decoder.sequence.score;
+                best_id = j;
+            }
+        }
 
-    if (params.no_timestamps) {
-        prompt_init.push_back(whisper_token_not(ctx));
-    }
+        WHISPER_LOG_DEBUG("%s: best decoder = %d\n", __func__, best_id);
 
-    int seek = seek_start;
+        return best_id;
+    };
 
-    std::vector<whisper_token> prompt;
-    prompt.reserve(whisper_n_text_ctx(ctx));
+    // was the decoding successful for the current temperature?
+    // do fallback only if:
+    // - we are not at the last temperature
+    // - the window is not silence - there is nothing to gain from decoding it again
+    auto decoders_success = [&](int it, int best_id) {
+        if (it != (int) temperatures.size() - 1 && no_speech_prob <= params.no_speech_thold) {
+            const auto & decoder = state->decoders[best_id];
+
+            if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
+                WHISPER_LOG_DEBUG("%s: failed due to avg_logprobs %8.5f < %8.5f\n", __func__, decoder.sequence.avg_logprobs, params.logprob_thold);
+                state->n_fail_p++;
+                return false;
+            }
+        }
 
-    struct beam_candidate {
-        int decoder_idx;
-        int seek_delta;
+        return true;
+    };
 
-        bool has_ts;
+    // the random generators of the slots taken by the speculative decoders
+    // the speculative decoders continue the generators of the decoders that they replace on fallback
+    std::vector<std::mt19937> rng_spec(WHISPER_MAX_DECODERS);
 
-        whisper_sequence sequence;
-        whisper_grammar grammar;
+    // drop the speculative decoders and give their slots back
+    auto spec_drop = [&](int n_cur, int n_spec) {
+        for (int j = n_cur; j < n_cur + n_spec; ++j) {
+            whisper_kv_cache_seq_rm(state->kv_self, j, -1, -1);
+            state->decoders[j].rng = rng_spec[j - n_cur];
+        }
     };
 
-    std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
-    std::vector<beam_candidate> beam_candidates;
-
     // main loop
     while (true) {
         if (params.progress_callback) {
@@ -5211,12 +7799,19 @@ int whisper_full_with_state(
             }
         }
 
+        if (audio_ctx_auto) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_auto(*ctx, seek_end - seek);
+        }
+
         // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        if (!whisper_encode_cached(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
 
+        // the KV cache of the prompt depends on the encoder output
+        prompt_cached.clear();
+
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
         // to confuse the decoder and often make it repeat or hallucinate stuff
         if (seek > seek_start && seek + 500 >= seek_end) {
@@ -5225,8 +7820,14 @@ int whisper_full_with_state(
 
         int best_decoder_id = 0;
 
+        // the speculative decoders of the next temperature, in the slots [n_decoders_cur, n_decoders_cur + n_spec)
+        int   n_spec = 0;
+        float t_spec = 0.0f;
+
+        bool spec_accepted = false;
+
         for (int it = 0; it < (int) temperatures.size(); ++it) {
-            const float t_cur = temperatures[it];
+            float t_cur = temperatures[it];
 
             int n_decoders_cur = 1;
 
@@ -5251,33 +7852,11 @@ int whisper_full_with_state(
 
             WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
 
-            // TAGS: WHISPER_DECODER_INIT
             for (int j = 0; j < n_decoders_cur; ++j) {
-                auto & decoder = state->decoders[j];
-
-                decoder.sequence.tokens.clear();
-                decoder.sequence.result_len       = 0;
-                decoder.sequence.sum_logprobs_all = 0.0;
-                decoder.sequence.sum_logprobs     = -INFINITY;
-                decoder.sequence.avg_logprobs     = -INFINITY;
-                decoder.sequence.entropy          = 0.0;
-                decoder.sequence.score            = -INFINITY;
-
-                decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
-
-                decoder.failed    = false;
-                decoder.completed = false;
-                decoder.has_ts    = false;
-
-                if (params.grammar_rules != nullptr) {
-                    decoder.grammar = whisper_grammar_init(params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
-                } else {
-                    decoder.grammar = {};
-                }
+                decoder_reset(state->decoders[j]);
             }
 
             // init prompt and kv cache for the current iteration
-            // TODO: do not recompute the prompt if it is the same as previous time
             {
                 prompt.clear();
 
@@ -5299,27 +7878,79 @@ int whisper_full_with_state(
                 }
                 WHISPER_LOG_DEBUG("\n\n");
 
-                whisper_kv_cache_clear(state->kv_self);
+                const int n_vocab = whisper_n_vocab(ctx);
+
+                if (prompt == prompt_cached) {
+                    // the prompt is already in the KV cache - drop only the tokens decoded by the previous attempt
+                    WHISPER_LOG_DEBUG("%s: reusing the KV cache of the prompt (%d tokens)\n", __func__, (int) prompt.size());
+
+                    whisper_kv_cache_seq_keep(state->kv_self, WHISPER_SEQ_ID_PROMPT);
+
+                    state->logits.resize(n_vocab);
+                    memcpy(state->logits.data(), logits_prompt.data(), n_vocab*sizeof(float));
+
+                    state->aheads_rows = aheads_prompt;
+
+                    state->decoders[0].i_batch = 0;
+
+                    no_speech_prob = no_speech_prob_prompt;
+                } else {
+                    whisper_kv_cache_clear(state->kv_self);
+
+                    whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, WHISPER_SEQ_ID_PROMPT);
+
+                    // the no-speech probability is predicted at the SOT token
+                    const int i_sot = prompt.size() - prompt_init.size();
+
+                    state->batch.logits[i_sot] = 1;
+
+                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -7;
+                    }
+
+                    // softmax of the raw logits, before any filtering
+                    {
+                        const float * logits_sot = state->logits.data() + i_sot*n_vocab;
+
+                        const float max = *std::max_element(logits_sot, logits_sot + n_vocab);
+
+                        double sum = 0.0;
+                        for (int i = 0; i < n_vocab; ++i) {
+                            sum += expf(logits_sot[i] - max);
+                        }
+
+                        no_speech_prob = expf(logits_sot[whisper_token_nosp(ctx)] - max)/sum;
+                    }
+
+                    prompt_cached = prompt;
+                    logits_prompt.assign(state->logits.end() - n_vocab, state->logits.end());
 
-                whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+                    state->aheads_rows.clear();
 
-                if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
-                    WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                    return -7;
+                    if (!ctx->aheads.empty()) {
+                        whisper_aheads_push(*ctx, *state, whisper_batch_n_outputs(state->batch) - 1);
+                    }
+
+                    aheads_prompt = state->aheads_rows;
+
+                    no_speech_prob_prompt = no_speech_prob;
+
+                    state->decoders[0].i_batch = prompt.size() - 1;
+                }
+
+                for (int j = 0; j < n_decoders_cur; ++j) {
+                    whisper_kv_cache_seq_cp(state->kv_self, WHISPER_SEQ_ID_PROMPT, j, -1, -1);
                 }
 
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    state->decoders[0].i_batch = prompt.size() - 1;
-
                     whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
 
                     for (int j = 1; j < n_decoders_cur; ++j) {
                         auto & decoder = state->decoders[j];
 
-                        whisper_kv_cache_seq_cp(state->kv_self, 0, j, -1, -1);
-
                         memcpy(decoder.probs.data(),    state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
                         memcpy(decoder.logits.data(),   state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
                         memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
@@ -5339,7 +7970,7 @@ int whisper_full_with_state(
                 }
 
                 // sampling
-                // TODO: avoid memory allocations, optimize, avoid threads?
+                // TODO: avoid memory allocations, optimize
                 {
                     std::atomic<int> j_cur(0);
 
@@ -5347,7 +7978,7 @@ int whisper_full_with_state(
                         while (true) {
                             const int j = j_cur.fetch_add(1);
 
-                            if (j >= n_decoders_cur) {
+                            if (j >= n_decoders_cur + n_spec) {
                                 break;
                             }
 
@@ -5357,15 +7988,19 @@ int whisper_full_with_state(
                                 continue;
                             }
 
+                            const float t_dec = j < n_decoders_cur ? t_cur : t_spec;
+
                             switch (params.strategy) {
                                 case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
                                     {
-                                        if (t_cur < 1e-6f) {
+                                        if (t_dec < 1e-6f) {
                                             decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, true));
                                         } else {
                                             decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, false));
                                         }
 
+                                        decoder.sequence.aheads.push_back(decoder.aheads_row);
+
                                         decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
                                     } break;
                                 case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
@@ -5373,32 +8008,14 @@ int whisper_full_with_state(
                                         const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
 
                                         for (const auto & token : tokens_new) {
-                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
-                                            bc_per_dec[j].back().sequence.tokens.push_back(token);
-                                            bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
+                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, token, decoder.sequence.sum_logprobs_all + token.plog, });
                                         }
                                     } break;
                             };
                         }
                     };
 
-                    const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                    if (n_threads == 1) {
-                        process();
-                    } else {
-                        std::vector<std::thread> threads(n_threads - 1);
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t] = std::thread(process);
-                        }
-
-                        process();
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t].join();
-                        }
-                    }
+                    whisper_parallel_run(*state, params.n_threads, std::min(params.n_threads, n_decoders_cur + n_spec), process);
                 }
 
                 beam_candidates.clear();
@@ -5416,7 +8033,7 @@ int whisper_full_with_state(
                             beam_candidates.begin(),
                             beam_candidates.end(),
                             [](const beam_candidate & a, const beam_candidate & b) {
-                        return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+                        return a.sum_logprobs_all > b.sum_logprobs_all;
                     });
 
                     uint32_t cur_c = 0;
@@ -5432,21 +8049,26 @@ int whisper_full_with_state(
                             cur_c = 0;
                         }
 
-                        auto & cur = beam_candidates[cur_c++];
+                        const auto & cur = beam_candidates[cur_c++];
 
-                        while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sequence.sum_logprobs_all == cur.sequence.sum_logprobs_all && i > 0) {
+                        while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sum_logprobs_all == cur.sum_logprobs_all && i > 0) {
                             ++cur_c;
                         }
 
-                        decoder.seek_delta = cur.seek_delta;
-                        decoder.has_ts     = cur.has_ts;
-                        decoder.sequence   = cur.sequence;
-                        decoder.grammar    = cur.grammar;
+                        beam_selected[j] = &cur;
 
-                        whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
+                        // a decoder that continues its own sequence keeps its state and its KV cache as they are
+                        if (cur.decoder_idx == j) {
+                            continue;
+                        }
 
-                        WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                        const auto & parent = state->decoders[cur.decoder_idx];
+
+                        beam_parents[j].sequence     = parent.sequence;
+                        beam_parents[j].stacks       = parent.grammar.stacks;
+                        beam_parents[j].partial_utf8 = parent.grammar.partial_utf8;
+
+                        whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
                     }
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
@@ -5456,9 +8078,27 @@ int whisper_full_with_state(
                             continue;
                         }
 
-                        whisper_kv_cache_seq_rm(state->kv_self, j,                           -1, -1);
-                        whisper_kv_cache_seq_cp(state->kv_self, WHISPER_MAX_DECODERS + j, j, -1, -1);
-                        whisper_kv_cache_seq_rm(state->kv_self, WHISPER_MAX_DECODERS + j,    -1, -1);
+                        const auto & cur = *beam_selected[j];
+
+                        if (cur.decoder_idx != j) {
+                            std::swap(decoder.sequence,       beam_parents[j].sequence);
+                            std::swap(decoder.grammar.stacks, beam_parents[j].stacks);
+                            decoder.grammar.partial_utf8 = beam_parents[j].partial_utf8;
+
+                            whisper_kv_cache_seq_rm(state->kv_self, j,                           -1, -1);
+                            whisper_kv_cache_seq_cp(state->kv_self, WHISPER_MAX_DECODERS + j, j, -1, -1);
+                            whisper_kv_cache_seq_rm(state->kv_self, WHISPER_MAX_DECODERS + j,    -1, -1);
+                        }
+
+                        decoder.seek_delta = cur.seek_delta;
+                        decoder.has_ts     = cur.has_ts;
+
+                        decoder.sequence.tokens.push_back(cur.token);
+                        decoder.sequence.aheads.push_back(state->decoders[cur.decoder_idx].aheads_row);
+                        decoder.sequence.sum_logprobs_all = cur.sum_logprobs_all;
+
+                        WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
+                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(cur.token.id).c_str(), cur.token.plog, cur.sum_logprobs_all);
                     }
                 }
 
@@ -5466,13 +8106,16 @@ int whisper_full_with_state(
                 // - check if the sequence is completed
                 // - check if the sequence is failed
                 // - update sliding window based on timestamp tokens
-                for (int j = 0; j < n_decoders_cur; ++j) {
+                for (int j = 0; j < n_decoders_cur + n_spec; ++j) {
                     auto & decoder = state->decoders[j];
 
                     if (decoder.completed || decoder.failed) {
                         continue;
                     }
 
+                    // the speculative decoders are behind the greedy decoder - use the own position of each decoder
+                    const int i_dec = decoder.sequence.tokens.size() - 1;
+
                     auto & has_ts     = decoder.has_ts;
                     auto & failed     = decoder.failed;
                     auto & completed  = decoder.completed;
@@ -5487,14 +8130,14 @@ int whisper_full_with_state(
                             const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
 
                             // do not allow to go back in time
-                            if (has_ts && seek_delta > seek_delta_new && result_len < i) {
+                            if (has_ts && seek_delta > seek_delta_new && result_len < i_dec) {
                                 WHISPER_LOG_DEBUG("%s: decoder %d: failed due to seek_delta (%d > %d)\n", __func__, j, seek_delta, seek_delta_new);
                                 failed = true; // TODO: maybe this is not a failure ?
                                 continue;
                             }
 
                             seek_delta = seek_delta_new;
-                            result_len = i + 1;
+                            result_len = i_dec + 1;
                             has_ts = true;
                         }
 
@@ -5510,12 +8153,12 @@ int whisper_full_with_state(
 
                         // end of segment
                         if (token.id == whisper_token_eot(ctx) ||               // end of text token
-                           (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
+                           (params.max_tokens > 0 && i_dec >= params.max_tokens) || // max tokens per segment reached
                            (has_ts && seek + seek_delta + 100 >= seek_end)      // end of audio reached
                            ) {
                             if (result_len == 0 && !params.no_timestamps) {
                                 if (seek + seek_delta + 100 >= seek_end) {
-                                    result_len = i + 1;
+                                    result_len = i_dec + 1;
                                 } else {
                                     WHISPER_LOG_DEBUG("%s: decoder %d failed (result_len = 0)\n", __func__, j);
                                     failed = true;
@@ -5524,7 +8167,7 @@ int whisper_full_with_state(
                             }
 
                             if (params.single_segment || params.no_timestamps) {
-                                result_len = i + 1;
+                                result_len = i_dec + 1;
                                 seek_delta = 100*WHISPER_CHUNK_SIZE;
                             }
 
@@ -5541,9 +8184,21 @@ int whisper_full_with_state(
                         }
                     }
 
+                    // detect repetition loops early, so that the fallback does not have to wait for the full window
+                    if (params.repetition_max_period > 0) {
+                        const auto & token = decoder.sequence.tokens.back();
+
+                        if (token.id < whisper_token_eot(ctx) && decoder.sequence.repetition.add(token.id, params.repetition_max_period)) {
+                            WHISPER_LOG_DEBUG("%s: decoder %d: failed due to repetition loop at token %d\n", __func__, j, i_dec);
+                            failed = true;
+                            state->n_fail_h++;
+                            continue;
+                        }
+                    }
+
                     // sometimes, the decoding can get stuck in a repetition loop
                     // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
-                    if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
+                    if (i_dec == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
                         WHISPER_LOG_DEBUG("%s: decoder %d: failed due to repetition loop\n", __func__, j);
                         failed = true;
                         continue;
@@ -5564,9 +8219,63 @@ int whisper_full_with_state(
                         completed_all = false;
                     }
 
-                    if (completed_all) {
+                    if (completed_all && n_spec == 0) {
                         break;
                     }
+
+                    // the greedy decoder has finished - either accept its result or continue with the speculative decoders
+                    if (completed_all) {
+                        best_decoder_id = decoders_rank(n_decoders_cur);
+
+                        if (decoders_success(it, best_decoder_id)) {
+                            spec_drop(n_decoders_cur, n_spec);
+                            n_spec = 0;
+
+                            spec_accepted = true;
+                            break;
+                        }
+
+                        WHISPER_LOG_DEBUG("\n%s: failed to decode with temperature = %.2f, continuing with the speculative decoders\n", __func__, t_cur);
+
+                        // move the speculative decoders to the front, as if the fallback had started them
+                        for (int k = 0; k < n_spec; ++k) {
+                            std::swap(state->decoders[k], state->decoders[n_decoders_cur + k]);
+
+                            whisper_kv_cache_seq_rm(state->kv_self, k,                  -1, -1);
+                            whisper_kv_cache_seq_cp(state->kv_self, n_decoders_cur + k, k, -1, -1);
+                        }
+
+                        for (int j = n_spec; j < n_decoders_cur + n_spec; ++j) {
+                            whisper_kv_cache_seq_rm(state->kv_self, j, -1, -1);
+
+                            if (j >= n_decoders_cur) {
+                                state->decoders[j].rng = rng_spec[j - n_decoders_cur];
+                            }
+                        }
+
+                        ++it;
+
+                        t_cur          = t_spec;
+                        n_decoders_cur = n_spec;
+                        n_spec         = 0;
+
+                        // the speculative decoders were started together, so the active ones are at the same position
+                        for (int j = 0; j < n_decoders_cur; ++j) {
+                            const auto & decoder = state->decoders[j];
+
+                            if (decoder.completed || decoder.failed) {
+                                continue;
+                            }
+
+                            i = decoder.sequence.tokens.size() - 1;
+
+                            completed_all = false;
+                        }
+
+                        if (completed_all) {
+                            break;
+                        }
+                    }
                 }
 
                 state->t_sample_us += ggml_time_us() - t_start_sample_us;
@@ -5577,9 +8286,15 @@ int whisper_full_with_state(
 
                     batch.n_tokens = 0;
 
-                    const int n_past = prompt.size() + i;
+                    // keep enough room in the KV cache for the greedy decoder - the speculation is only an optimization
+                    if (n_spec > 0 && whisper_kv_cache_n_free(state->kv_self) < (uint32_t) (n_decoders_cur + n_spec)*WHISPER_KV_PAD) {
+                        WHISPER_LOG_DEBUG("%s: KV cache is full, dropping the speculative decoders\n", __func__);
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        spec_drop(n_decoders_cur, n_spec);
+                        n_spec = 0;
+                    }
+
+                    for (int j = 0; j < n_decoders_cur + n_spec; ++j) {
                         auto & decoder = state->decoders[j];
 
                         if (decoder.failed || decoder.completed) {
@@ -5591,7 +8306,7 @@ int whisper_full_with_state(
                         decoder.i_batch = batch.n_tokens;
 
                         batch.token   [batch.n_tokens]    = decoder.sequence.tokens.back().id;
-                        batch.pos     [batch.n_tokens]    = n_past;
+                        batch.pos     [batch.n_tokens]    = prompt.size() + decoder.sequence.tokens.size() - 1;
                         batch.n_seq_id[batch.n_tokens]    = 1;
                         batch.seq_id  [batch.n_tokens][0] = j;
                         batch.logits  [batch.n_tokens]    = 1;
@@ -5605,9 +8320,21 @@ int whisper_full_with_state(
                         return -8;
                     }
 
+                    if (!ctx->aheads.empty()) {
+                        for (int j = 0; j < n_decoders_cur + n_spec; ++j) {
+                            auto & decoder = state->decoders[j];
+
+                            if (decoder.failed || decoder.completed) {
+                                continue;
+                            }
+
+                            decoder.aheads_row = whisper_aheads_push(*ctx, *state, decoder.i_batch);
+                        }
+                    }
+
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    // TODO: avoid memory allocations, optimize, avoid threads?
+                    // TODO: avoid memory allocations, optimize
                     {
                         std::atomic<int> j_cur(0);
 
@@ -5615,7 +8342,7 @@ int whisper_full_with_state(
                             while (true) {
                                 const int j = j_cur.fetch_add(1);
 
-                                if (j >= n_decoders_cur) {
+                                if (j >= n_decoders_cur + n_spec) {
                                     break;
                                 }
 
@@ -5625,85 +8352,96 @@ int whisper_full_with_state(
                                     continue;
                                 }
 
-                                whisper_process_logits(*ctx, *state, decoder, params, t_cur);
+                                whisper_process_logits(*ctx, *state, decoder, params, j < n_decoders_cur ? t_cur : t_spec);
                             }
                         };
 
-                        const int n_threads = std::min(params.n_threads, n_decoders_cur);
+                        whisper_parallel_run(*state, params.n_threads, std::min(params.n_threads, n_decoders_cur + n_spec), process);
+                    }
+
+                    // speculative fallback: when the running average log probability of the greedy decoder drops below
+                    // the threshold, start the decoders of the next temperature in the same batch instead of waiting
+                    // for the greedy decoder to finish
+                    if (spec_fallback && n_spec == 0 && it + 1 < (int) temperatures.size() && no_speech_prob <= params.no_speech_thold) {
+                        const float t_next = temperatures[it + 1];
 
-                        if (n_threads == 1) {
-                            process();
-                        } else {
-                            std::vector<std::thread> threads(n_threads - 1);
+                        const int n_next = t_next > 0.0f ? std::max(1, params.greedy.best_of) : 1;
 
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t] = std::thread(process);
-                            }
+                        // the next temperature must decode the same prompt
+                        const bool same_prompt = prompt_past.empty() || params.n_max_text_ctx <= 0 || (t_next < 0.5f) == (t_cur < 0.5f);
+
+                        bool low_logprob = same_prompt && n_decoders_cur + n_next <= n_decoders_alloc;
 
-                            process();
+                        for (int j = 0; j < n_decoders_cur && low_logprob; ++j) {
+                            const auto & decoder = state->decoders[j];
 
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t].join();
+                            if (decoder.failed || decoder.completed) {
+                                continue;
                             }
+
+                            const int n = decoder.sequence.tokens.size();
+
+                            low_logprob = n >= 8 && decoder.sequence.sum_logprobs_all/n < params.logprob_thold;
                         }
-                    }
 
-                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
-                }
-            }
+                        if (low_logprob) {
+                            WHISPER_LOG_DEBUG("%s: starting %d speculative decoders with temperature = %.2f at token %d\n", __func__, n_next, t_next, i);
 
-            // rank the resulting sequences and select the best one
-            {
-                double best_score = -INFINITY;
+                            n_spec = n_next;
+                            t_spec = t_next;
 
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+                            const int j0 = n_decoders_cur;
 
-                    if (decoder.failed) {
-                        continue;
-                    }
+                            for (int k = 0; k < n_spec; ++k) {
+                                auto & decoder = state->decoders[j0 + k];
 
-                    decoder.sequence.tokens.resize(decoder.sequence.result_len);
-                    whisper_sequence_score(params, decoder.sequence);
+                                decoder_reset(decoder);
 
-                    WHISPER_LOG_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
-                            __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
+                                // the slots before j0 + k that are taken by speculative decoders have their generator in rng_spec
+                                rng_spec[k] = decoder.rng;
+                                decoder.rng = k < j0 ? state->decoders[k].rng : rng_spec[k - j0];
 
-                    if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
-                        WHISPER_LOG_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
-                                __func__, j, decoder.sequence.entropy, params.entropy_thold);
+                                whisper_kv_cache_seq_cp(state->kv_self, WHISPER_SEQ_ID_PROMPT, j0 + k, -1, -1);
+                            }
 
-                        decoder.failed = true;
-                        state->n_fail_h++;
+                            // the speculative decoders start from the logits of the prompt
+                            const int i_prompt = state->logits.size()/whisper_n_vocab(ctx);
 
-                        continue;
-                    }
+                            state->logits.insert(state->logits.end(), logits_prompt.begin(), logits_prompt.end());
 
-                    if (best_score < decoder.sequence.score) {
-                        best_score = decoder.sequence.score;
-                        best_decoder_id = j;
-                    }
-                }
+                            state->decoders[j0].i_batch = i_prompt;
 
-                WHISPER_LOG_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
-            }
+                            whisper_process_logits(*ctx, *state, state->decoders[j0], params, t_spec);
 
-            bool success = true;
+                            for (int k = 1; k < n_spec; ++k) {
+                                auto & decoder = state->decoders[j0 + k];
 
-            // was the decoding successful for the current temperature?
-            // do fallback only if:
-            // - we are not at the last temperature
-            if (it != (int) temperatures.size() - 1) {
-                const auto & decoder = state->decoders[best_decoder_id];
+                                memcpy(decoder.probs.data(),    state->decoders[j0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
+                                memcpy(decoder.logits.data(),   state->decoders[j0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
+                                memcpy(decoder.logprobs.data(), state->decoders[j0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+                            }
+                        }
+                    }
 
-                if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
-                    WHISPER_LOG_DEBUG("%s: failed due to avg_logprobs %8.5f < %8.5f\n", __func__, decoder.sequence.avg_logprobs, params.logprob_thold);
-                    success = false;
-                    state->n_fail_p++;
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
                 }
             }
 
-            if (success) {
+            // the result was already accepted while the speculative decoders were running
+            if (spec_accepted) {
+                break;
+            }
+
+            // the window ended before the greedy decoder - the speculation is of no use anymore
+            if (n_spec > 0) {
+                spec_drop(n_decoders_cur, n_spec);
+                n_spec = 0;
+            }
+
+            // rank the resulting sequences and select the best one
+            best_decoder_id = decoders_rank(n_decoders_cur);
+
+            if (decoders_success(it, best_decoder_id)) {
                 //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
                 //    WHISPER_LOG_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
                 //}
@@ -5714,6 +8452,20 @@ int whisper_full_with_state(
             WHISPER_LOG_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
         }
 
+        // skip the window if it does not contain speech
+        if (no_speech_prob > params.no_speech_thold && state->decoders[best_decoder_id].sequence.avg_logprobs < params.logprob_thold) {
+            WHISPER_LOG_DEBUG("%s: no speech in the window (p = %.3f, avg_logprobs = %.3f), skipping\n",
+                    __func__, no_speech_prob, state->decoders[best_decoder_id].sequence.avg_logprobs);
+
+            seek += 100*WHISPER_CHUNK_SIZE;
+            continue;
+        }
+
+        // [EXPERIMENTAL] token-level timestamps of the result from the cross-attention of the alignment heads
+        if (!ctx->aheads.empty() && ctx->model.n_loaded > 0) {
+            whisper_dtw_token_timestamps(*ctx, *state, state->decoders[best_decoder_id].sequence, seek, std::min(seek_end - seek, 100*WHISPER_CHUNK_SIZE)/2);
+        }
+
         // output results through a user-provided callback
         {
             const auto & best_decoder = state->decoders[best_decoder_id];
@@ -5765,7 +8517,7 @@ int whisper_full_with_state(
 
                             if (params.print_realtime) {
                                 if (params.print_timestamps) {
-                                    printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+                                    printf("[%s --> %s]  %s\n", to_timestamp(skip_time(tt0, false)).c_str(), to_timestamp(skip_time(tt1, true)).c_str(), text.c_str());
                                 } else {
                                     printf("%s", text.c_str());
                                     fflush(stdout);
@@ -5782,13 +8534,16 @@ int whisper_full_with_state(
                             int n_new = 1;
 
                             if (params.token_timestamps) {
-                                whisper_exp_compute_token_level_timestamps(
-                                        *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+                                if (ctx->aheads.empty()) {
+                                    whisper_exp_compute_token_level_timestamps(
+                                            *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+                                }
 
                                 if (params.max_len > 0) {
                                     n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
                                 }
                             }
+                            skip_segments(n_new);
                             if (params.new_segment_callback) {
                                 params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
                             }
@@ -5810,52 +8565,179 @@ int whisper_full_with_state(
                     const auto tt0 = params.speed_up ? 2*t0 : t0;
                     const auto tt1 = params.speed_up ? 2*t1 : t1;
 
-                    if (params.print_realtime) {
-                        if (params.print_timestamps) {
-                            printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
-                        } else {
-                            printf("%s", text.c_str());
-                            fflush(stdout);
-                        }
-                    }
+                    if (params.print_realtime) {
+                        if (params.print_timestamps) {
+                            printf("[%s --> %s]  %s\n", to_timestamp(skip_time(tt0, false)).c_str(), to_timestamp(skip_time(tt1, true)).c_str(), text.c_str());
+                        } else {
+                            printf("%s", text.c_str());
+                            fflush(stdout);
+                        }
+                    }
+
+                    result_all.push_back({ tt0, tt1, text, {} , speaker_turn_next });
+                    for (int j = i0; j < (int) tokens_cur.size(); j++) {
+                        result_all.back().tokens.push_back(tokens_cur[j]);
+                    }
+
+                    int n_new = 1;
+
+                    if (params.token_timestamps) {
+                        if (ctx->aheads.empty()) {
+                            whisper_exp_compute_token_level_timestamps(
+                                    *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+                        }
+
+                        if (params.max_len > 0) {
+                            n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
+                        }
+                    }
+                    skip_segments(n_new);
+                    if (params.new_segment_callback) {
+                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                    }
+                }
+            }
+
+            // update audio window
+            seek += seek_delta;
+
+            WHISPER_LOG_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
+        }
+    }
+
+    return 0;
+}
+
+int whisper_full(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+}
+
+int whisper_full_multi(
+        struct whisper_context * ctx,
+          struct whisper_state ** states,
+const struct whisper_full_params * params,
+                           int   n_configs,
+                   const float * samples,
+                           int   n_samples) {
+    if (n_configs <= 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < n_configs; ++i) {
+        if (params[i].speed_up) {
+            WHISPER_LOG_ERROR("%s: speed_up is not supported\n", __func__);
+            return -1;
+        }
+
+        // the states share the encoded windows, so their spectrograms must be compacted in the same way
+        if (params[i].skip_silence       != params[0].skip_silence    ||
+            params[i].skip_silence_ms    != params[0].skip_silence_ms ||
+            params[i].skip_silence_thold != params[0].skip_silence_thold) {
+            WHISPER_LOG_ERROR("%s: all configurations must use the same skip_silence parameters\n", __func__);
+            return -1;
+        }
+    }
+
+    // compute the log mel spectrogram once and share it with all states
+    if (n_samples > 0) {
+        if (whisper_pcm_to_mel_with_state(ctx, states[0], samples, n_samples, params[0].n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
+    }
+
+    std::vector<float> energy;
+
+    for (int i = 0; i < n_configs; ++i) {
+        if (i > 0) {
+            states[i]->mel = states[0]->mel;
+            states[i]->kv_cross_seek = -1;
+        }
+
+        if (params[i].token_timestamps && n_samples > 0) {
+            if (energy.empty()) {
+                energy = get_signal_energy(samples, n_samples, 32);
+            }
+            states[i]->energy = energy;
+        }
+    }
+
+    whisper_encoder_cache cache;
+    cache.n_max = n_configs;
 
-                    result_all.push_back({ tt0, tt1, text, {} , speaker_turn_next });
-                    for (int j = i0; j < (int) tokens_cur.size(); j++) {
-                        result_all.back().tokens.push_back(tokens_cur[j]);
-                    }
+    for (int i = 0; i < n_configs; ++i) {
+        states[i]->encoder_cache = &cache;
+    }
 
-                    int n_new = 1;
+    std::vector<int> ret(n_configs, 0);
 
-                    if (params.token_timestamps) {
-                        whisper_exp_compute_token_level_timestamps(
-                                *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+    // the configurations progress concurrently, so that they need the same windows at about the same time
+    std::vector<std::thread> workers(n_configs - 1);
+    for (int i = 1; i < n_configs; ++i) {
+        workers[i - 1] = std::thread([&, i]() {
+            ret[i] = whisper_full_with_state(ctx, states[i], params[i], nullptr, 0);
+        });
+    }
 
-                        if (params.max_len > 0) {
-                            n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
-                        }
-                    }
-                    if (params.new_segment_callback) {
-                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
-                    }
-                }
-            }
+    ret[0] = whisper_full_with_state(ctx, states[0], params[0], nullptr, 0);
 
-            // update audio window
-            seek += seek_delta;
+    for (auto & worker : workers) {
+        worker.join();
+    }
 
-            WHISPER_LOG_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
+    for (int i = 0; i < n_configs; ++i) {
+        states[i]->encoder_cache = nullptr;
+    }
+
+    for (int i = 0; i < n_configs; ++i) {
+        if (ret[i] != 0) {
+            WHISPER_LOG_ERROR("%s: configuration %d failed with error %d\n", __func__, i, ret[i]);
+            return ret[i];
         }
     }
 
     return 0;
 }
 
-int whisper_full(
-        struct whisper_context * ctx,
-    struct whisper_full_params   params,
-                   const float * samples,
-                           int   n_samples) {
-    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+// the sample in [i0, i1) near i_split at the center of the window with the lowest signal energy
+// among equally quiet windows (e.g. digital silence) the one closest to i_split is used
+static int whisper_parallel_split_point(const float * samples, int i0, int i1, int i_split) {
+    const int n_search = (WHISPER_SAMPLE_RATE*WHISPER_PARALLEL_SPLIT_SEARCH_MS)/1000;
+    const int n_window = (WHISPER_SAMPLE_RATE*WHISPER_PARALLEL_SPLIT_WINDOW_MS)/1000;
+
+    const int a = std::max(i0, i_split - n_search);
+    const int b = std::min(i1, i_split + n_search);
+
+    if (b - a <= n_window) {
+        return i_split;
+    }
+
+    const auto energy = get_signal_energy(samples + a, b - a, 32);
+
+    double sum = 0.0;
+    for (int i = 0; i < n_window; ++i) {
+        sum += energy[i];
+    }
+
+    double sum_best = sum;
+    int    i_best   = a + n_window/2;
+
+    for (int i = n_window; i < b - a; ++i) {
+        sum += energy[i] - energy[i - n_window];
+
+        const int i_cur = a + i - n_window + 1 + n_window/2;
+
+        if (sum < sum_best || (sum == sum_best && std::abs(i_cur - i_split) < std::abs(i_best - i_split))) {
+            sum_best = sum;
+            i_best   = i_cur;
+        }
+    }
+
+    return i_best;
 }
 
 int whisper_full_parallel(
@@ -5864,27 +8746,58 @@ int whisper_full_parallel(
         const float * samples,
         int n_samples,
         int n_processors) {
-    if (n_processors == 1) {
+    if (n_processors == 1 || params.vad_split) {
         return whisper_full(ctx, params, samples, n_samples);
     }
     int ret = 0;
 
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
-
     const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
     const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
 
+    // split the audio in low-energy regions near the equal split points
+    // the chunk i covers the samples [splits[i] - overlap, splits[i + 1]) - the first chunk starts at the offset
+    std::vector<int> splits(n_processors + 1);
+    {
+        splits[0]            = offset_samples;
+        splits[n_processors] = n_samples;
+
+        const int n_margin = n_samples_per_processor/4;
+
+        for (int i = 1; i < n_processors; ++i) {
+            const int i_split = offset_samples + i*n_samples_per_processor;
+
+            splits[i] = whisper_parallel_split_point(samples, i_split - n_margin, i_split + n_margin, i_split);
+        }
+    }
+
+    const int n_overlap = (WHISPER_SAMPLE_RATE*WHISPER_PARALLEL_OVERLAP_MS)/1000;
+
+    std::vector<int> starts(n_processors);
+    for (int i = 0; i < n_processors; ++i) {
+        starts[i] = i == 0 ? 0 : std::max(splits[i - 1], splits[i] - n_overlap);
+    }
+
+    // the states of the other chunks are taken from the pool of the context
+    std::vector<whisper_state *> states;
+    for (int i = 0; i < n_processors - 1; ++i) {
+        whisper_state * state = whisper_state_pool_get(ctx);
+        if (state == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to initialize the state of chunk %d\n", __func__, i + 1);
+            for (auto * s : states) {
+                whisper_state_pool_put(ctx, s);
+            }
+            return -7;
+        }
+        states.push_back(state);
+    }
+
     // the calling thread will process the first chunk
     // while the other threads will process the remaining chunks
 
     std::vector<std::thread> workers(n_processors - 1);
     for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
-
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+        const int start_samples = starts[i + 1];
+        const int n_samples_cur = splits[i + 2] - start_samples;
 
         auto params_cur = params;
 
@@ -5908,23 +8821,38 @@ int whisper_full_parallel(
         params_cur.print_realtime = false;
 
         // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
+        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, splits[1]);
     }
 
     for (int i = 0; i < n_processors - 1; ++i) {
         workers[i].join();
     }
 
-    const int64_t offset_t = (int64_t) params.offset_ms/10.0;
+    const bool has_token_times = params.token_timestamps || !ctx->aheads.empty();
 
     // combine results into result_state->result_all from all other states
     for (int i = 0; i < n_processors - 1; ++i) {
         auto& results_i = states[i]->result_all;
 
+        // the segment timestamps of the chunk are relative to its start
+        const int64_t t_start = (100*(int64_t) starts[i + 1])/WHISPER_SAMPLE_RATE;
+        const int64_t t_split = (100*(int64_t) splits[i + 1])/WHISPER_SAMPLE_RATE;
+
         for (auto& result : results_i) {
-            // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+            result.t0 += t_start;
+            result.t1 += t_start;
+
+            // the segments in the overlap have already been transcribed by the previous chunk
+            if (result.t0 + result.t1 < 2*t_split) {
+                continue;
+            }
+
+            if (has_token_times) {
+                for (auto & token : result.tokens) {
+                    token.t0 += t_start;
+                    token.t1 += t_start;
+                }
+            }
 
             // make sure that segments are not overlapping
             if (!ctx->state->result_all.empty()) {
@@ -5939,6 +8867,8 @@ int whisper_full_parallel(
             }
         }
 
+        results_i.clear();
+
         ctx->state->t_mel_us += states[i]->t_mel_us;
 
         ctx->state->t_sample_us += states[i]->t_sample_us;
@@ -5953,7 +8883,7 @@ int whisper_full_parallel(
         ctx->state->n_batchd += states[i]->n_batchd;
         ctx->state->n_prompt += states[i]->n_prompt;
 
-        whisper_free_state(states[i]);
+        whisper_state_pool_put(ctx, states[i]);
     }
 
     // average the timings
@@ -5963,16 +8893,334 @@ int whisper_full_parallel(
     ctx->state->t_decode_us /= n_processors;
 
     // print information about the audio boundaries
-    WHISPER_LOG_WARN("\n");
-    WHISPER_LOG_WARN("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        WHISPER_LOG_WARN("%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
+    WHISPER_LOG_INFO("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
+    for (int i = 1; i < n_processors; ++i) {
+        WHISPER_LOG_INFO("%s: split %d - %s\n", __func__, i, to_timestamp((100*(int64_t) splits[i])/WHISPER_SAMPLE_RATE).c_str());
     }
-    WHISPER_LOG_WARN("%s: the transcription quality may be degraded near these boundaries\n", __func__);
 
     return ret;
 }
 
+int whisper_align_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples,
+                    const char * text) {
+    // clear old results
+    auto & result_all = state->result_all;
+
+    result_all.clear();
+
+    if (text == nullptr) {
+        WHISPER_LOG_ERROR("%s: no transcript to align\n", __func__);
+        return -1;
+    }
+
+    if (n_samples > 0) {
+        // compute log mel spectrogram
+        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
+    }
+
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = params.audio_ctx;
+
+    // auto-detect language if not specified
+    if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0) {
+        std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+
+        // same as whisper_full_with_state(): the audio context of the first window when there is no offset
+        if (params.audio_ctx_auto && params.audio_ctx == 0) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_auto(*ctx, params.duration_ms == 0 ? whisper_n_len_from_state(state) : params.duration_ms/10);
+        }
+
+        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
+        if (lang_id < 0) {
+            WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
+            return -3;
+        }
+        state->lang_id = lang_id;
+        params.language = whisper_lang_str(lang_id);
+
+        WHISPER_LOG_INFO("%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
+    }
+
+    state->t_beg    = 0;
+    state->t_last   = 0;
+    state->tid_last = 0;
+    if (n_samples > 0) {
+        state->energy = get_signal_energy(samples, n_samples, 32);
+    }
+
+    const int seek_start = params.offset_ms/10;
+    const int seek_end = params.duration_ms == 0 ? whisper_n_len_from_state(state) : seek_start + params.duration_ms/10;
+
+    if (seek_end < seek_start + 100) {
+        WHISPER_LOG_DEBUG("%s: input is too short - %d ms < 1000 ms\n", __func__, (seek_end - seek_start)*10);
+        return 0;
+    }
+
+    // the transcript with collapsed whitespace, starting with a space like the decoded text
+    std::vector<whisper_token> tokens;
+    {
+        std::string transcript = " ";
+        for (const char * c = text; *c; ++c) {
+            if (isspace((unsigned char) *c)) {
+                if (transcript.back() != ' ') {
+                    transcript += ' ';
+                }
+            } else {
+                transcript += *c;
+            }
+        }
+        while (transcript.size() > 1 && transcript.back() == ' ') {
+            transcript.pop_back();
+        }
+
+        if (transcript.size() > 1) {
+            tokens = tokenize(ctx->vocab, transcript);
+        }
+    }
+
+    if (tokens.empty()) {
+        return 0;
+    }
+
+    const whisper_token token_beg = whisper_token_beg(ctx);
+
+    // sot, language and task tokens, followed by the forced <|0.00|> timestamp
+    std::vector<whisper_token> prompt = { whisper_token_sot(ctx), };
+
+    if (whisper_is_multilingual(ctx)) {
+        const int lang_id = whisper_lang_id(params.language);
+        state->lang_id = lang_id;
+        prompt.push_back(whisper_token_lang(ctx, lang_id));
+        prompt.push_back(whisper_token_transcribe(ctx));
+    }
+
+    prompt.push_back(token_beg);
+
+    const int n_prompt = prompt.size();
+    const int n_vocab  = whisper_n_vocab(ctx);
+
+    // the logits of the last prompt token and of all forced tokens are computed in the same decoder pass
+    const int n_force_max = whisper_n_text_ctx(ctx)/2 - 1;
+
+    whisper_reserve_outputs(*ctx, *state, n_force_max + 1);
+
+    std::vector<whisper_token> batch_tokens;
+    batch_tokens.reserve(n_prompt + n_force_max);
+
+    std::vector<float> logprobs(n_vocab);
+    std::vector<float> probs   (n_vocab);
+
+    // tids[k] - the most likely timestamp before the forced token k, i.e. where the token starts
+    std::vector<whisper_token> tids;
+
+    whisper_sequence sequence;
+
+    int seek  = seek_start;
+    int i_tok = 0;
+
+    while (i_tok < (int) tokens.size()) {
+        if (params.progress_callback) {
+            const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
+
+            params.progress_callback(
+                ctx, state, progress_cur, params.progress_callback_user_data);
+        }
+
+        // if only 1 second left, then stop
+        if (seek + 100 >= seek_end) {
+            break;
+        }
+
+        if (params.encoder_begin_callback) {
+            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
+                WHISPER_LOG_ERROR("%s: encoder_begin_callback returned false - aborting\n", __func__);
+                break;
+            }
+        }
+
+        if (params.audio_ctx_auto && params.audio_ctx == 0) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_auto(*ctx, seek_end - seek);
+        }
+
+        // encode audio features starting at offset seek
+        if (!whisper_encode_cached(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+            WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+            return -6;
+        }
+
+        const int  n_window = std::min(seek_end - seek, 100*WHISPER_CHUNK_SIZE);
+        const bool is_last  = seek + 100*WHISPER_CHUNK_SIZE >= seek_end;
+
+        const int n_left  = tokens.size() - i_tok;
+        const int n_force = std::min(n_left, n_force_max);
+
+        // teacher-forced decoding of the remaining transcript in a single pass
+        {
+            batch_tokens = prompt;
+            batch_tokens.insert(batch_tokens.end(), tokens.begin() + i_tok, tokens.begin() + i_tok + n_force);
+
+            whisper_kv_cache_clear(state->kv_self);
+
+            whisper_batch_prep_legacy(state->batch, batch_tokens.data(), batch_tokens.size(), 0, 0);
+
+            for (int i = n_prompt - 1; i < state->batch.n_tokens; ++i) {
+                state->batch.logits[i] = 1;
+            }
+
+            if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+                WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                return -8;
+            }
+        }
+
+        // the probabilities of the forced tokens and the timestamps that the model predicts before them
+        // the timestamps are not allowed to decrease
+        // the sequence starts with the forced <|0.00|>, like the segments of whisper_full() start with a timestamp
+        {
+            const int64_t t_start_sample_us = ggml_time_us();
+
+            sequence.tokens.clear();
+            sequence.tokens.push_back({ token_beg, token_beg, 1.0f, 0.0f, 1.0f, 1.0f, -1, -1, 0.0f });
+
+            tids.clear();
+
+            whisper_token tid_prev = token_beg;
+
+            for (int k = 0; k <= n_force; ++k) {
+                const float * logits = state->logits.data() + (n_prompt - 1 + k)*n_vocab;
+
+                float max_text_logprob;
+                whisper_log_softmax(logits, logprobs.data(), probs.data(), n_vocab, token_beg, max_text_logprob);
+
+                double sum_ts = 0.0;
+                double max_ts = 0.0;
+
+                whisper_token tid = tid_prev;
+
+                for (int i = token_beg; i < n_vocab; ++i) {
+                    sum_ts += probs[i];
+                    if (i >= tid_prev && max_ts < probs[i]) {
+                        max_ts = probs[i];
+                        tid = i;
+                    }
+                }
+
+                tids.push_back(tid);
+                tid_prev = tid;
+
+                if (k < n_force) {
+                    const whisper_token id = tokens[i_tok + k];
+
+                    sequence.tokens.push_back({ id, tid, probs[id], logprobs[id], (float) (max_ts/(sum_ts + 1e-10)), (float) sum_ts, -1, -1, 0.0f });
+                }
+            }
+
+            state->t_sample_us += ggml_time_us() - t_start_sample_us;
+        }
+
+        // the number of tokens that belong to this window and the audio that they cover
+        // the tokens predicted to start in the last second of the window are left for the next one, which
+        // starts at the first word that is left out
+        int n_keep     = n_force;
+        int seek_delta = n_window;
+
+        if (!is_last) {
+            n_keep = 0;
+            while (n_keep < n_force && 2*(tids[n_keep] - token_beg) < n_window - 100) {
+                n_keep++;
+            }
+        }
+
+        while (n_keep > 0 && n_keep < n_left && ctx->vocab.id_to_token.at(tokens[i_tok + n_keep])[0] != ' ') {
+            n_keep--;
+        }
+
+        if (n_keep < n_left) {
+            seek_delta = std::max(100, std::min(n_window, 2*(tids[n_keep] - token_beg)));
+        }
+
+        if (n_keep > 0) {
+            sequence.tokens.resize(1 + n_keep);
+
+            if (!ctx->aheads.empty()) {
+                // the output k is the row of the forced token k, the row of the token after the last one marks its end
+                state->aheads_rows.clear();
+                sequence.aheads.assign(1, -1);
+                for (int k = 0; k <= n_keep; ++k) {
+                    sequence.aheads.push_back(whisper_aheads_push(*ctx, *state, k));
+                }
+
+                whisper_dtw_token_timestamps(*ctx, *state, sequence, seek, seek_delta/2);
+            }
+
+            std::string text;
+            for (const auto & token : sequence.tokens) {
+                if (params.print_special || token.id < whisper_token_eot(ctx)) {
+                    text += whisper_token_to_str(ctx, token.id);
+                }
+            }
+
+            result_all.push_back({ seek, seek + seek_delta, text, sequence.tokens, false });
+
+            if (ctx->aheads.empty()) {
+                whisper_exp_compute_token_level_timestamps(
+                        *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+            }
+
+            if (params.print_realtime) {
+                if (params.print_timestamps) {
+                    printf("[%s --> %s]  %s\n", to_timestamp(seek).c_str(), to_timestamp(seek + seek_delta).c_str(), text.c_str());
+                } else {
+                    printf("%s", text.c_str());
+                    fflush(stdout);
+                }
+            }
+
+            int n_new = 1;
+
+            if (params.max_len > 0) {
+                n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
+            }
+
+            if (params.new_segment_callback) {
+                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+            }
+        }
+
+        i_tok += n_keep;
+        seek  += seek_delta;
+
+        WHISPER_LOG_DEBUG("%s: seek = %d, seek_delta = %d, aligned %d / %d tokens\n", __func__, seek, seek_delta, i_tok, (int) tokens.size());
+    }
+
+    if (i_tok < (int) tokens.size()) {
+        WHISPER_LOG_WARN("%s: the audio ended before the transcript - %d tokens could not be aligned\n", __func__, (int) tokens.size() - i_tok);
+    }
+
+    return 0;
+}
+
+int whisper_align(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples,
+                    const char * text) {
+    return whisper_align_with_state(ctx, ctx->state, params, samples, n_samples, text);
+}
+
 int whisper_full_n_segments_from_state(struct whisper_state * state) {
     return state->result_all.size();
 }
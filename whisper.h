@@ -84,8 +84,50 @@ extern "C" {
     typedef int32_t whisper_token;
     typedef int32_t whisper_seq_id;
 
+    // the cross-attention heads of the text decoder that follow the time alignment of the text to the audio
+    // ref: https://github.com/openai/whisper/blob/ba3f3cd54b0e5b8ce1ab3de13e32122d0d5f98ab/whisper/__init__.py#L44-L60
+    enum whisper_alignment_heads_preset {
+        WHISPER_AHEADS_NONE,
+        WHISPER_AHEADS_N_TOP_MOST,  // all heads of the dtw_n_top top-most text layers
+        WHISPER_AHEADS_CUSTOM,      // the heads in dtw_aheads
+        WHISPER_AHEADS_TINY_EN,
+        WHISPER_AHEADS_TINY,
+        WHISPER_AHEADS_BASE_EN,
+        WHISPER_AHEADS_BASE,
+        WHISPER_AHEADS_SMALL_EN,
+        WHISPER_AHEADS_SMALL,
+        WHISPER_AHEADS_MEDIUM_EN,
+        WHISPER_AHEADS_MEDIUM,
+        WHISPER_AHEADS_LARGE_V1,
+        WHISPER_AHEADS_LARGE_V2,
+        WHISPER_AHEADS_LARGE_V3,
+    };
+
+    typedef struct whisper_ahead {
+        int n_text_layer;
+        int n_head;
+    } whisper_ahead;
+
+    typedef struct whisper_aheads {
+        size_t n_heads;
+        const whisper_ahead * heads;
+    } whisper_aheads;
+
     struct whisper_context_params {
         bool  use_gpu;
+
+        // how long (in microseconds) the idle compute threads of a state busy-wait for new work before they sleep
+        // larger values lower the latency of the per-token graph computations, at the cost of idle CPU time
+        int threadpool_spin_us;
+
+        // [EXPERIMENTAL] token-level timestamps with dynamic time warping over the cross-attention weights of the
+        // alignment heads - the weights are output by the decoder graph, so no additional decoding pass is needed
+        // when enabled, whisper_full() sets the t0 and t1 of the tokens (in units of 10 ms)
+        bool dtw_token_timestamps;
+        enum whisper_alignment_heads_preset dtw_aheads_preset;
+
+        int dtw_n_top;                    // for WHISPER_AHEADS_N_TOP_MOST, <= 0 for the top half of the layers
+        struct whisper_aheads dtw_aheads; // for WHISPER_AHEADS_CUSTOM
     };
 
     typedef struct whisper_token_data {
@@ -98,7 +140,7 @@ extern "C" {
         float ptsum;       // sum of probabilities of all timestamp tokens
 
         // token-level timestamp data
-        // do not use if you haven't computed token-level timestamps
+        // do not use if you haven't computed token-level timestamps (token_timestamps or dtw_token_timestamps)
         int64_t t0;        // start time of the token
         int64_t t1;        //   end time of the token
 
@@ -292,6 +334,42 @@ extern "C" {
                                int   n_past,
                                int   n_threads);
 
+    // Run the decoder for several independent states in a single batched graph.
+    // State i decodes tokens[i] + n_tokens[i] after n_past[i] tokens, with cross-attention to its own encoded audio.
+    // The decoder weights are read once for all states, so decoding the steps of concurrent transcriptions
+    // together is much cheaper than separate whisper_decode_with_state() calls.
+    // The states can join and leave freely between calls. The states must be distinct and their audio already encoded.
+    // Up to 8 states with at most 8 tokens each share a graph, longer batches (prompts) are decoded separately.
+    // The graph and its compute buffer belong to the context, so concurrent calls are serialized.
+    // The logits of the last token of each state are obtained with whisper_get_logits_from_state(), with the
+    // vocabulary subset of the state applied (see whisper_set_vocab_subset()).
+    // Returns 0 on success
+    WHISPER_API int whisper_decode_batch(
+            struct whisper_context * ctx,
+             struct whisper_state ** states,
+              const whisper_token ** tokens,
+                         const int * n_tokens,
+                         const int * n_past,
+                               int   n_states,
+                               int   n_threads);
+
+    // Restrict the decoder output projection to a subset of the vocabulary.
+    // Only the logits of the provided tokens and of the special and timestamp tokens are computed,
+    // the logits of all other tokens are set to -INFINITY.
+    // Useful when the tokens that can be sampled are known in advance (e.g. grammar or command lists).
+    // Pass tokens == NULL or n_tokens == 0 to compute the logits for the whole vocabulary again.
+    // Returns 0 on success
+    WHISPER_API int whisper_set_vocab_subset(
+            struct whisper_context * ctx,
+               const whisper_token * tokens,
+                               int   n_tokens);
+
+    WHISPER_API int whisper_set_vocab_subset_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+               const whisper_token * tokens,
+                               int   n_tokens);
+
     // Convert the provided text into tokens.
     // The tokens pointer must be large enough to hold the resulting tokens.
     // Returns the number of tokens on success, no more than n_max_tokens
@@ -337,6 +415,35 @@ extern "C" {
                                int   n_threads,
                              float * lang_probs);
 
+    // Detect the spoken language of several clips at once, e.g. to route them before transcription
+    // The clips of similar length are encoded together in a single batched graph, followed by the SOT token of every
+    // clip. The clips of a batch are encoded with an audio_ctx reduced to the length of the longest one (only the first
+    // 30 s of a clip are used)
+    // The mel spectrograms of the clips are not stored in the state
+    // If not null, lang_ids[i] is set to the top language id of clip i
+    // If not null, lang_probs is filled with the probabilities of all languages of each clip
+    // The array must be n_clips*(whisper_lang_max_id() + 1) in size, clip i starts at i*(whisper_lang_max_id() + 1)
+    // Note: the reduced audio_ctx can be less accurate than whisper_lang_auto_detect() for some clips
+    // Returns 0 on success
+    WHISPER_API int whisper_lang_detect_batch(
+            struct whisper_context * ctx,
+                      const float ** samples,
+                         const int * n_samples,
+                               int   n_clips,
+                               int   n_threads,
+                               int * lang_ids,
+                             float * lang_probs);
+
+    WHISPER_API int whisper_lang_detect_batch_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                      const float ** samples,
+                         const int * n_samples,
+                               int   n_clips,
+                               int   n_threads,
+                               int * lang_ids,
+                             float * lang_probs);
+
     WHISPER_API int whisper_n_len           (struct whisper_context * ctx); // mel length
     WHISPER_API int whisper_n_len_from_state(struct whisper_state * state); // mel length
     WHISPER_API int whisper_n_vocab         (struct whisper_context * ctx);
@@ -460,10 +567,26 @@ extern "C" {
         bool speed_up;          // speed-up the audio by 2x using Phase Vocoder
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        bool audio_ctx_auto;    // if audio_ctx == 0, size the audio context of each window from the length of the audio left
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
 
+        // [EXPERIMENTAL] long-form transcription over speech regions
+        // the audio is split at the pauses found by an energy-based VAD into independent regions of at most 30 s and
+        // vad_n_parallel regions are transcribed at the same time, each with its own state (see whisper_full_parallel)
+        bool  vad_split;
+        int   vad_n_parallel;   // number of regions transcribed at the same time
+        float vad_thold;        // a 10 ms frame is speech if its smoothed energy is above vad_thold times the mean energy
+
+        // [EXPERIMENTAL] skip the long silences before running the encoder
+        // the stretches of at least skip_silence_ms in which the energy of the spectrogram stays below skip_silence_thold
+        // times its mean energy are removed from the spectrogram of the state, keeping 1 s of silence on each side
+        // the timestamps of the results are mapped back to the original audio
+        bool  skip_silence;
+        int   skip_silence_ms;    // min length of a removed stretch
+        float skip_silence_thold;
+
         // tokens to provide to the whisper decoder as initial prompt
         // these are prepended to any existing text context from a previous call
         const char * initial_prompt;
@@ -487,7 +610,13 @@ extern "C" {
         float temperature_inc;
         float entropy_thold;    // similar to OpenAI's "compression_ratio_threshold"
         float logprob_thold;
-        float no_speech_thold;  // TODO: not implemented
+        float no_speech_thold;  // skip the window if the no-speech probability is above this and the avg logprob is below logprob_thold
+        int   repetition_max_period; // fail a decoder as soon as its last 32 text tokens repeat with a period of at most
+                                     // this many tokens, instead of waiting for the entropy check (max 10, 0 = disabled)
+
+        // greedy only: start decoding with the next temperature in the same batch as soon as the running avg logprob
+        // of the current decoder drops below logprob_thold, instead of after it has finished
+        bool fallback_speculative;
 
         struct {
             int best_of;    // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L264
@@ -547,11 +676,28 @@ extern "C" {
                            const float * samples,
                                    int   n_samples);
 
+    // Transcribe the same audio with several sets of parameters (e.g. different prompts, beam sizes or tasks)
+    // The log mel spectrogram is computed once and each audio window is encoded only once - the configurations
+    // that reach the same window reuse the cross-attention KV cache computed by the first one
+    // The configurations run concurrently, each on its own thread with params[i].n_threads threads
+    // The results of configuration i are stored in states[i]. The states must be distinct
+    // Returns 0 on success, or the error of the first failed configuration
+    WHISPER_API int whisper_full_multi(
+                struct whisper_context * ctx,
+                 struct whisper_state ** states,
+      const struct whisper_full_params * params,
+                                   int   n_configs,
+                           const float * samples,
+                                   int   n_samples);
+
     // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
+    // The audio is split at the quietest point within 5 s of the equal split points and each chunk after the first one
+    // starts 0.5 s before its split point - the segments in this overlap are dropped when merging the results
     // Result is stored in the default state of the context
+    // The states of the other chunks are kept by the context and reused by the next call
     // Not thread safe if executed in parallel on the same context.
     // It seems this approach can offer some speedup in some cases.
-    // However, the transcription accuracy can be worse at the beginning and end of each chunk.
+    // However, the transcription accuracy can still be worse near the split points if there is no pause in the speech.
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -559,6 +705,28 @@ extern "C" {
                                    int   n_samples,
                                    int   n_processors);
 
+    // Align a known transcript to the audio, without transcribing it
+    // The tokens of the transcript are teacher-forced, so each audio window takes a single decoder pass instead
+    // of one pass per token. The results are stored as segments, like the ones of whisper_full(), with the
+    // probabilities of the tokens and their timestamps t0 and t1 - from the cross-attention of the alignment
+    // heads when dtw_token_timestamps is enabled, otherwise from the timestamp tokens
+    // Uses the language, n_threads, offset_ms, duration_ms, audio_ctx, print_special, print_realtime, print_timestamps,
+    // max_len, split_on_word, thold_pt, thold_ptsum and callbacks of params
+    WHISPER_API int whisper_align(
+                struct whisper_context * ctx,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples,
+                            const char * text);
+
+    WHISPER_API int whisper_align_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples,
+                            const char * text);
+
     // Number of generated text segments
     // A segment can be a few words, a sentence, or even a paragraph.
     WHISPER_API int whisper_full_n_segments           (struct whisper_context * ctx);